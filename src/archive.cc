@@ -0,0 +1,255 @@
+#include "archive.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+static const auto memory_dir = std::filesystem::path{"/dev/shm"};
+static const string memory_prefix = "vad-dealias-";
+
+memory_file::memory_file(string const& name)
+  : name_{name}
+{
+  if (!std::filesystem::is_directory(memory_dir))
+    throw std::runtime_error("no /dev/shm to hold " + name + " in memory");
+  auto pattern = (memory_dir / (memory_prefix + std::to_string(getpid()) + "-XXXXXX-" + name)).string();
+  fd_ = mkstemps(pattern.data(), name.size() + 1);
+  if (fd_ < 0)
+    throw std::runtime_error("unable to create memory file for " + name);
+  path_ = pattern;
+}
+
+memory_file::memory_file(string const& name, const void* data, size_t size)
+  : memory_file{name}
+{
+  append(data, size);
+}
+
+memory_file::~memory_file(){
+  close(fd_);
+  std::filesystem::remove(path_);
+}
+
+auto memory_file::append(const void* data, size_t size) -> void{
+  auto ptr = static_cast<const char*>(data);
+  while (size > 0){
+    auto n = ::write(fd_, ptr, size);
+    if (n < 0)
+      throw std::runtime_error("unable to write memory file for " + name_);
+    ptr += n;
+    size -= n;
+  }
+}
+
+auto remove_stale_memory_files() -> size_t{
+  size_t count = 0;
+  std::error_code ec;
+  for (auto const& entry : std::filesystem::directory_iterator{memory_dir, ec}){
+    // vad-dealias-<pid>-XXXXXX-<name>, of a process that no longer exists.
+    const auto name = entry.path().filename().string();
+    if (name.compare(0, memory_prefix.size(), memory_prefix) != 0)
+      continue;
+    char* end;
+    const auto pid = std::strtol(name.c_str() + memory_prefix.size(), &end, 10);
+    if (*end != '-' || pid <= 0 || kill(pid_t(pid), 0) == 0 || errno != ESRCH)
+      continue;
+    if (std::filesystem::remove(entry.path(), ec)){
+      trace::warning("removed {}, left behind by process {}", entry.path().string(), pid);
+      ++count;
+    }
+  }
+  return count;
+}
+
+// Little endian fields of the zip records.
+template <typename T>
+static auto field(const unsigned char* p) -> T{
+  T v = 0;
+  for (size_t i = 0; i < sizeof(T); ++i)
+    v |= T(p[i]) << (8 * i);
+  return v;
+}
+
+static auto read_at(std::ifstream& file, uint64_t offset, size_t size) -> vector<unsigned char>{
+  vector<unsigned char> buf(size);
+  file.seekg(offset);
+  file.read(reinterpret_cast<char*>(buf.data()), size);
+  if (!file)
+    throw std::runtime_error("truncated zip archive");
+  return buf;
+}
+
+zip_archive::zip_archive(std::filesystem::path const& path)
+  : path_{path}
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("unable to open archive " + path.string());
+
+  // End of central directory record, followed by a comment of up to 64k.
+  const uint64_t length = std::filesystem::file_size(path);
+  if (length < 22)
+    throw std::runtime_error("not a zip archive " + path.string());
+  const auto tail_size = std::min<uint64_t>(length, 22 + 65535);
+  const auto tail = read_at(file, length - tail_size, tail_size);
+  size_t eocd = tail_size;
+  for (size_t i = tail_size - 22 + 1; i-- > 0; )
+    if (field<uint32_t>(&tail[i]) == 0x06054b50){
+      eocd = i;
+      break;
+    }
+  if (eocd == tail_size)
+    throw std::runtime_error("not a zip archive " + path.string());
+
+  uint64_t count = field<uint16_t>(&tail[eocd + 10]);
+  uint64_t dir_size = field<uint32_t>(&tail[eocd + 12]);
+  uint64_t dir_offset = field<uint32_t>(&tail[eocd + 16]);
+
+  // Zip64 end of central directory, found through its locator.
+  if (eocd >= 20 && field<uint32_t>(&tail[eocd - 20]) == 0x07064b50){
+    const auto rec = read_at(file, field<uint64_t>(&tail[eocd - 12]), 56);
+    if (field<uint32_t>(&rec[0]) != 0x06064b50)
+      throw std::runtime_error("corrupt zip64 archive " + path.string());
+    count = field<uint64_t>(&rec[32]);
+    dir_size = field<uint64_t>(&rec[40]);
+    dir_offset = field<uint64_t>(&rec[48]);
+  }
+
+  if (dir_offset > length || dir_size > length - dir_offset)
+    throw std::runtime_error("corrupt zip directory in " + path.string());
+  const auto dir = read_at(file, dir_offset, dir_size);
+  members_.reserve(std::min<uint64_t>(count, dir.size() / 46));
+  for (size_t pos = 0; pos + 46 <= dir.size() && members_.size() < count; ){
+    const auto p = &dir[pos];
+    if (field<uint32_t>(p) != 0x02014b50)
+      throw std::runtime_error("corrupt zip directory in " + path.string());
+
+    member m;
+    m.method = field<uint16_t>(p + 10);
+    m.crc = field<uint32_t>(p + 16);
+    m.compressed = field<uint32_t>(p + 20);
+    m.size = field<uint32_t>(p + 24);
+    m.offset = field<uint32_t>(p + 42);
+    const auto name_len = field<uint16_t>(p + 28);
+    const auto extra_len = field<uint16_t>(p + 30);
+    const auto comment_len = field<uint16_t>(p + 32);
+    if (pos + 46 + name_len + extra_len + comment_len > dir.size())
+      throw std::runtime_error("corrupt zip directory in " + path.string());
+    m.name.assign(reinterpret_cast<const char*>(p + 46), name_len);
+
+    // Sizes and offset too large for 32 bits are in the zip64 extra field.
+    const auto extra_end = p + 46 + name_len + extra_len;
+    for (auto e = p + 46 + name_len; e + 4 <= extra_end; ){
+      const auto id = field<uint16_t>(e);
+      const auto len = field<uint16_t>(e + 2);
+      if (e + 4 + len > extra_end)
+        throw std::runtime_error("corrupt zip extra field in " + path.string());
+      if (id == 0x0001){
+        auto v = e + 4;
+        const auto end = v + len;
+        auto wide = [&](uint64_t& value){
+          if (value != 0xffffffff)
+            return;
+          if (v + 8 > end)
+            throw std::runtime_error("corrupt zip64 extra field in " + path.string());
+          value = field<uint64_t>(v);
+          v += 8;
+        };
+        wide(m.size);
+        wide(m.compressed);
+        wide(m.offset);
+      }
+      e += 4 + len;
+    }
+
+    if (!m.name.empty() && m.name.back() != '/')
+      members_.push_back(std::move(m));
+    pos += 46 + name_len + extra_len + comment_len;
+  }
+}
+
+auto zip_archive::find(string const& name) const -> member const*{
+  for (auto const& m : members_)
+    if (m.name == name)
+      return &m;
+  return nullptr;
+}
+
+auto zip_archive::extract(member const& m) const -> std::unique_ptr<memory_file>{
+  if (m.method != 0 && m.method != 8)
+    throw std::runtime_error("unsupported compression of " + m.name + " in " + path_.string());
+
+  std::ifstream file(path_, std::ios::binary);
+  const auto local = read_at(file, m.offset, 30);
+  if (field<uint32_t>(&local[0]) != 0x04034b50)
+    throw std::runtime_error("corrupt zip member " + m.name + " in " + path_.string());
+  file.seekg(m.offset + 30 + field<uint16_t>(&local[26]) + field<uint16_t>(&local[28]));
+
+  auto out = std::make_unique<memory_file>(std::filesystem::path(m.name).filename().string());
+  constexpr size_t block = 1 << 18;
+  vector<unsigned char> in(block), inflated(4 * block);
+  uLong crc = crc32(0, nullptr, 0);
+  uint64_t remaining = m.compressed, written = 0;
+
+  z_stream zs{};
+  if (m.method == 8 && inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+    throw std::runtime_error("unable to initialise inflate");
+
+  int status = Z_OK;
+  while (remaining > 0 && status != Z_STREAM_END){
+    const auto n = std::min<uint64_t>(remaining, block);
+    file.read(reinterpret_cast<char*>(in.data()), n);
+    if (!file){
+      if (m.method == 8)
+        inflateEnd(&zs);
+      throw std::runtime_error("truncated zip member " + m.name + " in " + path_.string());
+    }
+    remaining -= n;
+
+    if (m.method == 0){
+      crc = crc32(crc, in.data(), n);
+      out->append(in.data(), n);
+      written += n;
+      continue;
+    }
+
+    zs.next_in = in.data();
+    zs.avail_in = n;
+    do {
+      zs.next_out = inflated.data();
+      zs.avail_out = inflated.size();
+      status = inflate(&zs, Z_NO_FLUSH);
+      if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR){
+        inflateEnd(&zs);
+        throw std::runtime_error("corrupt data in zip member " + m.name + " in " + path_.string());
+      }
+      const auto produced = inflated.size() - zs.avail_out;
+      crc = crc32(crc, inflated.data(), produced);
+      out->append(inflated.data(), produced);
+      written += produced;
+    } while (zs.avail_out == 0 && status != Z_STREAM_END);
+  }
+  if (m.method == 8)
+    inflateEnd(&zs);
+
+  if (written != m.size || crc != m.crc)
+    throw std::runtime_error("checksum mismatch for zip member " + m.name + " in " + path_.string());
+  return out;
+}
+
+auto open_input(string const& spec, std::unique_ptr<memory_file>& holder) -> std::filesystem::path{
+  const auto pos = spec.find(".zip:");
+  if (pos == string::npos)
+    return spec;
+
+  const auto archive = zip_archive{spec.substr(0, pos + 4)};
+  const auto name = spec.substr(pos + 5);
+  auto m = archive.find(name);
+  if (!m)
+    throw std::runtime_error("no member " + name + " in " + archive.path().string());
+  holder = archive.extract(*m);
+  return holder->path();
+}
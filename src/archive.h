@@ -0,0 +1,73 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "pch.h"
+
+#include <memory>
+
+using namespace bom;
+
+// Volumes held in memory rather than on disk. bom opens ODIM files by path
+// only, so neither the HDF5 file image driver nor an unlinked file can be
+// used, and HDF5 resolves the /proc/self/fd links of anonymous memory
+// files. A buffer is exposed as a file on tmpfs (/dev/shm) instead, removed
+// again when the memory_file goes. Without /dev/shm it throws rather than
+// going through a disk. The file names carry the pid of their process, see
+// remove_stale_memory_files.
+class memory_file{
+public:
+  explicit memory_file(string const& name);
+  memory_file(string const& name, const void* data, size_t size);
+  ~memory_file();
+
+  memory_file(memory_file const&) = delete;
+  auto operator=(memory_file const&) -> memory_file& = delete;
+
+  auto append(const void* data, size_t size) -> void;
+  auto name() const -> string const& { return name_; }
+  auto path() const -> std::filesystem::path const& { return path_; }
+
+private:
+  string name_;
+  std::filesystem::path path_;
+  int fd_;
+};
+
+// Removes the memory files left in /dev/shm by processes that are gone,
+// such as a worker killed while holding a volume. Returns their number.
+auto remove_stale_memory_files() -> size_t;
+
+// Members of a zip archive, such as the daily <site>_<date>.pvol.zip files,
+// inflated one at a time straight into memory. Stored and deflated members
+// are supported, with zip64 archives.
+class zip_archive{
+public:
+  struct member{
+    string   name;
+    uint16_t method;
+    uint32_t crc;
+    uint64_t compressed;
+    uint64_t size;
+    uint64_t offset; // of the local header
+  };
+
+  explicit zip_archive(std::filesystem::path const& path);
+
+  auto path() const -> std::filesystem::path const& { return path_; }
+  auto members() const -> vector<member> const& { return members_; }
+  auto find(string const& name) const -> member const*;
+
+  // Streaming inflate of a member, checked against its CRC.
+  auto extract(member const& m) const -> std::unique_ptr<memory_file>;
+
+private:
+  std::filesystem::path path_;
+  vector<member> members_;
+};
+
+// Input given either as a file path or as archive.zip:member, the member
+// then being inflated into memory. The returned path is valid as long as
+// holder lives.
+auto open_input(string const& spec, std::unique_ptr<memory_file>& holder) -> std::filesystem::path;
+
+#endif
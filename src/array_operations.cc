@@ -7,20 +7,6 @@
 // }
 
 
-auto copy_mask(array2f const& ref, array2f& dest) -> void
-{
-  for (size_t y = 0; y < ref.extents().y; ++y)
-  {
-    for (size_t x = 0; x < ref.extents().x; ++x)
-    {
-      if(std::isnan(ref[y][x]) || std::fabs(ref[y][x] - undetect) < 0.001f)
-        dest[y][x] = nodata;
-      if(std::fabs(dest[y][x] - undetect) < 0.001f)
-        dest[y][x] = nodata;
-    }
-  }
-}
-
 auto flip(array1d& data) -> void
 {
   auto copy = array1d{data};
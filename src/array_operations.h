@@ -18,7 +18,6 @@ auto argmin2(const vector<T>& x, const T val) -> size_t{
   return min_index;
 }
 
-auto copy_mask(array2f const& ref, array2f& dest) -> void;
 auto flip(array1d& data) -> void;
 auto flipud(array2f& data) -> void;
 auto fliplr(array2f& data) -> void;
@@ -141,98 +141,111 @@ float bicubic_interpolation(
     const float  vv,                //y component of the vector field
     const int    nx,                //width of the image
     const int    ny,                //height of the image
+    const int    stride,            //row length of the image
     const bool   border_out = false //if true, put zeros outside the region
 )
 {
-    const int sx = (uu < 0)? -1: 1;
-    const int sy = (vv < 0)? -1: 1;
-
     int x, y, mx, my, dx, dy, ddx, ddy;
-    bool out = false;
-
-    switch(BOUNDARY_CONDITION) {
-
-	case 0:x   = neumann_bc((int) uu, nx, out);
-		y   = neumann_bc((int) vv, ny, out);
-		mx  = neumann_bc((int) uu - sx, nx, out);
-		my  = neumann_bc((int) vv - sx, ny, out);
-		dx  = neumann_bc((int) uu + sx, nx, out);
-		dy  = neumann_bc((int) vv + sy, ny, out);
-		ddx = neumann_bc((int) uu + 2*sx, nx, out);
-		ddy = neumann_bc((int) vv + 2*sy, ny, out);
-		break;
-
-	case 1:x   = periodic_bc((int) uu, nx, out);
-		y   = periodic_bc((int) vv, ny, out);
-		mx  = periodic_bc((int) uu - sx, nx, out);
-		my  = periodic_bc((int) vv - sx, ny, out);
-		dx  = periodic_bc((int) uu + sx, nx, out);
-		dy  = periodic_bc((int) vv + sy, ny, out);
-		ddx = periodic_bc((int) uu + 2*sx, nx, out);
-		ddy = periodic_bc((int) vv + 2*sy, ny, out);
-		break;
-
-	case 2:x   = symmetric_bc((int) uu, nx, out);
-		y   = symmetric_bc((int) vv, ny, out);
-		mx  = symmetric_bc((int) uu - sx, nx, out);
-		my  = symmetric_bc((int) vv - sx, ny, out);
-		dx  = symmetric_bc((int) uu + sx, nx, out);
-		dy  = symmetric_bc((int) vv + sy, ny, out);
-		ddx = symmetric_bc((int) uu + 2*sx, nx, out);
-		ddy = symmetric_bc((int) vv + 2*sy, ny, out);
-		break;
-
-	default:x   = neumann_bc((int) uu, nx, out);
-		y   = neumann_bc((int) vv, ny, out);
-		mx  = neumann_bc((int) uu - sx, nx, out);
-		my  = neumann_bc((int) vv - sx, ny, out);
-		dx  = neumann_bc((int) uu + sx, nx, out);
-		dy  = neumann_bc((int) vv + sy, ny, out);
-		ddx = neumann_bc((int) uu + 2*sx, nx, out);
-		ddy = neumann_bc((int) vv + 2*sy, ny, out);
-		break;
-    }
-
-    if(out && border_out)
-      
-	return 0.0;
 
+    if(uu >= 1 && vv >= 1 && (int) uu < nx - 2 && (int) vv < ny - 2)
+    {
+	//the 4x4 neighbourhood is inside the image: no boundary condition
+	x   = (int) uu;
+	y   = (int) vv;
+	mx  = x - 1;
+	my  = y - 1;
+	dx  = x + 1;
+	dy  = y + 1;
+	ddx = x + 2;
+	ddy = y + 2;
+    }
     else
     {
-	//obtain the interpolation points of the image
-	const float p11 = input[mx  + nx * my];
-	const float p12 = input[x   + nx * my];
-	const float p13 = input[dx  + nx * my];
-	const float p14 = input[ddx + nx * my];
-
-	const float p21 = input[mx  + nx * y];
-	const float p22 = input[x   + nx * y];
-	const float p23 = input[dx  + nx * y];
-	const float p24 = input[ddx + nx * y];
-
-	const float p31 = input[mx  + nx * dy];
-	const float p32 = input[x   + nx * dy];
-	const float p33 = input[dx  + nx * dy];
-	const float p34 = input[ddx + nx * dy];
-
-	const float p41 = input[mx  + nx * ddy];
-	const float p42 = input[x   + nx * ddy];
-	const float p43 = input[dx  + nx * ddy];
-	const float p44 = input[ddx + nx * ddy];
-
-	//create array
-	double pol[4][4] = {{p11,p21,p31,p41}, {p12,p22,p32,p42}, 
-			    {p13,p23,p33,p43}, {p14,p24,p34,p44}};
-
-	//return interpolation
-	return bicubic_interpolation(pol, (float)uu-x, (float)vv-y);
+	const int sx = (uu < 0)? -1: 1;
+	const int sy = (vv < 0)? -1: 1;
+
+	bool out = false;
+
+	switch(BOUNDARY_CONDITION) {
+
+	    case 0:x   = neumann_bc((int) uu, nx, out);
+		    y   = neumann_bc((int) vv, ny, out);
+		    mx  = neumann_bc((int) uu - sx, nx, out);
+		    my  = neumann_bc((int) vv - sx, ny, out);
+		    dx  = neumann_bc((int) uu + sx, nx, out);
+		    dy  = neumann_bc((int) vv + sy, ny, out);
+		    ddx = neumann_bc((int) uu + 2*sx, nx, out);
+		    ddy = neumann_bc((int) vv + 2*sy, ny, out);
+		    break;
+
+	    case 1:x   = periodic_bc((int) uu, nx, out);
+		    y   = periodic_bc((int) vv, ny, out);
+		    mx  = periodic_bc((int) uu - sx, nx, out);
+		    my  = periodic_bc((int) vv - sx, ny, out);
+		    dx  = periodic_bc((int) uu + sx, nx, out);
+		    dy  = periodic_bc((int) vv + sy, ny, out);
+		    ddx = periodic_bc((int) uu + 2*sx, nx, out);
+		    ddy = periodic_bc((int) vv + 2*sy, ny, out);
+		    break;
+
+	    case 2:x   = symmetric_bc((int) uu, nx, out);
+		    y   = symmetric_bc((int) vv, ny, out);
+		    mx  = symmetric_bc((int) uu - sx, nx, out);
+		    my  = symmetric_bc((int) vv - sx, ny, out);
+		    dx  = symmetric_bc((int) uu + sx, nx, out);
+		    dy  = symmetric_bc((int) vv + sy, ny, out);
+		    ddx = symmetric_bc((int) uu + 2*sx, nx, out);
+		    ddy = symmetric_bc((int) vv + 2*sy, ny, out);
+		    break;
+
+	    default:x   = neumann_bc((int) uu, nx, out);
+		    y   = neumann_bc((int) vv, ny, out);
+		    mx  = neumann_bc((int) uu - sx, nx, out);
+		    my  = neumann_bc((int) vv - sx, ny, out);
+		    dx  = neumann_bc((int) uu + sx, nx, out);
+		    dy  = neumann_bc((int) vv + sy, ny, out);
+		    ddx = neumann_bc((int) uu + 2*sx, nx, out);
+		    ddy = neumann_bc((int) vv + 2*sy, ny, out);
+		    break;
+	}
+
+	if(out && border_out)
+	    return 0.0;
     }
+
+    //obtain the interpolation points of the image
+    const float p11 = input[mx  + stride * my];
+    const float p12 = input[x   + stride * my];
+    const float p13 = input[dx  + stride * my];
+    const float p14 = input[ddx + stride * my];
+
+    const float p21 = input[mx  + stride * y];
+    const float p22 = input[x   + stride * y];
+    const float p23 = input[dx  + stride * y];
+    const float p24 = input[ddx + stride * y];
+
+    const float p31 = input[mx  + stride * dy];
+    const float p32 = input[x   + stride * dy];
+    const float p33 = input[dx  + stride * dy];
+    const float p34 = input[ddx + stride * dy];
+
+    const float p41 = input[mx  + stride * ddy];
+    const float p42 = input[x   + stride * ddy];
+    const float p43 = input[dx  + stride * ddy];
+    const float p44 = input[ddx + stride * ddy];
+
+    //create array
+    double pol[4][4] = {{p11,p21,p31,p41}, {p12,p22,p32,p42}, 
+			{p13,p23,p33,p43}, {p14,p24,p34,p44}};
+
+    //return interpolation
+    return bicubic_interpolation(pol, (float)uu-x, (float)vv-y);
 }
 
 
 /**
   *
-  * Compute the bicubic interpolation of an image.
+  * Compute the bicubic interpolation of a region of an image.
   *
 **/
 void bicubic_interpolation(
@@ -242,19 +255,24 @@ void bicubic_interpolation(
     float       *output,            //warped output image with bicubic interpolation
     const int    nx,                //width of the image
     const int    ny,                //height of the image
+    const int    stride,            //row length of the images
+    const int    x0,                //first column of the region to warp
+    const int    y0,                //first row of the region to warp
+    const int    width,             //width of the region to warp
+    const int    height,            //height of the region to warp
     bool         border_out = false //if true, put zeros outside the region
 )
 {
-    for(int i = 0; i < ny; i++)
+    for(int i = y0; i < y0 + height; i++)
 
-	for(int j = 0; j < nx; j++)
+	for(int j = x0; j < x0 + width; j++)
 	{
-	    const int   p  = i * nx + j;
+	    const int   p  = i * stride + j;
 	    const float uu = (float) (j + u[p]);
 	    const float vv = (float) (i + v[p]);
 
 	    //obtain the bicubic interpolation at position (uu, vv)
-	    output[p] = bicubic_interpolation(input, uu, vv, nx, ny, border_out);
+	    output[p] = bicubic_interpolation(input, uu, vv, nx, ny, stride, border_out);
 	}
 }
 
@@ -21,6 +21,49 @@
 #define MAXITER 300
 #define SOR_PARAMETER 1.9
 #define GAUSSIAN_SIGMA 0.8
+#define MIN_SCALE_SIZE 16   //smallest width or height of a pyramid level
+#define OUTER_TOL 0.001     //rms flow update (pixels) that ends the outer iterations
+#define TILE_SIZE 16        //width and height of the tiles of the sparse mode
+#define TILE_HALO 1         //tiles kept around the active ones in the sparse mode
+
+#define BROX_SOR 0          //linear solvers of the inner iterations
+#define BROX_MULTIGRID 1
+#define BROX_PCG 2
+#define MG_MAXCYCLES 50     //maximum number of multigrid V-cycles
+#define MG_SMOOTH 2         //Gauss-Seidel sweeps before and after a coarse correction
+#define MG_COARSE_SIZE 8    //smallest width or height of a multigrid level
+#define MG_COARSE_SWEEPS 20 //Gauss-Seidel sweeps on the coarsest multigrid level
+
+/**
+  *
+  * Statistics of a multiscale optical flow computation
+  *
+**/
+struct brox_stats
+{
+    int scales_requested; //number of scales asked for by the caller
+    int scales;           //number of scales actually built
+    int degenerate;       //scales skipped because both images are flat
+    int outer_iter;       //outer iterations run, summed over the scales
+    int early_exits;      //scales that converged before outer_iter
+    int linear_solves;    //linear systems solved in the inner iterations
+    int linear_iter;      //iterations of the linear solver, summed over the systems
+    int linear_capped;    //linear systems left above TOL at the iteration limit
+    float linear_residual;//largest final rms update of the linear solver
+};
+
+/**
+  *
+  * Warm start of the multiscale method: u and v hold an initial flow at the
+  * finest scale, so only the finest scales are computed, with fewer outer
+  * iterations
+  *
+**/
+struct brox_warm_start
+{
+    int scales;     //number of scales to compute, counted from the finest
+    int outer_iter; //number of outer iterations at each of those scales
+};
 
 /**
   *
@@ -36,19 +79,20 @@ void psi_data(
     const float *dv,  //motion increment
     float *psip,      //output coefficients
     const int nx,     //image width
-    const int ny      //image height
+    const int ny,     //image height
+    const int stride  //row length of the padded images
 )
 {
-    const int size = nx * ny;
-
     //compute 1/(sqrt((I2-I1+I2x*du+I2y*dv)²+e²) in each pixel
-    for(int i = 0; i < size; i++)
-    {
-	const float dI  = I2[i] - I1[i] + I2x[i] * du[i] + I2y[i] * dv[i];
-	const float dI2 = dI * dI;
+    for(int y = 0; y < ny; y++)
+	for(int x = 0; x < nx; x++)
+	{
+	    const int i = y * stride + x;
+	    const float dI  = I2[i] - I1[i] + I2x[i] * du[i] + I2y[i] * dv[i];
+	    const float dI2 = dI * dI;
 
-	psip[i] = 1. / sqrt(dI2 + EPSILON * EPSILON);
-    }
+	    psip[i] = 1. / sqrt(dI2 + EPSILON * EPSILON);
+	}
 }
 
 
@@ -69,20 +113,21 @@ void psi_gradient(
     const float *dv,   //motion increment
     float *psip,       //output coefficients
     const int nx,      //image width
-    const int ny       //image height
+    const int ny,      //image height
+    const int stride   //row length of the padded images
 )
 {
-    const int size = nx * ny;
-
     //compute 1/(sqrt(|DI2-DI1+HI2*(du,dv)|²+e²) in each pixel
-    for(int i = 0; i < size; i++)
-    {
-	const float dIx = I2x[i] - I1x[i] + I2xx[i] * du[i] + I2xy[i] * dv[i];
-	const float dIy = I2y[i] - I1y[i] + I2xy[i] * du[i] + I2yy[i] * dv[i];
-	const float dI2 = dIx * dIx + dIy * dIy;
+    for(int y = 0; y < ny; y++)
+	for(int x = 0; x < nx; x++)
+	{
+	    const int i = y * stride + x;
+	    const float dIx = I2x[i] - I1x[i] + I2xx[i] * du[i] + I2xy[i] * dv[i];
+	    const float dIy = I2y[i] - I1y[i] + I2xy[i] * du[i] + I2yy[i] * dv[i];
+	    const float dI2 = dIx * dIx + dIy * dIy;
 
-	psip[i] = 1. / sqrt(dI2 + EPSILON * EPSILON);
-    }
+	    psip[i] = 1. / sqrt(dI2 + EPSILON * EPSILON);
+	}
 }
 
 
@@ -98,26 +143,28 @@ void psi_smooth(
     const float *vy, //gradient of y component of the optical flow
     float *psi,      //output coefficients
     const int nx,    //image width
-    const int ny     //image height
+    const int ny,    //image height
+    const int stride //row length of the padded images
 )
 {
-    const int size = nx * ny;
-
     //compute 1/(sqrt(ux²+uy²+vx²+vy²+e²) in each pixel
-    for(int i = 0; i < size; i++)
-    {
-	const float du  = ux[i] * ux[i] + uy[i] * uy[i];
-	const float dv  = vx[i] * vx[i] + vy[i] * vy[i];
-	const float d2  = du + dv;
+    for(int y = 0; y < ny; y++)
+	for(int x = 0; x < nx; x++)
+	{
+	    const int i = y * stride + x;
+	    const float du  = ux[i] * ux[i] + uy[i] * uy[i];
+	    const float dv  = vx[i] * vx[i] + vy[i] * vy[i];
+	    const float d2  = du + dv;
 
-	psi[i] = 1. / sqrt(d2 + EPSILON * EPSILON);
-    }
+	    psi[i] = 1. / sqrt(d2 + EPSILON * EPSILON);
+	}
 }
 
 
 /**
  * 
- *  SOR iteration in one position
+ *  SOR iteration in one position. The divergence coefficients vanish
+ *  across the image border, so the same stencil is used everywhere
  * 
  */
 inline float sor_iteration(
@@ -133,26 +180,18 @@ inline float sor_iteration(
     const float *psi2, 
     const float *psi3,
     const float *psi4,
-    const int   i,     //current row
-    const int   i0,    //previous row
-    const int   i1,    //following row
-    const int   j,     //current column
-    const int   nx,    //number of columns
-    const int   j0,    //previous column
-    const int   j1     //following column
+    const int   k,     //position in the padded arrays
+    const int   stride //row length of the padded arrays
 )
 {
     //set the SOR extrapolation parameter
     const float w = SOR_PARAMETER;
 
-    //calculate the position in the array
-    const int k = i * nx + j;
-
     //compute the divergence part of the numerator
-    const float div_du = psi1[k] * du[k+i1] + psi2[k] * du[k-i0] + 
-			  psi3[k] * du[k+j1] + psi4[k] * du[k-j0] ;
-    const float div_dv = psi1[k] * dv[k+i1] + psi2[k] * dv[k-i0] + 
-			  psi3[k] * dv[k+j1] + psi4[k] * dv[k-j0] ;
+    const float div_du = psi1[k] * du[k+stride] + psi2[k] * du[k-stride] + 
+			  psi3[k] * du[k+1] + psi4[k] * du[k-1] ;
+    const float div_dv = psi1[k] * dv[k+stride] + psi2[k] * dv[k-stride] + 
+			  psi3[k] * dv[k+1] + psi4[k] * dv[k-1] ;
 
     const float duk = du[k];
     const float dvk = dv[k];
@@ -168,430 +207,1569 @@ inline float sor_iteration(
 
 /**
   *
-  * Compute the optic flow with the Brox spatial method
+  * Buffers of the single-scale solver. They are kept between calls, so a
+  * thread computing many flows allocates them only once. A workspace must
+  * not be shared between threads
   *
 **/
-void brox_optic_flow
-(
-    const float *I1,         //first image
-    const float *I2,         //second image
-    float *u, 		      //x component of the optical flow
-    float *v, 		      //y component of the optical flow
-    const int    nx,         //image width
-    const int    ny,         //image height
-    const float  alpha,      //smoothness parameter
-    const float  gamma,      //gradient term parameter
-    const float  TOL,        //stopping criterion threshold
-    const int    inner_iter, //number of inner iterations
-    const int    outer_iter, //number of outer iterations
-    const bool   verbose     //switch on messages
+struct brox_workspace
+{
+    std::vector<float *> buffers; //padded images, from their first ghost cell
+    std::vector<size_t>  sizes;   //number of floats allocated in each buffer
+
+    brox_workspace() {}
+    brox_workspace(const brox_workspace &) = delete;
+    brox_workspace &operator=(const brox_workspace &) = delete;
+
+    ~brox_workspace()
+    {
+	for(size_t i = 0; i < buffers.size(); i++)
+	    std::free(buffers[i]);
+    }
+};
+
+
+/**
+  *
+  * Get a zeroed padded image from a workspace. The returned pointer
+  * addresses the pixel (0,0) of the image, so that the ghost cells are
+  * reached with negative offsets or with indices past the image size
+  *
+**/
+float *padded_image(
+    brox_workspace &ws, //workspace holding the buffers
+    const size_t id,    //number of the buffer
+    const int ny,       //image height
+    const int stride    //row length of the padded image
 )
 {
-    const int size = nx * ny;
-
-    //allocate memory
-    float *du    = new float[size];
-    float *dv    = new float[size];
-
-    float *ux    = new float[size];
-    float *uy    = new float[size];
-    float *vx    = new float[size];
-    float *vy    = new float[size];
-
-    float *I1x   = new float[size];
-    float *I1y   = new float[size];
-    float *I2x   = new float[size];
-    float *I2y   = new float[size];
-    float *I2w   = new float[size];
-    float *I2wx  = new float[size];
-    float *I2wy  = new float[size];
-    float *I2xx  = new float[size];
-    float *I2yy  = new float[size];
-    float *I2xy  = new float[size];
-    float *I2wxx = new float[size];
-    float *I2wyy = new float[size];
-    float *I2wxy = new float[size];
-
-    float *div_u = new float[size];
-    float *div_v = new float[size];
-    float *div_d = new float[size];
-
-    float *Au    = new float[size];
-    float *Av    = new float[size];
-    float *Du    = new float[size];
-    float *Dv    = new float[size];
-    float *D     = new float[size];
-
-    float *psid  = new float[size];
-    float *psig  = new float[size];
-    float *psis  = new float[size];
-    float *psi1  = new float[size];
-    float *psi2  = new float[size];
-    float *psi3  = new float[size];
-    float *psi4  = new float[size];
-
-    //compute the gradient of the images
-    gradient(I1, I1x, I1y, nx, ny);
-    gradient(I2, I2x, I2y, nx, ny);
-
-    //compute second order derivatives
-    Dxx(I2, I2xx, nx, ny);
-    Dyy(I2, I2yy, nx, ny);
-    Dxy(I2, I2xy, nx, ny);
-
-    //outer iterations loop
-    for(int no = 0; no < outer_iter; no++)
+    const size_t n = (size_t) stride * (ny + 2 * BORDER);
+
+    if(ws.buffers.size() <= id)
     {
-	//warp the second image and its derivatives
-	bicubic_interpolation(I2,   u, v, I2w,   nx, ny, true);
-	bicubic_interpolation(I2x,  u, v, I2wx,  nx, ny, true);
-	bicubic_interpolation(I2y,  u, v, I2wy,  nx, ny, true);
-	bicubic_interpolation(I2xx, u, v, I2wxx, nx, ny, true);
-	bicubic_interpolation(I2xy, u, v, I2wxy, nx, ny, true);
-	bicubic_interpolation(I2yy, u, v, I2wyy, nx, ny, true);
+	ws.buffers.resize(id + 1, NULL);
+	ws.sizes.resize(id + 1, 0);
+    }
 
-	//compute the flow gradient
-	gradient(u, ux, uy, nx, ny);
-	gradient(v, vx, vy, nx, ny);
+    //rows are a multiple of 16 floats, so the size is a multiple of 64 bytes
+    if(ws.sizes[id] < n)
+    {
+	std::free(ws.buffers[id]);
+	ws.buffers[id] = (float *) std::aligned_alloc(64, sizeof(float) * n);
+	ws.sizes[id] = n;
+    }
 
-	//compute robust function Phi for the smoothness term
-	psi_smooth(ux, uy, vx, vy, psis, nx, ny);
+    std::memset(ws.buffers[id], 0, sizeof(float) * n);
 
-	//compute coefficients of Phi functions in divergence
-	psi_divergence(psis, psi1, psi2, psi3, psi4, nx, ny);
+    return ws.buffers[id] + stride * BORDER + BORDER;
+}
 
-	//compute the divergence for the gradient of w
-	divergence_u(u, v, psi1, psi2, psi3, psi4, div_u, div_v, nx, ny);
 
-	for(int i = 0; i < size; i++)
-	{
-	    //compute the coefficents of dw[i] in the smoothness term
-	    div_d[i] = alpha * (psi1[i] + psi2[i] + psi3[i] + psi4[i]);
+/**
+  *
+  * Rectangular part of an image processed by the solver
+  *
+**/
+struct brox_tile
+{
+    int x0, y0; //position of the first pixel
+    int nx, ny; //size of the tile
+};
 
-	    //initialize the motion increment
-	    du[i] = dv[i] = 0;
-	}
 
-	//inner iterations loop
-	for(int ni = 0; ni < inner_iter; ni++)
+/**
+  *
+  * Split an image in tiles of TILE_SIZE pixels and keep the tiles with an
+  * active pixel in the mask, plus TILE_HALO tiles around them. Without a
+  * mask the whole image is a single tile
+  *
+**/
+void active_tiles(
+    const unsigned char *mask,     //activity mask, may be NULL
+    const int nx,                  //image width
+    const int ny,                  //image height
+    std::vector<brox_tile> &tiles  //output list of tiles
+)
+{
+    tiles.clear();
+
+    if(!mask)
+    {
+	tiles.push_back({0, 0, nx, ny});
+	return;
+    }
+
+    const int ntx = (nx + TILE_SIZE - 1) / TILE_SIZE;
+    const int nty = (ny + TILE_SIZE - 1) / TILE_SIZE;
+
+    //mark the tiles with activity
+    std::vector<unsigned char> on(ntx * nty, 0);
+    for(int y = 0; y < ny; y++)
+	for(int x = 0; x < nx; x++)
+	    if(mask[y * nx + x])
+		on[(y / TILE_SIZE) * ntx + x / TILE_SIZE] = 1;
+
+    //dilate them by the halo
+    for(int ty = 0; ty < nty; ty++)
+	for(int tx = 0; tx < ntx; tx++)
 	{
-	    //compute robust function Phi for the data and gradient terms
-	    psi_data(I1, I2w, I2wx, I2wy, du, dv,  psid, nx, ny);
-	    psi_gradient(I1x, I1y, I2wx, I2wy, I2wxx, I2wxy, I2wyy, du, dv, psig, nx, ny);
+	    bool keep = false;
+	    for(int j = std::max(0, ty - TILE_HALO); j <= std::min(nty - 1, ty + TILE_HALO) && !keep; j++)
+		for(int i = std::max(0, tx - TILE_HALO); i <= std::min(ntx - 1, tx + TILE_HALO) && !keep; i++)
+		    keep = on[j * ntx + i];
 
-	    //store constant parts of the numerical scheme
-	    for(int i = 0; i < size; i++)
+	    if(keep)
 	    {
-		const float p = psid[i];
-		const float g = gamma * psig[i];
-
-		//brightness constancy term
-		const float dif = I2w[i] - I1[i];
-		const float BNu = -p * dif * I2wx[i];
-		const float BNv = -p * dif * I2wy[i];
-		const float BDu = p * I2wx[i] * I2wx[i];
-		const float BDv = p * I2wy[i] * I2wy[i];
-
-		//gradient constancy term
-		const float dx  = (I2wx[i] - I1x[i]);
-		const float dy  = (I2wy[i] - I1y[i]);
-		const float GNu = -g * (dx * I2wxx[i] + dy * I2wxy[i]);
-		const float GNv = -g * (dx * I2wxy[i] + dy * I2wyy[i]);
-		const float GDu =  g * (I2wxx[i] * I2wxx[i] + I2wxy[i] * I2wxy[i]);
-		const float GDv =  g * (I2wyy[i] * I2wyy[i] + I2wxy[i] * I2wxy[i]);
-		const float DI  = (I2wxx[i] + I2wyy[i]) * I2wxy[i];
-		const float Duv =  p * I2wy[i] * I2wx[i] + g * DI;	    
-
-		Au[i] = BNu + GNu + alpha * div_u[i];
-		Av[i] = BNv + GNv + alpha * div_v[i];
-		Du[i] = BDu + GDu + div_d[i];
-		Dv[i] = BDv + GDv + div_d[i];
-		D [i] = Duv;
+		const int x0 = tx * TILE_SIZE;
+		const int y0 = ty * TILE_SIZE;
+		tiles.push_back({x0, y0, std::min(TILE_SIZE, nx - x0), std::min(TILE_SIZE, ny - y0)});
 	    }
+	}
+}
+
+
+/**
+  *
+  * Downsample an activity mask: a pixel is active if any of the pixels it
+  * covers in the finer mask is active
+  *
+**/
+void zoom_out_mask(
+    const unsigned char *mask, //input mask
+    unsigned char *mout,       //output mask
+    const int nx,              //input width
+    const int ny,              //input height
+    const int nxx,             //output width
+    const int nyy,             //output height
+    const float factor         //zoom factor between 0 and 1
+)
+{
+    std::fill(mout, mout + nxx * nyy, 0);
 
-	    //sor iterations loop
-	    float error = 1000;
-	    int nsor = 0;
-	    
-	    while( error > TOL && nsor < MAXITER)
+    for(int y = 0; y < ny; y++)
+	for(int x = 0; x < nx; x++)
+	    if(mask[y * nx + x])
 	    {
-		error = 0;
-		nsor++;
-		
-		//update the motion increment in the center of the images
-		for(int i = 1; i < ny-1; i++)
-		    for(int j = 1; j < nx-1; j++) {
-
-			error += sor_iteration(
-			      Au, Av, Du, Dv, D, du, dv, alpha,  
-			      psi1, psi2, psi3, psi4,
-			      i, nx, nx, j, nx, 1, 1
-			);
-		    }
+		const int xx = std::min(nxx - 1, (int) (x * factor));
+		const int yy = std::min(nyy - 1, (int) (y * factor));
+		mout[yy * nxx + xx] = 1;
+	    }
+}
 
-		//update the motion increment in the first and last rows
-		for(int j = 1; j < nx-1; j++)
-		{
-		    error += sor_iteration(
-			Au, Av, Du, Dv, D, du, dv, alpha,  
-			psi1, psi2, psi3, psi4,
-			0, 0, nx, j, nx, 1, 1
-		    );    
 
-		    error += sor_iteration(
-			Au, Av, Du, Dv, D, du, dv, alpha,  
-			psi1, psi2, psi3, psi4,
-			ny-1, nx, 0, j, nx, 1, 1
-		    );    
-		}
+/**
+  *
+  * Linear system of the motion increment on one grid. At each pixel
+  *
+  *   Duu du + Duv dv - alpha sum_j w_j du_j = bu
+  *   Duv du + Dvv dv - alpha sum_j w_j dv_j = bv
+  *
+  * where j runs over the four neighbours with weights wN, wS, wE, wW. The
+  * increment is zero in the ghost cells and on the inactive pixels, and
+  * the weights are symmetric, so the system is positive definite
+  *
+**/
+struct brox_system
+{
+    int nx, ny, stride;           //size of the grid
+    float alpha;                  //scale of the neighbour weights
+    float *Duu, *Dvv, *Duv;       //diagonal blocks
+    float *wN, *wS, *wE, *wW;     //neighbour weights
+    float *act;                   //1 on the unknowns, 0 elsewhere
+    float *bu, *bv;               //right hand side
+    float *du, *dv;               //motion increment
+};
 
-		//update the motion increment in the first and last columns
-		for(int i = 1; i < ny-1; i++)
-		{
-		    error += sor_iteration(
-			Au, Av, Du, Dv, D, du, dv, alpha,  
-			psi1, psi2, psi3, psi4,
-			i, nx, nx, 0, nx, 0, 1
-		    );
 
-		    error += sor_iteration(
-			Au, Av, Du, Dv, D, du, dv, alpha,  
-			psi1, psi2, psi3, psi4,
-			i, nx, nx, nx-1, nx, 1, 0
-		    );
-		}
-		
-		//process the top-left corner (0,0)
-		error += sor_iteration(
-		    Au, Av, Du, Dv, D, du, dv, alpha,  
-		    psi1, psi2, psi3, psi4,
-		    0, 0, nx, 0, nx, 0, 1
-		);
+/**
+  *
+  * Product of the system matrix and a vector at one position
+  *
+**/
+inline void system_product(
+    const brox_system &S, //linear system
+    const float *xu,      //x component of the vector
+    const float *xv,      //y component of the vector
+    const int k,          //position in the padded arrays
+    float &yu,            //x component of the product
+    float &yv             //y component of the product
+)
+{
+    const int s = S.stride;
 
-		//process the top-right corner (0,nx-1)
-		error += sor_iteration(
-		    Au, Av, Du, Dv, D, du, dv, alpha,  
-		    psi1, psi2, psi3, psi4,
-		    0, 0, nx, nx-1, nx, 1, 0
-		);
+    const float nbu = S.wN[k] * xu[k+s] + S.wS[k] * xu[k-s] + S.wE[k] * xu[k+1] + S.wW[k] * xu[k-1];
+    const float nbv = S.wN[k] * xv[k+s] + S.wS[k] * xv[k-s] + S.wE[k] * xv[k+1] + S.wW[k] * xv[k-1];
 
-		//process the bottom-left corner (ny-1,0)
-		error += sor_iteration(
-		    Au, Av, Du, Dv, D, du, dv, alpha,  
-		    psi1, psi2, psi3, psi4,
-		    ny-1, nx, 0, 0, nx, 0, 1
-		);
+    yu = S.Duu[k] * xu[k] + S.Duv[k] * xv[k] - S.alpha * nbu;
+    yv = S.Duv[k] * xu[k] + S.Dvv[k] * xv[k] - S.alpha * nbv;
+}
 
-		//process the bottom-right corner (ny-1,nx-1)
-		error += sor_iteration(
-		    Au, Av, Du, Dv, D, du, dv, alpha,  
-		    psi1, psi2, psi3, psi4,
-		    ny-1, nx, 0, nx-1, nx, 1, 0
-		);
-		
-		error = sqrt(error / size);
-	    }
-	    
-	    if(verbose) std::cout << "Iterations: " << nsor << std::endl; 
-	}
 
-	//update the flow with the estimated motion increment
-	for(int i = 0; i < size; i++)
-	{
-	    u[i] += du[i];
-	    v[i] += dv[i];
-	}
-    }
+/**
+  *
+  * Solve the 2x2 diagonal block at one position (block Jacobi preconditioner)
+  *
+**/
+inline void block_solve(
+    const brox_system &S, //linear system
+    const float ru,       //x component of the right hand side
+    const float rv,       //y component of the right hand side
+    const int k,          //position in the padded arrays
+    float &zu,            //x component of the solution
+    float &zv             //y component of the solution
+)
+{
+    const float det = S.Duu[k] * S.Dvv[k] - S.Duv[k] * S.Duv[k];
 
-    //delete allocated memory
-    delete []du;
-    delete []dv;
-
-    delete []ux;
-    delete []uy;
-    delete []vx;
-    delete []vy;
-
-    delete []I1x;
-    delete []I1y;
-    delete []I2x;
-    delete []I2y;
-    delete []I2w;
-    delete []I2wx;
-    delete []I2wy;
-    delete []I2xx;
-    delete []I2yy;
-    delete []I2xy;
-    delete []I2wxx;
-    delete []I2wyy;
-    delete []I2wxy;
-
-    delete []div_u;
-    delete []div_v;    
-    delete []div_d;
-
-    delete []Au;
-    delete []Av;
-    delete []Du;
-    delete []Dv;
-    delete []D;
-
-    delete []psid;
-    delete []psig;
-    delete []psis;
-    delete []psi1;
-    delete []psi2;
-    delete []psi3;
-    delete []psi4;
+    zu = (S.Dvv[k] * ru - S.Duv[k] * rv) / det;
+    zv = (S.Duu[k] * rv - S.Duv[k] * ru) / det;
 }
 
 
 /**
   *
-  * Function to normalize the images between 0 and 255
+  * Residual r = b - A d of the system
   *
 **/
-void image_normalization(
-    const float *I1,   //input image 1
-    const float *I2,   //input image 2
-    float       *I1n,  //normalized output image 1
-    float       *I2n,  //normalized output image 2 
-    int          size  //size of the image
+void system_residual(
+    const brox_system &S, //linear system
+    float *ru,            //x component of the residual
+    float *rv             //y component of the residual
 )
 {
-    //compute the max and min values of the images
-    const float max0 = *std::max_element(I1, &I1[size]);
-    const float max1 = *std::max_element(I2, &I2[size]);
-    const float min0 = *std::min_element(I1, &I1[size]);
-    const float min1 = *std::min_element(I2, &I2[size]);
+    for(int y = 0; y < S.ny; y++)
+	for(int x = 0; x < S.nx; x++)
+	{
+	    const int k = y * S.stride + x;
 
-    //compute the global max and min
-    const float max = std::max(max0, max1);
-    const float min = std::min(min0, min1);
-    const float den = max - min;
+	    if(S.act[k])
+	    {
+		float Au, Av;
+		system_product(S, S.du, S.dv, k, Au, Av);
 
-    if(den > 0)
-	//normalize the images between 0 and 255
-	for(int i = 0; i < size; i++)
-	{
-	    I1n[i] = 255.0 * (I1[i] - min) / den;
-	    I2n[i] = 255.0 * (I2[i] - min) / den;
+		ru[k] = S.bu[k] - Au;
+		rv[k] = S.bv[k] - Av;
+	    }
+	    else ru[k] = rv[k] = 0;
 	}
+}
 
-    else
-	//copy the original data
-	for(int i = 0; i < size; i++)
-	{
-	    I1n[i] = I1[i];
-	    I2n[i] = I2[i];
-	}
+
+/**
+  *
+  * Block Gauss-Seidel sweeps, the smoother of the multigrid method
+  *
+**/
+void gauss_seidel(
+    const brox_system &S, //linear system
+    const int sweeps      //number of sweeps
+)
+{
+    const int s = S.stride;
+
+    for(int n = 0; n < sweeps; n++)
+	for(int y = 0; y < S.ny; y++)
+	    for(int x = 0; x < S.nx; x++)
+	    {
+		const int k = y * s + x;
+
+		if(S.act[k])
+		{
+		    const float nbu = S.wN[k] * S.du[k+s] + S.wS[k] * S.du[k-s] + 
+				      S.wE[k] * S.du[k+1] + S.wW[k] * S.du[k-1];
+		    const float nbv = S.wN[k] * S.dv[k+s] + S.wS[k] * S.dv[k-s] + 
+				      S.wE[k] * S.dv[k+1] + S.wW[k] * S.dv[k-1];
+
+		    block_solve(S, S.bu[k] + S.alpha * nbu, S.bv[k] + S.alpha * nbv, k, S.du[k], S.dv[k]);
+		}
+	    }
 }
 
 
 /**
   *
-  *  Multiscale approach for computing the optical flow
+  * Build the coarse system of a multigrid level. A coarse pixel covers 2x2
+  * fine pixels and is active if any of them is. The coarse matrix is the
+  * Galerkin product with piecewise constant interpolation, with the
+  * weights between coarse pixels halved so that the smoothness term keeps
+  * its scale on the coarse grid
   *
 **/
-void brox_optic_flow(
-    const float *I1,         //first image
-    const float *I2,         //second image
-    float *u, 		      //x component of the optical flow
-    float *v, 		      //y component of the optical flow
-    const int    nxx,        //image width
-    const int    nyy,        //image height
-    const float  alpha,      //smoothness parameter
-    const float  gamma,      //gradient term parameter
-    const int    nscales,    //number of scales
-    const float  nu,         //downsampling factor
-    const float  TOL,        //stopping criterion threshold
-    const int    inner_iter, //number of inner iterations
-    const int    outer_iter, //number of outer iterations
-    const bool   verbose     //switch on messages
+void coarse_system(
+    const brox_system &F, //fine system
+    brox_system &C,       //output coarse system
+    brox_workspace &w,    //workspace for the coarse buffers
+    size_t &id            //next free buffer of the workspace
 )
 {
-    int size = nxx * nyy;
+    C.nx = (F.nx + 1) / 2;
+    C.ny = (F.ny + 1) / 2;
+    C.stride = padded_stride(C.nx);
+    C.alpha = 1;
+
+    C.Duu = padded_image(w, id++, C.ny, C.stride);
+    C.Dvv = padded_image(w, id++, C.ny, C.stride);
+    C.Duv = padded_image(w, id++, C.ny, C.stride);
+    C.wN  = padded_image(w, id++, C.ny, C.stride);
+    C.wS  = padded_image(w, id++, C.ny, C.stride);
+    C.wE  = padded_image(w, id++, C.ny, C.stride);
+    C.wW  = padded_image(w, id++, C.ny, C.stride);
+    C.act = padded_image(w, id++, C.ny, C.stride);
+    C.bu  = padded_image(w, id++, C.ny, C.stride);
+    C.bv  = padded_image(w, id++, C.ny, C.stride);
+    C.du  = padded_image(w, id++, C.ny, C.stride);
+    C.dv  = padded_image(w, id++, C.ny, C.stride);
+
+    for(int y = 0; y < F.ny; y++)
+	for(int x = 0; x < F.nx; x++)
+	{
+	    const int k = y * F.stride + x;
+
+	    if(!F.act[k])
+		continue;
 
-    std::vector<float *> I1s(nscales);
-    std::vector<float *> I2s(nscales);
-    std::vector<float *> us (nscales);
-    std::vector<float *> vs (nscales);
+	    const int K = (y / 2) * C.stride + x / 2;
 
-    std::vector<int> nx(nscales);
-    std::vector<int> ny(nscales);
+	    C.act[K] = 1;
+	    C.Duu[K] += F.Duu[k];
+	    C.Dvv[K] += F.Dvv[k];
+	    C.Duv[K] += F.Duv[k];
 
-    I1s[0] = new float[size];
-    I2s[0] = new float[size];
+	    //neighbours of the fine pixel: offset, weight and coarse weight
+	    const int   dk[4] = {F.stride, -F.stride, 1, -1};
+	    const float fw[4] = {F.wN[k], F.wS[k], F.wE[k], F.wW[k]};
+	    const int   dy[4] = {1, -1, 0, 0};
+	    const int   dx[4] = {0, 0, 1, -1};
+	    float *cw[4] = {C.wN, C.wS, C.wE, C.wW};
 
-    //normalize the input images between 0 and 255
-    image_normalization(I1, I2, I1s[0], I2s[0], size);
+	    for(int j = 0; j < 4; j++)
+	    {
+		const int xn = x + dx[j];
+		const int yn = y + dy[j];
 
-    //presmoothing the finest scale images
-    gaussian(I1s[0], nxx, nyy, GAUSSIAN_SIGMA);
-    gaussian(I2s[0], nxx, nyy, GAUSSIAN_SIGMA);
+		//the faces towards the border or inactive pixels stay in the
+		//diagonal, as the increment is zero there
+		if(xn < 0 || yn < 0 || xn >= F.nx || yn >= F.ny || !F.act[k + dk[j]])
+		    continue;
 
-    us [0] = u;
-    vs [0] = v;
-    nx [0] = nxx;
-    ny [0] = nyy;
+		const float aw = F.alpha * fw[j];
+
+		if(xn / 2 == x / 2 && yn / 2 == y / 2)
+		{
+		    C.Duu[K] -= aw;
+		    C.Dvv[K] -= aw;
+		}
+		else
+		{
+		    C.Duu[K] -= 0.5 * aw;
+		    C.Dvv[K] -= 0.5 * aw;
+		    cw[j][K] += 0.5 * aw;
+		}
+	    }
+	}
+}
 
-    //create the scales
-    for(int s = 1; s < nscales; s++)
-    {
-	zoom_size(nx[s-1], ny[s-1], nx[s], ny[s], nu);
-	const int sizes = nx[s] * ny[s];
 
-	I1s[s] = new float[sizes];
-	I2s[s] = new float[sizes];
-	us[s]  = new float[sizes];
-	vs[s]  = new float[sizes];
+/**
+  *
+  * Multigrid V-cycle from the level l of a hierarchy of systems
+  *
+**/
+void v_cycle(
+    std::vector<brox_system> &L, //systems from the finest to the coarsest
+    std::vector<float *> &ru,    //x component of the residual of each level
+    std::vector<float *> &rv,    //y component of the residual of each level
+    const size_t l               //current level
+)
+{
+    const brox_system &F = L[l];
 
-	//compute the zoom from the previous scale
-	zoom_out(I1s[s-1], I1s[s], nx[s-1], ny[s-1], nu);
-	zoom_out(I2s[s-1], I2s[s], nx[s-1], ny[s-1], nu);
+    if(l + 1 == L.size())
+    {
+	gauss_seidel(F, MG_COARSE_SWEEPS);
+	return;
     }
 
-    //initialization of the optical flow at the coarsest scale
-    for(int i = 0; i < nx[nscales-1] * ny[nscales-1]; i++)
-	us[nscales-1][i] = vs[nscales-1][i] = 0.0;
+    brox_system &C = L[l+1];
 
+    gauss_seidel(F, MG_SMOOTH);
+    system_residual(F, ru[l], rv[l]);
 
-    //pyramidal approach for computing the optical flow
-    for(int s = nscales-1; s >= 0; s--)
-    {
-	if(verbose) std::cout << "Scale: " << s << std::endl;
+    //restrict the residual and solve for the coarse correction
+    for(int y = 0; y < C.ny; y++)
+	for(int x = 0; x < C.nx; x++)
+	{
+	    const int K = y * C.stride + x;
+	    C.bu[K] = C.bv[K] = C.du[K] = C.dv[K] = 0;
+	}
+
+    for(int y = 0; y < F.ny; y++)
+	for(int x = 0; x < F.nx; x++)
+	{
+	    const int k = y * F.stride + x;
+	    const int K = (y / 2) * C.stride + x / 2;
+	    C.bu[K] += ru[l][k];
+	    C.bv[K] += rv[l][k];
+	}
 
-	//compute the optical flow for the current scale
-	brox_optic_flow(
-	    I1s[s], I2s[s], us[s], vs[s], nx[s], ny[s], 
-	    alpha, gamma, TOL, inner_iter, outer_iter, verbose
-	);
+    v_cycle(L, ru, rv, l + 1);
 
-	//if it is not the finer scale, then upsample the optical flow and adapt it conveniently
-	if(s)
+    //interpolate the correction to the active pixels
+    for(int y = 0; y < F.ny; y++)
+	for(int x = 0; x < F.nx; x++)
 	{
-	    zoom_in(us[s], us[s-1], nx[s], ny[s], nx[s-1], ny[s-1]);
-	    zoom_in(vs[s], vs[s-1], nx[s], ny[s], nx[s-1], ny[s-1]);
+	    const int k = y * F.stride + x;
 
-	    for(int i = 0; i < nx[s-1] * ny[s-1]; i++)
+	    if(F.act[k])
 	    {
-		us[s-1][i] *= 1.0 / nu;
-		vs[s-1][i] *= 1.0 / nu;
+		const int K = (y / 2) * C.stride + x / 2;
+		F.du[k] += C.du[K];
+		F.dv[k] += C.dv[K];
 	    }
 	}
-    }
 
-    //delete allocated memory
-    delete []I1s[0];
-    delete []I2s[0];
+    gauss_seidel(F, MG_SMOOTH);
+}
+
+
+/**
+  *
+  * Mark the pixels of the tiles as the unknowns of a system
+  *
+**/
+void tile_activity(
+    const std::vector<brox_tile> &tiles, //tiles to be processed
+    const int stride,                    //row length of the padded image
+    float *act                           //output activity, zeroed
+)
+{
+    for(const brox_tile &t: tiles)
+	for(int y = t.y0; y < t.y0 + t.ny; y++)
+	    for(int x = t.x0; x < t.x0 + t.nx; x++)
+		act[y * stride + x] = 1;
+}
+
+
+/**
+  *
+  * Solve the system with SOR iterations. The error is the rms update of
+  * one sweep. Returns the number of iterations
+  *
+**/
+int sor_solve(
+    const brox_system &S,                //linear system
+    const std::vector<brox_tile> &tiles, //tiles to be processed
+    const int   active,                  //number of active pixels
+    const float TOL,                     //stopping criterion threshold
+    const bool  verbose,                 //switch on messages
+    float &residual                      //output error of the last iteration
+)
+{
+    float error = 1000;
+    int nsor = 0;
 
-    for(int i = 1; i < nscales; i++)
+    while(error > TOL && nsor < MAXITER)
     {
-	delete []I1s[i];
-	delete []I2s[i];
-	delete []us [i];
-	delete []vs [i];
+	error = 0;
+	nsor++;
+
+	//update the motion increment, the ghost cells of du and dv and
+	//the pixels outside the tiles stay at zero
+	for(const brox_tile &t: tiles)
+	    for(int y = t.y0; y < t.y0 + t.ny; y++)
+		for(int x = t.x0; x < t.x0 + t.nx; x++)
+		    error += sor_iteration(
+			  S.bu, S.bv, S.Duu, S.Dvv, S.Duv, S.du, S.dv, S.alpha,  
+			  S.wN, S.wS, S.wE, S.wW,
+			  y * S.stride + x, S.stride
+		    );
+
+	error = sqrt(error / active);
+	if(verbose) std::cout << "SOR iteration " << nsor << ": " << error << std::endl;
     }
+
+    residual = error;
+    return nsor;
+}
+
+
+/**
+  *
+  * Solve the system with multigrid V-cycles and block Gauss-Seidel
+  * smoothing. The error is the rms update of one cycle. Returns the
+  * number of cycles
+  *
+**/
+int multigrid_solve(
+    const brox_system &S,                //linear system
+    const std::vector<brox_tile> &tiles, //tiles to be processed
+    const int   active,                  //number of active pixels
+    const float TOL,                     //stopping criterion threshold
+    const bool  verbose,                 //switch on messages
+    brox_workspace &w,                   //workspace for the other buffers
+    size_t id,                           //first free buffer of the workspace
+    float &residual                      //output error of the last iteration
+)
+{
+    std::vector<brox_system> L(1, S);
+    std::vector<float *> ru, rv;
+
+    L[0].act = padded_image(w, id++, S.ny, S.stride);
+    tile_activity(tiles, S.stride, L[0].act);
+
+    float *du0 = padded_image(w, id++, S.ny, S.stride);
+    float *dv0 = padded_image(w, id++, S.ny, S.stride);
+
+    //build the coarser systems
+    while(true)
+    {
+	const brox_system &F = L.back();
+
+	ru.push_back(padded_image(w, id++, F.ny, F.stride));
+	rv.push_back(padded_image(w, id++, F.ny, F.stride));
+
+	if(F.nx < 2 * MG_COARSE_SIZE || F.ny < 2 * MG_COARSE_SIZE)
+	    break;
+
+	brox_system C;
+	coarse_system(F, C, w, id);
+	L.push_back(C);
+    }
+
+    float error = 1000;
+    int ncycles = 0;
+
+    while(error > TOL && ncycles < MG_MAXCYCLES)
+    {
+	ncycles++;
+
+	std::copy(S.du - S.stride - 1, S.du + (S.ny + 1) * S.stride - 1, du0 - S.stride - 1);
+	std::copy(S.dv - S.stride - 1, S.dv + (S.ny + 1) * S.stride - 1, dv0 - S.stride - 1);
+
+	v_cycle(L, ru, rv, 0);
+
+	error = 0;
+	for(const brox_tile &t: tiles)
+	    for(int y = t.y0; y < t.y0 + t.ny; y++)
+		for(int x = t.x0; x < t.x0 + t.nx; x++)
+		{
+		    const int k = y * S.stride + x;
+		    error += (S.du[k] - du0[k]) * (S.du[k] - du0[k]) + 
+			     (S.dv[k] - dv0[k]) * (S.dv[k] - dv0[k]);
+		}
+
+	error = sqrt(error / active);
+	if(verbose) std::cout << "V-cycle " << ncycles << ": " << error << std::endl;
+    }
+
+    residual = error;
+    return ncycles;
+}
+
+
+/**
+  *
+  * Solve the system with the conjugate gradient method and a block Jacobi
+  * preconditioner. The error is the rms update of one iteration. Returns
+  * the number of iterations
+  *
+**/
+int pcg_solve(
+    const brox_system &S,                //linear system
+    const std::vector<brox_tile> &tiles, //tiles to be processed
+    const int   active,                  //number of active pixels
+    const float TOL,                     //stopping criterion threshold
+    const bool  verbose,                 //switch on messages
+    brox_workspace &w,                   //workspace for the other buffers
+    size_t id,                           //first free buffer of the workspace
+    float &residual                      //output error of the last iteration
+)
+{
+    brox_system A = S;
+    A.act = padded_image(w, id++, S.ny, S.stride);
+    tile_activity(tiles, S.stride, A.act);
+
+    float *ru = padded_image(w, id++, S.ny, S.stride);
+    float *rv = padded_image(w, id++, S.ny, S.stride);
+    float *pu = padded_image(w, id++, S.ny, S.stride);
+    float *pv = padded_image(w, id++, S.ny, S.stride);
+    float *qu = padded_image(w, id++, S.ny, S.stride);
+    float *qv = padded_image(w, id++, S.ny, S.stride);
+
+    //initial residual and search direction
+    system_residual(A, ru, rv);
+    double rz = 0;
+
+    for(const brox_tile &t: tiles)
+	for(int y = t.y0; y < t.y0 + t.ny; y++)
+	    for(int x = t.x0; x < t.x0 + t.nx; x++)
+	    {
+		const int k = y * S.stride + x;
+		block_solve(A, ru[k], rv[k], k, pu[k], pv[k]);
+		rz += ru[k] * pu[k] + rv[k] * pv[k];
+	    }
+
+    float error = 1000;
+    int ncg = 0;
+
+    while(error > TOL && ncg < MAXITER)
+    {
+	ncg++;
+
+	//step along the search direction
+	double pq = 0;
+	for(const brox_tile &t: tiles)
+	    for(int y = t.y0; y < t.y0 + t.ny; y++)
+		for(int x = t.x0; x < t.x0 + t.nx; x++)
+		{
+		    const int k = y * S.stride + x;
+		    system_product(A, pu, pv, k, qu[k], qv[k]);
+		    pq += pu[k] * qu[k] + pv[k] * qv[k];
+		}
+
+	//no direction left, the system is solved
+	if(pq <= 0)
+	{
+	    error = 0;
+	    break;
+	}
+
+	const float a = rz / pq;
+
+	//update the increment and the residual, keep the preconditioned
+	//residual in q as the product is no longer needed
+	double rz_new = 0;
+	error = 0;
+
+	for(const brox_tile &t: tiles)
+	    for(int y = t.y0; y < t.y0 + t.ny; y++)
+		for(int x = t.x0; x < t.x0 + t.nx; x++)
+		{
+		    const int k = y * S.stride + x;
+
+		    A.du[k] += a * pu[k];
+		    A.dv[k] += a * pv[k];
+		    ru[k] -= a * qu[k];
+		    rv[k] -= a * qv[k];
+		    error += a * a * (pu[k] * pu[k] + pv[k] * pv[k]);
+
+		    block_solve(A, ru[k], rv[k], k, qu[k], qv[k]);
+		    rz_new += ru[k] * qu[k] + rv[k] * qv[k];
+		}
+
+	error = sqrt(error / active);
+	if(verbose) std::cout << "PCG iteration " << ncg << ": " << error << std::endl;
+
+	//new search direction
+	const float b = rz_new / rz;
+	rz = rz_new;
+
+	for(const brox_tile &t: tiles)
+	    for(int y = t.y0; y < t.y0 + t.ny; y++)
+		for(int x = t.x0; x < t.x0 + t.nx; x++)
+		{
+		    const int k = y * S.stride + x;
+		    pu[k] = qu[k] + b * pu[k];
+		    pv[k] = qv[k] + b * pv[k];
+		}
+    }
+
+    residual = error;
+    return ncg;
+}
+
+
+/**
+  *
+  * Padded images of the single-scale solver that are set by the caller
+  *
+**/
+struct brox_images
+{
+    float *I1, *I1x, *I1y;                      //first image and its gradient
+    float *I2, *I2x, *I2y, *I2xx, *I2yy, *I2xy; //second image and its derivatives
+    float *u, *v;                               //optical flow
+};
+
+#define BROX_IMAGES 11 //workspace buffers taken by brox_images
+
+
+/**
+  *
+  * Get the input images of the single-scale solver from a workspace
+  *
+**/
+brox_images input_images(
+    brox_workspace &w, //workspace holding the buffers
+    const int ny,      //image height
+    const int stride   //row length of the padded images
+)
+{
+    brox_images im;
+
+    im.I1   = padded_image(w, 0,  ny, stride);
+    im.I1x  = padded_image(w, 1,  ny, stride);
+    im.I1y  = padded_image(w, 2,  ny, stride);
+    im.I2   = padded_image(w, 3,  ny, stride);
+    im.I2x  = padded_image(w, 4,  ny, stride);
+    im.I2y  = padded_image(w, 5,  ny, stride);
+    im.I2xx = padded_image(w, 6,  ny, stride);
+    im.I2yy = padded_image(w, 7,  ny, stride);
+    im.I2xy = padded_image(w, 8,  ny, stride);
+    im.u    = padded_image(w, 9,  ny, stride);
+    im.v    = padded_image(w, 10, ny, stride);
+
+    return im;
+}
+
+
+/**
+  *
+  * Compute the optic flow with the Brox spatial method on the tiles of the
+  * padded input images. Returns the number of outer iterations run before
+  * the flow update fell below OUTER_TOL
+  *
+**/
+int brox_solve(
+    const brox_images &im,               //input images and flow
+    const int    nx,                     //image width
+    const int    ny,                     //image height
+    const int    stride,                 //row length of the padded images
+    const float  alpha,                  //smoothness parameter
+    const float  gamma,                  //gradient term parameter
+    const float  TOL,                    //stopping criterion threshold
+    const int    inner_iter,             //number of inner iterations
+    const int    outer_iter,             //number of outer iterations
+    const bool   verbose,                //switch on messages
+    const std::vector<brox_tile> &tiles, //tiles to be processed
+    brox_workspace &w,                   //workspace for the other buffers
+    const int    solver,                 //linear solver, BROX_SOR, BROX_MULTIGRID or BROX_PCG
+    int &linear_solves,                  //output number of linear systems solved
+    int &linear_iter,                    //output iterations of the linear solver
+    int &linear_capped,                  //output systems left above TOL
+    float &linear_residual               //output largest final error of the linear solver
+)
+{
+    const float *I1p  = im.I1;
+    const float *I1x  = im.I1x;
+    const float *I1y  = im.I1y;
+    const float *I2p  = im.I2;
+    const float *I2x  = im.I2x;
+    const float *I2y  = im.I2y;
+    const float *I2xx = im.I2xx;
+    const float *I2yy = im.I2yy;
+    const float *I2xy = im.I2xy;
+    float *up = im.u;
+    float *vp = im.v;
+
+    //get the memory from the workspace, after the input images
+    size_t id = BROX_IMAGES;
+
+    float *du    = padded_image(w, id++, ny, stride);
+    float *dv    = padded_image(w, id++, ny, stride);
+
+    float *ux    = padded_image(w, id++, ny, stride);
+    float *uy    = padded_image(w, id++, ny, stride);
+    float *vx    = padded_image(w, id++, ny, stride);
+    float *vy    = padded_image(w, id++, ny, stride);
+
+    float *I2w   = padded_image(w, id++, ny, stride);
+    float *I2wx  = padded_image(w, id++, ny, stride);
+    float *I2wy  = padded_image(w, id++, ny, stride);
+    float *I2wxx = padded_image(w, id++, ny, stride);
+    float *I2wyy = padded_image(w, id++, ny, stride);
+    float *I2wxy = padded_image(w, id++, ny, stride);
+
+    float *div_u = padded_image(w, id++, ny, stride);
+    float *div_v = padded_image(w, id++, ny, stride);
+    float *div_d = padded_image(w, id++, ny, stride);
+
+    float *Au    = padded_image(w, id++, ny, stride);
+    float *Av    = padded_image(w, id++, ny, stride);
+    float *Du    = padded_image(w, id++, ny, stride);
+    float *Dv    = padded_image(w, id++, ny, stride);
+    float *D     = padded_image(w, id++, ny, stride);
+
+    float *psid  = padded_image(w, id++, ny, stride);
+    float *psig  = padded_image(w, id++, ny, stride);
+    float *psis  = padded_image(w, id++, ny, stride);
+    float *psi1  = padded_image(w, id++, ny, stride);
+    float *psi2  = padded_image(w, id++, ny, stride);
+    float *psi3  = padded_image(w, id++, ny, stride);
+    float *psi4  = padded_image(w, id++, ny, stride);
+
+    int active = 0;
+    for(const brox_tile &t: tiles)
+	active += t.nx * t.ny;
+
+    linear_solves = linear_iter = linear_capped = 0;
+    linear_residual = 0;
+
+    //outer iterations loop, nothing to do without active tiles
+    int no = 0;
+    while(active && no < outer_iter)
+    {
+	no++;
+
+	neumann_border(up, nx, ny, stride);
+	neumann_border(vp, nx, ny, stride);
+
+	for(const brox_tile &t: tiles)
+	{
+	    const int o = t.y0 * stride + t.x0;
+
+	    //warp the second image and its derivatives
+	    bicubic_interpolation(I2p,  up, vp, I2w,   nx, ny, stride, t.x0, t.y0, t.nx, t.ny, true);
+	    bicubic_interpolation(I2x,  up, vp, I2wx,  nx, ny, stride, t.x0, t.y0, t.nx, t.ny, true);
+	    bicubic_interpolation(I2y,  up, vp, I2wy,  nx, ny, stride, t.x0, t.y0, t.nx, t.ny, true);
+	    bicubic_interpolation(I2xx, up, vp, I2wxx, nx, ny, stride, t.x0, t.y0, t.nx, t.ny, true);
+	    bicubic_interpolation(I2xy, up, vp, I2wxy, nx, ny, stride, t.x0, t.y0, t.nx, t.ny, true);
+	    bicubic_interpolation(I2yy, up, vp, I2wyy, nx, ny, stride, t.x0, t.y0, t.nx, t.ny, true);
+
+	    //compute the flow gradient
+	    gradient(up + o, ux + o, uy + o, t.nx, t.ny, stride);
+	    gradient(vp + o, vx + o, vy + o, t.nx, t.ny, stride);
+
+	    //compute robust function Phi for the smoothness term
+	    psi_smooth(ux + o, uy + o, vx + o, vy + o, psis + o, t.nx, t.ny, stride);
+	}
+
+	noflux_border(psis, nx, ny, stride);
+
+	for(const brox_tile &t: tiles)
+	{
+	    const int o = t.y0 * stride + t.x0;
+
+	    //compute coefficients of Phi functions in divergence
+	    psi_divergence(psis + o, psi1 + o, psi2 + o, psi3 + o, psi4 + o, t.nx, t.ny, stride);
+
+	    //compute the divergence for the gradient of w
+	    divergence_u(
+		up + o, vp + o, psi1 + o, psi2 + o, psi3 + o, psi4 + o, 
+		div_u + o, div_v + o, t.nx, t.ny, stride
+	    );
+
+	    for(int y = 0; y < t.ny; y++)
+		for(int x = 0; x < t.nx; x++)
+		{
+		    const int i = o + y * stride + x;
+
+		    //compute the coefficents of dw[i] in the smoothness term
+		    div_d[i] = alpha * (psi1[i] + psi2[i] + psi3[i] + psi4[i]);
+
+		    //initialize the motion increment
+		    du[i] = dv[i] = 0;
+		}
+	}
+
+	//inner iterations loop
+	for(int ni = 0; ni < inner_iter; ni++)
+	{
+	    for(const brox_tile &t: tiles)
+	    {
+		const int o = t.y0 * stride + t.x0;
+
+		//compute robust function Phi for the data and gradient terms
+		psi_data(
+		    I1p + o, I2w + o, I2wx + o, I2wy + o, du + o, dv + o, 
+		    psid + o, t.nx, t.ny, stride
+		);
+		psi_gradient(
+		    I1x + o, I1y + o, I2wx + o, I2wy + o, I2wxx + o, I2wxy + o, I2wyy + o, 
+		    du + o, dv + o, psig + o, t.nx, t.ny, stride
+		);
+
+		//store constant parts of the numerical scheme
+		for(int y = 0; y < t.ny; y++)
+		    for(int x = 0; x < t.nx; x++)
+		    {
+			const int i = o + y * stride + x;
+			const float p = psid[i];
+			const float g = gamma * psig[i];
+
+			//brightness constancy term
+			const float dif = I2w[i] - I1p[i];
+			const float BNu = -p * dif * I2wx[i];
+			const float BNv = -p * dif * I2wy[i];
+			const float BDu = p * I2wx[i] * I2wx[i];
+			const float BDv = p * I2wy[i] * I2wy[i];
+
+			//gradient constancy term
+			const float dx  = (I2wx[i] - I1x[i]);
+			const float dy  = (I2wy[i] - I1y[i]);
+			const float GNu = -g * (dx * I2wxx[i] + dy * I2wxy[i]);
+			const float GNv = -g * (dx * I2wxy[i] + dy * I2wyy[i]);
+			const float GDu =  g * (I2wxx[i] * I2wxx[i] + I2wxy[i] * I2wxy[i]);
+			const float GDv =  g * (I2wyy[i] * I2wyy[i] + I2wxy[i] * I2wxy[i]);
+			const float DI  = (I2wxx[i] + I2wyy[i]) * I2wxy[i];
+			const float Duv =  p * I2wy[i] * I2wx[i] + g * DI;
+
+			Au[i] = BNu + GNu + alpha * div_u[i];
+			Av[i] = BNv + GNv + alpha * div_v[i];
+			Du[i] = BDu + GDu + div_d[i];
+			Dv[i] = BDv + GDv + div_d[i];
+			D [i] = Duv;
+		    }
+	    }
+
+	    //solve the linear system of the motion increment
+	    const brox_system S = {
+		nx, ny, stride, alpha, Du, Dv, D, psi1, psi2, psi3, psi4, 
+		NULL, Au, Av, du, dv
+	    };
+
+	    int nlin;
+	    float residual;
+	    switch(solver)
+	    {
+		case BROX_MULTIGRID:
+		    nlin = multigrid_solve(S, tiles, active, TOL, verbose, w, id, residual);
+		    break;
+		case BROX_PCG:
+		    nlin = pcg_solve(S, tiles, active, TOL, verbose, w, id, residual);
+		    break;
+		default:
+		    nlin = sor_solve(S, tiles, active, TOL, verbose, residual);
+		    break;
+	    }
+
+	    linear_iter += nlin;
+	    linear_solves++;
+	    linear_capped += residual > TOL;
+	    linear_residual = std::max(linear_residual, residual);
+
+	    if(verbose) std::cout << "Iterations: " << nlin << ", residual: " << residual << std::endl; 
+	}
+
+	//update the flow with the estimated motion increment
+	float update = 0;
+	for(const brox_tile &t: tiles)
+	    for(int y = t.y0; y < t.y0 + t.ny; y++)
+		for(int x = t.x0; x < t.x0 + t.nx; x++)
+		{
+		    const int i = y * stride + x;
+		    up[i] += du[i];
+		    vp[i] += dv[i];
+		    update += du[i] * du[i] + dv[i] * dv[i];
+		}
+
+	//stop when the warping no longer changes the flow
+	if(sqrt(update / active) < OUTER_TOL)
+	    break;
+    }
+
+    return no;
+}
+
+
+/**
+  *
+  * Compute the optic flow with the Brox spatial method. Returns the number
+  * of outer iterations run before the flow update fell below OUTER_TOL
+  *
+**/
+int brox_optic_flow
+(
+    const float *I1,         //first image
+    const float *I2,         //second image
+    float *u, 		      //x component of the optical flow
+    float *v, 		      //y component of the optical flow
+    const int    nx,         //image width
+    const int    ny,         //image height
+    const float  alpha,      //smoothness parameter
+    const float  gamma,      //gradient term parameter
+    const float  TOL,        //stopping criterion threshold
+    const int    inner_iter, //number of inner iterations
+    const int    outer_iter, //number of outer iterations
+    const bool   verbose,    //switch on messages
+    const unsigned char *mask = NULL, //optional activity mask, see active_tiles
+    brox_workspace *ws = NULL, //optional buffers reused between calls
+    const int solver = BROX_SOR //linear solver of the inner iterations
+)
+{
+    const int stride = padded_stride(nx);
+
+    brox_workspace local;
+    brox_workspace &w = ws ? *ws : local;
+
+    //list the tiles to be processed
+    std::vector<brox_tile> tiles;
+    active_tiles(mask, nx, ny, tiles);
+
+    //copy the input into the padded layout
+    const brox_images im = input_images(w, ny, stride);
+
+    copy_to_padded(I1, im.I1, nx, ny, stride);
+    copy_to_padded(I2, im.I2, nx, ny, stride);
+    copy_to_padded(u,  im.u,  nx, ny, stride);
+    copy_to_padded(v,  im.v,  nx, ny, stride);
+
+    neumann_border(im.I1, nx, ny, stride);
+    neumann_border(im.I2, nx, ny, stride);
+
+    //the kernels work on a tile through pointers offset to its origin
+    for(const brox_tile &t: tiles)
+    {
+	const int o = t.y0 * stride + t.x0;
+
+	//compute the gradient of the images
+	gradient(im.I1 + o, im.I1x + o, im.I1y + o, t.nx, t.ny, stride);
+	gradient(im.I2 + o, im.I2x + o, im.I2y + o, t.nx, t.ny, stride);
+
+	//compute second order derivatives
+	Dxx(im.I2 + o, im.I2xx + o, t.nx, t.ny, stride);
+	Dyy(im.I2 + o, im.I2yy + o, t.nx, t.ny, stride);
+	Dxy(im.I2 + o, im.I2xy + o, t.nx, t.ny, stride);
+    }
+
+    int linear_solves, linear_iter, linear_capped;
+    float linear_residual;
+    const int no = brox_solve(
+	im, nx, ny, stride, alpha, gamma, TOL, inner_iter, outer_iter, 
+	verbose, tiles, w, solver, linear_solves, linear_iter, linear_capped, linear_residual
+    );
+
+    //copy the flow back to the compact layout
+    copy_from_padded(im.u, u, nx, ny, stride);
+    copy_from_padded(im.v, v, nx, ny, stride);
+
+    return no;
+}
+
+
+/**
+  *
+  * Compute the range of an image
+  *
+**/
+void image_range(
+    const float *I, //input image
+    const int size, //size of the image
+    float &min,     //output minimum
+    float &max      //output maximum
+)
+{
+    const auto mm = std::minmax_element(I, &I[size]);
+    min = *mm.first;
+    max = *mm.second;
+}
+
+
+/**
+  *
+  * Coefficients of the normalization of a pair of images between 0 and 255,
+  * from the range of each image: In = a * I + b
+  *
+**/
+void normalization_factors(
+    const float min0, //minimum of image 1
+    const float max0, //maximum of image 1
+    const float min1, //minimum of image 2
+    const float max1, //maximum of image 2
+    float &a,         //output scale
+    float &b          //output offset
+)
+{
+    //compute the global max and min
+    const float max = std::max(max0, max1);
+    const float min = std::min(min0, min1);
+    const float den = max - min;
+
+    if(den > 0)
+    {
+	a = 255.0 / den;
+	b = -255.0 * min / den;
+    }
+    else
+    {
+	//keep the original data
+	a = 1;
+	b = 0;
+    }
+}
+
+
+/**
+  *
+  * Function to normalize the images between 0 and 255
+  *
+**/
+void image_normalization(
+    const float *I1,   //input image 1
+    const float *I2,   //input image 2
+    float       *I1n,  //normalized output image 1
+    float       *I2n,  //normalized output image 2 
+    int          size  //size of the image
+)
+{
+    float min0, max0, min1, max1, a, b;
+
+    image_range(I1, size, min0, max0);
+    image_range(I2, size, min1, max1);
+    normalization_factors(min0, max0, min1, max1, a, b);
+
+    for(int i = 0; i < size; i++)
+    {
+	I1n[i] = a * I1[i] + b;
+	I2n[i] = a * I2[i] + b;
+    }
+}
+
+
+/**
+  *
+  * Number of scales of a pyramid. The pyramid is cut at the first level
+  * smaller than MIN_SCALE_SIZE or too small for the zoom smoothing kernel,
+  * so that asking for more scales than the image supports is harmless
+  *
+**/
+int pyramid_depth(
+    const int nx,      //image width
+    const int ny,      //image height
+    const int nscales, //number of scales requested
+    const float nu     //downsampling factor
+)
+{
+    //size of the window used by zoom_out to smooth a level
+    const float zsigma = ZOOM_SIGMA_ZERO * sqrt(1.0/(nu*nu) - 1.0);
+    const int   zwin   = (int) (5 * zsigma) + 1;
+
+    int nx_s = nx, ny_s = ny;
+    int ns = 1;
+    while(ns < nscales)
+    {
+	int nx_n, ny_n;
+	zoom_size(nx_s, ny_s, nx_n, ny_n, nu);
+
+	if(nx_n < MIN_SCALE_SIZE || ny_n < MIN_SCALE_SIZE || zwin > nx_s || zwin > ny_s)
+	    break;
+
+	nx_s = nx_n;
+	ny_s = ny_n;
+	ns++;
+    }
+
+    return ns;
+}
+
+
+/**
+  *
+  * One scale of the pyramid of a frame
+  *
+**/
+struct brox_scale
+{
+    int nx, ny;                 //size of the scale
+    bool flat;                  //true if the image is constant
+    std::vector<float> I;       //smoothed and zoomed image
+    std::vector<float> Ix, Iy;  //gradient
+    std::vector<float> Ixx, Iyy, Ixy; //second order derivatives
+};
+
+
+/**
+  *
+  * Pyramid of a frame and its derivatives, before the normalization of a
+  * pair of frames. The smoothing, the zoom and the derivatives are linear,
+  * so normalizing a pair only scales and shifts these images, and a frame
+  * can be shared by two consecutive pairs
+  *
+**/
+struct brox_frame
+{
+    float min, max;                  //range of the input image
+    float nu;                        //downsampling factor
+    int   scales_requested;          //number of scales asked for
+    std::vector<brox_scale> scales;  //from the finest to the coarsest
+};
+
+
+/**
+  *
+  * Build the pyramid of a frame
+  *
+**/
+void build_frame(
+    const float *I,    //input image
+    const int nx,      //image width
+    const int ny,      //image height
+    const int nscales, //number of scales
+    const float nu,    //downsampling factor
+    brox_frame &f      //output frame
+)
+{
+    const int ns = pyramid_depth(nx, ny, nscales, nu);
+
+    image_range(I, nx * ny, f.min, f.max);
+    f.nu = nu;
+    f.scales_requested = nscales;
+    f.scales.resize(ns);
+
+    for(int s = 0; s < ns; s++)
+    {
+	brox_scale &sc = f.scales[s];
+
+	if(s == 0)
+	{
+	    //presmoothing the finest scale image
+	    sc.nx = nx;
+	    sc.ny = ny;
+	    sc.I.assign(I, I + nx * ny);
+	    gaussian(sc.I.data(), nx, ny, GAUSSIAN_SIGMA);
+	}
+	else
+	{
+	    //compute the zoom from the previous scale
+	    const brox_scale &prev = f.scales[s-1];
+	    zoom_size(prev.nx, prev.ny, sc.nx, sc.ny, nu);
+	    sc.I.resize(sc.nx * sc.ny);
+	    zoom_out(prev.I.data(), sc.I.data(), prev.nx, prev.ny, nu);
+	}
+
+	const int size = sc.nx * sc.ny;
+	const int stride = padded_stride(sc.nx);
+
+	float min, max;
+	image_range(sc.I.data(), size, min, max);
+	sc.flat = min == max;
+
+	//compute the derivatives in the padded layout
+	brox_workspace w;
+	float *P   = padded_image(w, 0, sc.ny, stride);
+	float *Px  = padded_image(w, 1, sc.ny, stride);
+	float *Py  = padded_image(w, 2, sc.ny, stride);
+	float *Pxx = padded_image(w, 3, sc.ny, stride);
+	float *Pyy = padded_image(w, 4, sc.ny, stride);
+	float *Pxy = padded_image(w, 5, sc.ny, stride);
+
+	copy_to_padded(sc.I.data(), P, sc.nx, sc.ny, stride);
+	neumann_border(P, sc.nx, sc.ny, stride);
+
+	gradient(P, Px, Py, sc.nx, sc.ny, stride);
+	Dxx(P, Pxx, sc.nx, sc.ny, stride);
+	Dyy(P, Pyy, sc.nx, sc.ny, stride);
+	Dxy(P, Pxy, sc.nx, sc.ny, stride);
+
+	sc.Ix.resize(size);
+	sc.Iy.resize(size);
+	sc.Ixx.resize(size);
+	sc.Iyy.resize(size);
+	sc.Ixy.resize(size);
+
+	copy_from_padded(Px,  sc.Ix.data(),  sc.nx, sc.ny, stride);
+	copy_from_padded(Py,  sc.Iy.data(),  sc.nx, sc.ny, stride);
+	copy_from_padded(Pxx, sc.Ixx.data(), sc.nx, sc.ny, stride);
+	copy_from_padded(Pyy, sc.Iyy.data(), sc.nx, sc.ny, stride);
+	copy_from_padded(Pxy, sc.Ixy.data(), sc.nx, sc.ny, stride);
+    }
+}
+
+
+/**
+  *
+  * Copy a compact image into the interior of a padded image, applying a
+  * scale and an offset
+  *
+**/
+inline void scale_to_padded(
+    const float *I,   //compact input image
+    float *P,         //padded output image
+    const int nx,     //image width
+    const int ny,     //image height
+    const int stride, //row length of the padded image
+    const float a,    //scale
+    const float b     //offset
+)
+{
+    for(int y = 0; y < ny; y++)
+	for(int x = 0; x < nx; x++)
+	    P[y * stride + x] = a * I[y * nx + x] + b;
+}
+
+
+/**
+  *
+  *  Multiscale approach for computing the optical flow between the pyramids
+  *  of two frames. With a warm start, u and v must hold the initial flow on
+  *  input. With an activity mask, only the tiles around active pixels are
+  *  computed at each scale and the flow elsewhere keeps the value it gets
+  *  from the coarser scale or the initial flow
+  *
+**/
+void brox_optic_flow(
+    const brox_frame &F1,    //pyramid of the first image
+    const brox_frame &F2,    //pyramid of the second image
+    float *u, 		      //x component of the optical flow
+    float *v, 		      //y component of the optical flow
+    const float  alpha,      //smoothness parameter
+    const float  gamma,      //gradient term parameter
+    const float  TOL,        //stopping criterion threshold
+    const int    inner_iter, //number of inner iterations
+    const int    outer_iter, //number of outer iterations
+    const bool   verbose,    //switch on messages
+    const brox_warm_start *warm = NULL, //optional warm start from u and v
+    brox_stats  *stats = NULL, //optional output statistics
+    const unsigned char *mask = NULL, //optional activity mask for the sparse mode
+    brox_workspace *ws = NULL, //optional buffers of the single-scale solver
+    const int solver = BROX_SOR //linear solver of the inner iterations
+)
+{
+    const float nu = F1.nu;
+    const int nxx = F1.scales[0].nx;
+    const int nyy = F1.scales[0].ny;
+    const int size = nxx * nyy;
+
+    //a warm start only needs the finest scales
+    const int nscales_cap = std::min(F1.scales.size(), F2.scales.size());
+    int ns = nscales_cap;
+    if(warm)
+	ns = std::max(1, std::min(warm->scales, ns));
+
+    const int niter = warm ? warm->outer_iter : outer_iter;
+
+    //normalize the pair of images between 0 and 255
+    float a, b;
+    normalization_factors(F1.min, F1.max, F2.min, F2.max, a, b);
+
+    brox_workspace local;
+    brox_workspace &w = ws ? *ws : local;
+
+    std::vector<float *> us (ns);
+    std::vector<float *> vs (ns);
+    std::vector<int> nx(ns);
+    std::vector<int> ny(ns);
+    std::vector<unsigned char *> ms(mask ? ns : 0);
+
+    us [0] = u;
+    vs [0] = v;
+
+    for(int s = 0; s < ns; s++)
+    {
+	nx[s] = F1.scales[s].nx;
+	ny[s] = F1.scales[s].ny;
+
+	if(s)
+	{
+	    us[s] = new float[nx[s] * ny[s]];
+	    vs[s] = new float[nx[s] * ny[s]];
+	}
+    }
+
+    //create the activity masks of the scales
+    if(mask)
+	for(int s = 0; s < ns; s++)
+	{
+	    ms[s] = new unsigned char[nx[s] * ny[s]];
+
+	    if(s == 0)
+		std::copy(mask, mask + size, ms[0]);
+	    else
+		zoom_out_mask(ms[s-1], ms[s], nx[s-1], ny[s-1], nx[s], ny[s], nu);
+	}
+
+    //pyramid of the initial flow, the finer scales only receive the
+    //correction computed at the coarser ones so the guess is not blurred
+    std::vector<float *> ugs(warm ? ns : 0);
+    std::vector<float *> vgs(warm ? ns : 0);
+
+    if(warm)
+	for(int s = 0; s < ns; s++)
+	{
+	    const int sizes = nx[s] * ny[s];
+
+	    ugs[s] = new float[sizes];
+	    vgs[s] = new float[sizes];
+
+	    if(s == 0)
+	    {
+		std::copy(u, u + sizes, ugs[0]);
+		std::copy(v, v + sizes, vgs[0]);
+		continue;
+	    }
+
+	    //downsample the initial flow from the previous scale
+	    zoom_out(ugs[s-1], ugs[s], nx[s-1], ny[s-1], nu);
+	    zoom_out(vgs[s-1], vgs[s], nx[s-1], ny[s-1], nu);
+
+	    for(int i = 0; i < sizes; i++)
+	    {
+		ugs[s][i] *= nu;
+		vgs[s][i] *= nu;
+	    }
+
+	    std::copy(ugs[s], ugs[s] + sizes, us[s]);
+	    std::copy(vgs[s], vgs[s] + sizes, vs[s]);
+	}
+    else
+	//initialization of the optical flow at the coarsest scale
+	for(int i = 0; i < nx[ns-1] * ny[ns-1]; i++)
+	    us[ns-1][i] = vs[ns-1][i] = 0.0;
+
+    brox_stats st = {F1.scales_requested, ns, 0, 0, 0, 0, 0, 0, 0.f};
+
+    if(verbose)
+	std::cout << "Scales: " << ns << " of " << F1.scales_requested << " requested (" 
+		  << nscales_cap << " usable)" << (warm ? ", warm start" : "") << std::endl;
+
+    //pyramid approach for computing the optical flow
+    for(int s = ns-1; s >= 0; s--)
+    {
+	if(verbose) std::cout << "Scale: " << s << std::endl;
+
+	const brox_scale &S1 = F1.scales[s];
+	const brox_scale &S2 = F2.scales[s];
+
+	//a pair of flat images carries no motion, keep the current flow
+	if(S1.flat && S2.flat)
+	    st.degenerate++;
+	else
+	{
+	    const int stride = padded_stride(nx[s]);
+
+	    //list the tiles to be processed
+	    std::vector<brox_tile> tiles;
+	    active_tiles(mask ? ms[s] : NULL, nx[s], ny[s], tiles);
+
+	    //normalize the images and their derivatives into the padded layout
+	    const brox_images im = input_images(w, ny[s], stride);
+
+	    scale_to_padded(S1.I.data(),   im.I1,   nx[s], ny[s], stride, a, b);
+	    scale_to_padded(S1.Ix.data(),  im.I1x,  nx[s], ny[s], stride, a, 0);
+	    scale_to_padded(S1.Iy.data(),  im.I1y,  nx[s], ny[s], stride, a, 0);
+	    scale_to_padded(S2.I.data(),   im.I2,   nx[s], ny[s], stride, a, b);
+	    scale_to_padded(S2.Ix.data(),  im.I2x,  nx[s], ny[s], stride, a, 0);
+	    scale_to_padded(S2.Iy.data(),  im.I2y,  nx[s], ny[s], stride, a, 0);
+	    scale_to_padded(S2.Ixx.data(), im.I2xx, nx[s], ny[s], stride, a, 0);
+	    scale_to_padded(S2.Iyy.data(), im.I2yy, nx[s], ny[s], stride, a, 0);
+	    scale_to_padded(S2.Ixy.data(), im.I2xy, nx[s], ny[s], stride, a, 0);
+	    copy_to_padded(us[s], im.u, nx[s], ny[s], stride);
+	    copy_to_padded(vs[s], im.v, nx[s], ny[s], stride);
+
+	    //compute the optical flow for the current scale
+	    int linear_solves, linear_iter, linear_capped;
+	    float linear_residual;
+	    const int no = brox_solve(
+		im, nx[s], ny[s], stride, alpha, gamma, TOL, inner_iter, niter, 
+		verbose, tiles, w, solver, linear_solves, linear_iter, linear_capped, linear_residual
+	    );
+
+	    copy_from_padded(im.u, us[s], nx[s], ny[s], stride);
+	    copy_from_padded(im.v, vs[s], nx[s], ny[s], stride);
+
+	    st.outer_iter += no;
+	    if(no < niter) st.early_exits++;
+	    st.linear_solves += linear_solves;
+	    st.linear_iter += linear_iter;
+	    st.linear_capped += linear_capped;
+	    st.linear_residual = std::max(st.linear_residual, linear_residual);
+	    if(verbose) std::cout << "Outer iterations: " << no << std::endl;
+	}
+
+	//if it is not the finer scale, then upsample the optical flow and adapt it conveniently
+	if(s && warm)
+	{
+	    //upsample the correction of the initial flow only
+	    for(int i = 0; i < nx[s] * ny[s]; i++)
+	    {
+		us[s][i] -= ugs[s][i];
+		vs[s][i] -= vgs[s][i];
+	    }
+
+	    zoom_in(us[s], us[s-1], nx[s], ny[s], nx[s-1], ny[s-1]);
+	    zoom_in(vs[s], vs[s-1], nx[s], ny[s], nx[s-1], ny[s-1]);
+
+	    for(int i = 0; i < nx[s-1] * ny[s-1]; i++)
+	    {
+		us[s-1][i] = ugs[s-1][i] + us[s-1][i] / nu;
+		vs[s-1][i] = vgs[s-1][i] + vs[s-1][i] / nu;
+	    }
+	}
+	else if(s)
+	{
+	    zoom_in(us[s], us[s-1], nx[s], ny[s], nx[s-1], ny[s-1]);
+	    zoom_in(vs[s], vs[s-1], nx[s], ny[s], nx[s-1], ny[s-1]);
+
+	    for(int i = 0; i < nx[s-1] * ny[s-1]; i++)
+	    {
+		us[s-1][i] *= 1.0 / nu;
+		vs[s-1][i] *= 1.0 / nu;
+	    }
+	}
+    }
+
+    if(verbose)
+	std::cout << "Outer iterations: " << st.outer_iter << ", early exits: " << st.early_exits
+		  << ", flat scales: " << st.degenerate << ", linear iterations: " << st.linear_iter 
+		  << " in " << st.linear_solves << " solves, " << st.linear_capped << " capped, largest residual "
+		  << st.linear_residual << std::endl;
+
+    if(stats) *stats = st;
+
+    //delete allocated memory
+    for(int i = 1; i < ns; i++)
+    {
+	delete []us [i];
+	delete []vs [i];
+    }
+
+    for(size_t i = 0; i < ugs.size(); i++)
+    {
+	delete []ugs[i];
+	delete []vgs[i];
+    }
+
+    for(size_t i = 0; i < ms.size(); i++)
+	delete []ms[i];
+}
+
+
+/**
+  *
+  *  Multiscale approach for computing the optical flow. The pyramid is cut
+  *  at the first level smaller than MIN_SCALE_SIZE (or too small for the
+  *  zoom smoothing kernel), so that asking for more scales than the image
+  *  supports is harmless. With a warm start, u and v must hold the
+  *  initial flow on input. With an activity mask, only the tiles around
+  *  active pixels are computed at each scale and the flow elsewhere keeps
+  *  the value it gets from the coarser scale or the initial flow
+  *
+**/
+void brox_optic_flow(
+    const float *I1,         //first image
+    const float *I2,         //second image
+    float *u, 		      //x component of the optical flow
+    float *v, 		      //y component of the optical flow
+    const int    nxx,        //image width
+    const int    nyy,        //image height
+    const float  alpha,      //smoothness parameter
+    const float  gamma,      //gradient term parameter
+    const int    nscales,    //number of scales
+    const float  nu,         //downsampling factor
+    const float  TOL,        //stopping criterion threshold
+    const int    inner_iter, //number of inner iterations
+    const int    outer_iter, //number of outer iterations
+    const bool   verbose,    //switch on messages
+    const brox_warm_start *warm = NULL, //optional warm start from u and v
+    brox_stats  *stats = NULL, //optional output statistics
+    const unsigned char *mask = NULL, //optional activity mask for the sparse mode
+    brox_workspace *ws = NULL, //optional buffers of the single-scale solver
+    const int solver = BROX_SOR //linear solver of the inner iterations
+)
+{
+    brox_frame F1, F2;
+
+    //a warm start only needs the finest scales
+    const int nbuild = warm ? std::min(nscales, std::max(1, warm->scales)) : nscales;
+
+    build_frame(I1, nxx, nyy, nbuild, nu, F1);
+    build_frame(I2, nxx, nyy, nbuild, nu, F2);
+    F1.scales_requested = F2.scales_requested = nscales;
+
+    brox_optic_flow(
+	F1, F2, u, v, alpha, gamma, TOL, inner_iter, outer_iter, 
+	verbose, warm, stats, mask, ws, solver
+    );
 }
 
 #endif
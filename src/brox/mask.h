@@ -9,115 +9,141 @@
 #ifndef MASK_H
 #define MASK_H
 
+#include <cstdlib>
+#include <cstring>
+
+#define BORDER 1 //width of the ghost border around padded images
+
 /**
  *
- * Function to apply a 3x3 mask to an image
+ * Row length of a padded image: the image width plus the ghost border,
+ * rounded up to a multiple of 16 floats so that every row starts on a
+ * cache line
  *
  */
-void mask3x3(
-    const float *input, //input image
-    float *output,      //output image
-    const int nx,       //image width
-    const int ny,       //image height
-    const float *mask   //mask to be applied
-)
+inline int padded_stride(const int nx)
 {
-    //apply the mask to the center body of the image
-    for(int i = 1; i < ny-1; i++)
-    {
-	for(int j = 1; j < nx-1; j++)
-	{
-	    double sum = 0;
-	    for(int l = 0; l < 3; l++)
-	    {
-		for(int m = 0; m < 3; m++)
-		{
-		    int p = (i + l -1) * nx + j + m -1;
-		    sum += input[p] * mask[l * 3 + m];
-		}
-	    }
-	    int k = i * nx + j;
-	    output[k] = sum;
-	}
-    }
-
-    //apply the mask to the first and last rows
-    for(int j = 1; j < nx-1; j++)
-    {
-	double sum = 0;
-	sum += input[j-1] * (mask[0] + mask[3]);
-	sum += input[ j ] * (mask[1] + mask[4]);
-	sum += input[j+1] * (mask[2] + mask[5]);
+    return ((nx + 2 * BORDER + 15) / 16) * 16;
+}
 
-	sum += input[nx + j-1] * mask[6];
-	sum += input[nx +  j ] * mask[7];
-	sum += input[nx + j+1] * mask[8];
 
-	output[j] = sum;
+/**
+ *
+ * Copy a compact image into the interior of a padded image
+ *
+ */
+inline void copy_to_padded(
+    const float *I,  //compact input image
+    float *P,        //padded output image
+    const int nx,    //image width
+    const int ny,    //image height
+    const int stride //row length of the padded image
+)
+{
+    for(int i = 0; i < ny; i++)
+	std::memcpy(P + i * stride, I + i * nx, sizeof(float) * nx);
+}
 
-	sum = 0;
-	sum += input[(ny-2)*nx+j-1] * mask[0];
-	sum += input[(ny-2)*nx+j  ] * mask[1];
-	sum += input[(ny-2)*nx+j+1] * mask[2];
 
-	sum += input[(ny-1)*nx+j-1] * (mask[6] + mask[3]);
-	sum += input[(ny-1)*nx+j  ] * (mask[7] + mask[4]);
-	sum += input[(ny-1)*nx+j+1] * (mask[8] + mask[5]);
+/**
+ *
+ * Copy the interior of a padded image into a compact image
+ *
+ */
+inline void copy_from_padded(
+    const float *P,  //padded input image
+    float *I,        //compact output image
+    const int nx,    //image width
+    const int ny,    //image height
+    const int stride //row length of the padded image
+)
+{
+    for(int i = 0; i < ny; i++)
+	std::memcpy(I + i * nx, P + i * stride, sizeof(float) * nx);
+}
 
-	output[(ny-1)*nx + j] = sum;
-    }
 
-    //apply the mask to the first and last columns
-    for(int i = 1; i < ny-1; i++)
+/**
+ *
+ * Refresh the ghost cells of a padded image with the Neumann boundary
+ * condition (the border pixels are replicated, corners included)
+ *
+ */
+inline void neumann_border(
+    float *I,        //padded image
+    const int nx,    //image width
+    const int ny,    //image height
+    const int stride //row length of the padded image
+)
+{
+    for(int i = 0; i < ny; i++)
     {
-	double sum = 0;
-	sum += input[(i - 1)*nx]   * (mask[0] + mask[1]);
-	sum += input[(i - 1)*nx+1] * mask[2];
-
-	sum += input[i * nx]   * (mask[3] + mask[4]);
-	sum += input[i * nx+1] * mask[5];
+	I[i * stride - 1]  = I[i * stride];
+	I[i * stride + nx] = I[i * stride + nx - 1];
+    }
 
-	sum += input[(i + 1)*nx]   * (mask[6] + mask[7]);
-	sum += input[(i + 1)*nx+1] * mask[8];
+    //the rows are copied with their ghost cells so the corners are set too
+    std::memcpy(I - stride - 1, I - 1, sizeof(float) * (nx + 2));
+    std::memcpy(I + ny * stride - 1, I + (ny - 1) * stride - 1, sizeof(float) * (nx + 2));
+}
 
-	output[i*nx] = sum;
 
-	sum = 0;
-	sum += input[i * nx-2] * mask[0];
-	sum += input[i * nx-1] * (mask[1] + mask[2]);
+/**
+ *
+ * Refresh the ghost cells of a padded image with the opposite value of the
+ * border pixels, so that the average across the image border vanishes (no
+ * flux through the border for the divergence coefficients)
+ *
+ */
+inline void noflux_border(
+    float *I,        //padded image
+    const int nx,    //image width
+    const int ny,    //image height
+    const int stride //row length of the padded image
+)
+{
+    for(int i = 0; i < ny; i++)
+    {
+	I[i * stride - 1]  = -I[i * stride];
+	I[i * stride + nx] = -I[i * stride + nx - 1];
+    }
 
-	sum += input[(i + 1)*nx-2] * mask[3];
-	sum += input[(i + 1)*nx-1] * (mask[4] + mask[5]);
+    for(int j = 0; j < nx; j++)
+    {
+	I[j - stride] = -I[j];
+	I[ny * stride + j] = -I[(ny - 1) * stride + j];
+    }
+}
 
-	sum += input[(i + 2)*nx-2] * mask[6];
-	sum += input[(i + 2)*nx-1] * (mask[7] + mask[8]);
 
-	output[i*nx + nx -1] = sum;
+/**
+ *
+ * Function to apply a 3x3 mask to an image. The ghost cells of the input
+ * image must hold the boundary condition
+ *
+ */
+void mask3x3(
+    const float *input, //padded input image
+    float *output,      //padded output image
+    const int nx,       //image width
+    const int ny,       //image height
+    const int stride,   //row length of the padded images
+    const float *mask   //mask to be applied
+)
+{
+    for(int i = 0; i < ny; i++)
+    {
+	const float *r0 = input + (i - 1) * stride;
+	const float *r1 = input + i * stride;
+	const float *r2 = input + (i + 1) * stride;
+	float *out = output + i * stride;
+
+	for(int j = 0; j < nx; j++)
+	    out[j] =
+		r0[j-1] * mask[0] + r0[j] * mask[1] + r0[j+1] * mask[2] +
+		r1[j-1] * mask[3] + r1[j] * mask[4] + r1[j+1] * mask[5] +
+		r2[j-1] * mask[6] + r2[j] * mask[7] + r2[j+1] * mask[8];
     }
-
-    //apply the mask to the four corners
-    output[0] = input[0]    * (mask[0] + mask[1] + mask[3] + mask[4]) +
-	input[1]    * (mask[2] + mask[5]) +
-	input[nx]   * (mask[6] + mask[7]) +
-	input[nx+1] * mask[8];
-
-    output[nx-1] =
-	input[nx-2]   * (mask[0] + mask[3]) +
-	input[nx-1]   * (mask[1] + mask[2] + mask[4] + mask[5]) +
-	input[2*nx-2] * mask[6] +
-	input[2*nx-1] * (mask[7] + mask[8]);
-
-    output[(ny-1)*nx] =
-	input[(ny-2)*nx]   * (mask[0] + mask[1]) +
-	input[(ny-2)*nx+1] *  mask[2] +
-	input[(ny-1)*nx]   * (mask[3] + mask[4] + mask[6] + mask[7]) +
-	input[(ny-1)*nx+1] * (mask[5] + mask[8]);
-
-    output[ny*nx-1] =
-	input[(ny-1)*nx-2] * mask[0] +
-	input[(ny-1)*nx-1] * (mask[1] + mask[2]) +
-	input[ny*nx-2] * (mask[3] + mask[6]) +
-	input[ny*nx-1] * (mask[4] + mask[5] + mask[7] + mask[8]);
 }
 
 /**
@@ -126,10 +152,11 @@ void mask3x3(
  *
  */
 void Dxx(
-    const float *I, //input image
-    float *Ixx,     //oputput derivative
-    const int nx,   //image width
-    const int ny    //image height
+    const float *I,  //input image
+    float *Ixx,      //oputput derivative
+    const int nx,    //image width
+    const int ny,    //image height
+    const int stride //row length of the padded images
 )
 {
     //mask of second derivative
@@ -138,7 +165,7 @@ void Dxx(
 		  0., 0., 0.};
 
     //computing the second derivative
-    mask3x3(I, Ixx, nx, ny, M);
+    mask3x3(I, Ixx, nx, ny, stride, M);
 }
 
 
@@ -148,10 +175,11 @@ void Dxx(
  *
  */
 void Dyy(
-    const float *I, //input image
-    float *Iyy,     //oputput derivative
-    const int nx,   //image width
-    const int ny    //image height
+    const float *I,  //input image
+    float *Iyy,      //oputput derivative
+    const int nx,    //image width
+    const int ny,    //image height
+    const int stride //row length of the padded images
 )
 {
     //mask of second derivative
@@ -160,7 +188,7 @@ void Dyy(
 		  0., 1., 0.};
 
     //computing the second derivative
-    mask3x3(I, Iyy, nx, ny, M);
+    mask3x3(I, Iyy, nx, ny, stride, M);
 }
 
 
@@ -170,10 +198,11 @@ void Dyy(
  *
  */
 void Dxy(
-    const float *I, //input image
-    float *Ixy,     //oputput derivative
-    const int nx,   //image width
-    const int ny    //image height
+    const float *I,  //input image
+    float *Ixy,      //oputput derivative
+    const int nx,    //image width
+    const int ny,    //image height
+    const int stride //row length of the padded images
 )
 {
     //mask of second derivative
@@ -182,77 +211,41 @@ void Dxy(
 		  -1./4., 0., 1./4.};
 
     //computing the second derivative
-    mask3x3(I, Ixy, nx, ny, M);
+    mask3x3(I, Ixy, nx, ny, stride, M);
 }
 
 
 /**
  *
- * Compute the gradient with central differences
+ * Compute the gradient with central differences. The ghost cells of the
+ * input image must hold the Neumann boundary condition
  *
  */
 void gradient(
-    const float *input, //input image
+    const float *input, //padded input image
     float *dx,          //computed x derivative
     float *dy,          //computed y derivative
     const int nx,       //image width
-    const int ny        //image height
+    const int ny,       //image height
+    const int stride    //row length of the padded images
 )
 {
-    //gradient in the center body of the image
-    for(int i = 1; i < ny-1; i++)
+    for(int i = 0; i < ny; i++)
     {
-	for(int j = 1; j < nx-1; j++)
+	for(int j = 0; j < nx; j++)
 	{
-	    const int k = i * nx + j;
+	    const int k = i * stride + j;
 	    dx[k] = 0.5*(input[k+1] - input[k-1]);
-	    dy[k] = 0.5*(input[k+nx] - input[k-nx]);
+	    dy[k] = 0.5*(input[k+stride] - input[k-stride]);
 	}
     }
-
-    //gradient in the first and last rows
-    for(int j = 1; j < nx-1; j++)
-    {
-	dx[j] = 0.5*(input[j+1] - input[j-1]);
-	dy[j] = 0.5*(input[j+nx] - input[j]);
-
-	const int k = (ny - 1) * nx + j;
-
-	dx[k] = 0.5*(input[k+1] - input[k-1]);
-	dy[k] = 0.5*(input[k] - input[k-nx]);
-    }
-
-    //gradient in the first and last columns
-    for(int i = 1; i < ny-1; i++)
-    {
-	const int p = i * nx;
-	dx[p] = 0.5*(input[p+1] - input[p]);
-	dy[p] = 0.5*(input[p+nx] - input[p-nx]);
-
-	const int k = (i+1) * nx - 1;
-
-	dx[k] = 0.5*(input[k] - input[k-1]);
-	dy[k] = 0.5*(input[k+nx] - input[k-nx]);
-    }
-
-    //calculate the gradient in the corners
-    dx[0] = 0.5*(input[1] - input[0]);
-    dy[0] = 0.5*(input[nx] - input[0]);
-
-    dx[nx-1] = 0.5*(input[nx-1] - input[nx-2]);
-    dy[nx-1] = 0.5*(input[2*nx-1] - input[nx-1]);
-
-    dx[(ny-1)*nx] = 0.5*(input[(ny-1)*nx + 1] - input[(ny-1)*nx]);
-    dy[(ny-1)*nx] = 0.5*(input[(ny-1)*nx] - input[(ny-2)*nx]);
-
-    dx[ny*nx-1] = 0.5*(input[ny*nx-1] - input[ny*nx-1-1]);
-    dy[ny*nx-1] = 0.5*(input[ny*nx-1] - input[(ny-1)*nx-1]);
 }
 
 
 /**
  *
- * Compute the coefficients of the divergence term
+ * Compute the coefficients of the divergence term. The ghost cells of the
+ * robust functional must hold the no-flux condition (see noflux_border)
  *
  */
 void psi_divergence(
@@ -262,84 +255,31 @@ void psi_divergence(
     float *psi3,      //coefficients of divergence
     float *psi4,      //coefficients of divergence
     const int nx,     //image width
-    const int ny      //image height
+    const int ny,     //image height
+    const int stride  //row length of the padded images
 )
 {
-    //calculate coefficients in the center body of the image
-    for(int i = 1; i < ny-1; i++)
+    for(int i = 0; i < ny; i++)
     {
-	for(int j = 1; j < nx-1; j++)
+	for(int j = 0; j < nx; j++)
 	{
-	    const int k = i * nx + j;
+	    const int k = i * stride + j;
 
-	    psi1[k] = 0.5 * (psi[k +nx] + psi[k]);
-	    psi2[k] = 0.5 * (psi[k -nx] + psi[k]);
+	    psi1[k] = 0.5 * (psi[k +stride] + psi[k]);
+	    psi2[k] = 0.5 * (psi[k -stride] + psi[k]);
 	    psi3[k] = 0.5 * (psi[k + 1] + psi[k]);
 	    psi4[k] = 0.5 * (psi[k - 1] + psi[k]);
 	}
     }
-
-    //calculate coefficients in the first and last rows
-    for(int j = 1; j < nx-1; j++)
-    {
-	psi1[j] = 0.5 * (psi[j +nx] + psi[j]);
-	psi2[j] = 0;
-	psi3[j] = 0.5 * (psi[j + 1] + psi[j]);
-	psi4[j] = 0.5 * (psi[j - 1] + psi[j]);
-
-	const int k  = (ny-1)*nx + j;
-	
-	psi1[k] = 0;
-	psi2[k] = 0.5 * (psi[k -nx] + psi[k]);
-	psi3[k] = 0.5 * (psi[k + 1] + psi[k]);
-	psi4[k] = 0.5 * (psi[k - 1] + psi[k]);
-    }
-
-    //calculate coefficients in the first and last columns
-    for(int i = 1; i < ny-1; i++)
-    {
-	const int k  = i*nx;
-	
-	psi1[k] = 0.5 * (psi[k +nx] + psi[k]);
-	psi2[k] = 0.5 * (psi[k -nx] + psi[k]);
-	psi3[k] = 0.5 * (psi[k + 1] + psi[k]);
-	psi4[k] = 0;
-
-	const int   j  = (i+1) * nx - 1;
-
-	psi1[j] = 0.5 * (psi[j +nx] + psi[j]);
-	psi2[j] = 0.5 * (psi[j -nx] + psi[j]);
-	psi3[j] = 0;
-	psi4[j] = 0.5 * (psi[j - 1] + psi[j]);
-    }
-
-    //up-left corner (0,0)
-    psi1[0] = 0.5 * (psi[nx] + psi[0]);
-    psi3[0] = 0.5 * (psi[1] + psi[0]);
-    psi2[0] = psi4[0] = 0;
-
-    //up-right corner (nx,0)
-    psi1[nx-1] = 0.5 * (psi[nx-1 + nx] + psi[nx-1]);
-    psi4[nx-1] = 0.5 * (psi[nx - 2] + psi[nx-1]);
-    psi2[nx-1] = psi3[nx-1] = 0;
-
-    //bottom-left corner (0,ny)
-    psi2[(ny-1)*nx] = 0.5 * (psi[(ny-2) * nx] + psi[(ny-1) * nx]);
-    psi3[(ny-1)*nx] = 0.5 * (psi[(ny-1)*nx + 1] + psi[(ny-1)*nx]);
-    psi1[(ny-1)*nx] = psi4[(ny-1)*nx] = 0;
-
-	    
-    //bottom-right corner (nx,ny)
-    psi2[ny*nx-1] = 0.5 * (psi[ny * nx - 1 - nx] + psi[ny * nx -1]);
-    psi4[ny*nx-1] = 0.5 * (psi[ny * nx - 2] + psi[ny * nx -1]);
-    psi1[ny*nx-1] = psi3[ny*nx-1] = 0;
 }
 
 
 
 /**
  *
- * Compute the divergence of the optical flow
+ * Compute the divergence of the optical flow. The coefficients vanish
+ * across the image border, so the ghost cells of the flow only need to
+ * hold finite values
  *
  */
 void divergence_u(
@@ -352,68 +292,22 @@ void divergence_u(
     float *div_u,      //computed divergence for u
     float *div_v,      //computed divergence for v
     const int nx,      //image width 
-    const int ny       //image height
+    const int ny,      //image height
+    const int stride   //row length of the padded images
 )
 {
-    //calculate the divergence in the center body of the image
-    for(int i = 1; i < ny-1; i++)
+    for(int i = 0; i < ny; i++)
     {
-	for(int j = 1; j < nx-1; j++)
+	for(int j = 0; j < nx; j++)
 	{
-	    const int k = i * nx + j;
+	    const int k = i * stride + j;
 
-	    div_u[k] = psi1[k] * (u[k + nx] - u[k]) + psi2[k] * (u[k - nx] - u[k]) + 
+	    div_u[k] = psi1[k] * (u[k + stride] - u[k]) + psi2[k] * (u[k - stride] - u[k]) + 
 			psi3[k] * (u[k + 1]  - u[k]) + psi4[k] * (u[k - 1]  - u[k]);
-	    div_v[k] = psi1[k] * (v[k + nx] - v[k]) + psi2[k] * (v[k - nx] - v[k]) + 
+	    div_v[k] = psi1[k] * (v[k + stride] - v[k]) + psi2[k] * (v[k - stride] - v[k]) + 
 			psi3[k] * (v[k + 1]  - v[k]) + psi4[k] * (v[k - 1]  - v[k]);
 	}
     }
-
-    //calculate the divergence in the first and last rows
-    for(int j = 1; j < nx-1; j++)
-    {
-	div_u[j] = psi1[j] * (u[j + nx] - u[j]) + psi3[j] * (u[j + 1]  - u[j]) + psi4[j] * (u[j - 1] - u[j]);
-	div_v[j] = psi1[j] * (v[j + nx] - v[j]) + psi3[j] * (v[j + 1]  - v[j]) + psi4[j] * (v[j - 1] - v[j]);
-
-	const int   k  = (ny-1)*nx + j;
-
-	div_u[k] = psi2[k] * (u[k - nx] - u[k]) + psi3[k] * (u[k + 1] - u[k]) + psi4[k] * (u[k - 1] - u[k]);
-	div_v[k] = psi2[k] * (v[k - nx] - v[k]) + psi3[k] * (v[k + 1] - v[k]) + psi4[k] * (v[k - 1] - v[k]);	
-    }
-
-    //calculate the divergence in the first and last columns
-    for(int i = 1; i < ny-1; i++)
-    {
-	const int   k  = i*nx;
-
-	div_u[k] = psi1[k] * (u[k + nx] - u[k]) + psi2[k] * (u[k - nx] - u[k]) + psi3[k] * (u[k + 1] - u[k]);
-	div_v[k] = psi1[k] * (v[k + nx] - v[k]) + psi2[k] * (v[k - nx] - v[k]) + psi3[k] * (v[k + 1] - v[k]);
-
-	const int   j  = (i+1) * nx - 1;
-
-	div_u[j] = psi1[j] * (u[j + nx] - u[j]) + psi2[j] * (u[j - nx] - u[j]) + psi4[j] * (u[j - 1] - u[j]);
-	div_v[j] = psi1[j] * (v[j + nx] - v[j]) + psi2[j] * (v[j - nx] - v[j]) + psi4[j] * (v[j - 1] - v[j]);
-    }
-
-    //up-left corner (0,0)
-    div_u[0] = psi1[0] * (u[nx] - u[0]) + psi3[0] * (u[1] - u[0]);
-    div_v[0] = psi1[0] * (v[nx] - v[0]) + psi3[0] * (v[1] - v[0]);
-
-    //up-right corner (nx,0)
-    div_u[nx-1] = psi1[nx-1] * (u[nx - 1 + nx] - u[nx-1]) + psi4[nx-1] * (u[nx - 2]  - u[nx - 1]);
-    div_v[nx-1] = psi1[nx-1] * (v[nx - 1 + nx] - v[nx-1]) + psi4[nx-1] * (v[nx - 2]  - v[nx - 1]);
-
-    //bottom-left corner (0,ny)
-    div_u[(ny-1)*nx] = psi2[(ny-1)*nx] * (u[(ny-2) * nx]     - u[(ny-1) * nx]) + 
-			psi3[(ny-1)*nx] * (u[(ny-1) * nx + 1] - u[(ny-1) * nx]);
-    div_v[(ny-1)*nx] = psi2[(ny-1)*nx] * (v[(ny-2) * nx]     - v[(ny-1) * nx]) + 
-			psi3[(ny-1)*nx] * (v[(ny-1) * nx + 1] - v[(ny-1) * nx]);
-	    
-    //bottom-right corner (nx,ny)
-    div_u[ny*nx-1] = psi2[ny*nx-1] * (u[ny * nx - 1 - nx] - u[ny * nx - 1]) + 
-		      psi4[ny*nx-1] * (u[ny * nx - 2]      - u[ny * nx - 1]);
-    div_v[ny*nx-1] = psi2[ny*nx-1] * (v[ny * nx - 1 - nx] - v[ny * nx - 1]) + 
-		      psi4[ny*nx-1] * (v[ny * nx - 2]      - v[ny * nx - 1]);
 }
 
 #endif
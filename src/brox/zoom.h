@@ -71,7 +71,7 @@ void zoom_out(
 		const float i2  = (float) i1 / factor;
 		const float j2  = (float) j1 / factor;
 
-		Iout[i1 * nxx + j1] = bicubic_interpolation(Is, j2, i2, nx, ny);
+		Iout[i1 * nxx + j1] = bicubic_interpolation(Is, j2, i2, nx, ny, nx);
 	    }
 
     delete []Is;
@@ -103,7 +103,7 @@ void zoom_in(
 		float i2 =  (float) i1 / factory;
 		float j2 =  (float) j1 / factorx;
 
-		Iout[i1 * nxx + j1] = bicubic_interpolation(I, j2, i2, nx, ny); 
+		Iout[i1 * nxx + j1] = bicubic_interpolation(I, j2, i2, nx, ny, nx);
 	    }
 }
 
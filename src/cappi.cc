@@ -1,4 +1,6 @@
 #include "cappi.h"
+#include "gate_bits.h"
+#include "geometry.h"
 
 auto compute_roi(const float range, const float beamwidth, const float max_roi) -> float{
   float roi = range * beamwidth * (M_PI / 180.0);
@@ -10,29 +12,6 @@ auto compute_roi(const float range, const float beamwidth, const float max_roi)
   return roi;
 }
 
-auto find_ground_range_bin(array1<bin_info> const& bins, float target) -> size_t{
-  auto ipos = std::upper_bound(bins.begin(), bins.end(), target, [](auto& l, auto& r) { return l < r.ground_range; });
-  if (ipos == bins.end())
-    return bins.size();
-  if (ipos == bins.begin())
-    return 0;
-  if (std::fabs(ipos->ground_range - target) < std::fabs((ipos - 1)->ground_range - target))
-    return ipos - bins.begin();
-  return ipos - bins.begin() - 1;
-}
-
-auto find_ray(array1<angle> const& rays, angle target) -> size_t{
-  // HACK - not handling 0/360 well
-  auto ipos = std::upper_bound(rays.begin(), rays.end(), target);
-  if (ipos == rays.end())
-    return rays.size() - 1;
-  if (ipos == rays.begin())
-    return 0;
-  if (abs(*ipos - target) < abs(*(ipos - 1) - target))
-    return ipos - rays.begin();
-  return ipos - rays.begin() - 1;
-}
-
 auto generate_cappi(
       volume const& vol
     , array2<latlon> const& latlons
@@ -73,25 +52,25 @@ auto generate_cappi(
       {
         auto& scan = vol.sweeps[iscan];
 
-        auto ibin = find_ground_range_bin(scan.bins, br.second);
+        auto ibin = find_ground_range_bin(scan, br.second);
         if (ibin >= scan.bins.size())
           continue;
-        roi = compute_roi(scan.bins[ibin].ground_range, beamwidth, max_roi);
+        roi = compute_roi(scan.bins.ground_range[ibin], beamwidth, max_roi);
 
-        auto alt_dist = scan.bins[ibin].altitude - altitude;
+        auto alt_dist = scan.bins.altitude[ibin] - altitude;
         if (alt_dist > max_alt_diff)
           continue;
         if(iscan == topscan || alt_dist < - max_alt_diff)
           continue;
 
         auto iray = find_ray(scan.rays, br.first);
-        auto val = scan.data[iray][ibin];
-        if (std::isnan(val) || std::fabs(val - undetect) < .1f)
+        if (!is_valid(scan, iray, ibin))
           continue;
+        auto val = gate_value(scan, iray, ibin);
 
         if (alt_dist <= 0)
         {
-          if (lwr_scan == -1 || scan.bins[ibin].altitude > vol.sweeps[lwr_scan].bins[lwr_bin].altitude)
+          if (lwr_scan == -1 || scan.bins.altitude[ibin] > vol.sweeps[lwr_scan].bins.altitude[lwr_bin])
           {
             lwr_scan = iscan;
             lwr_bin = ibin;
@@ -99,7 +78,7 @@ auto generate_cappi(
             lwr_dist = -alt_dist;
           }
         } else {
-          if (upr_scan == -1 || scan.bins[ibin].altitude < vol.sweeps[upr_scan].bins[upr_bin].altitude)
+          if (upr_scan == -1 || scan.bins.altitude[ibin] < vol.sweeps[upr_scan].bins.altitude[upr_bin])
           {
             upr_scan = iscan;
             upr_bin = ibin;
@@ -5,8 +5,6 @@
 using namespace bom;
 
 auto compute_roi(const float range, const float beamwidth, const float max_roi) -> float;
-auto find_ground_range_bin(array1<bin_info> const& bins, float target) -> size_t;
-auto find_ray(array1<angle> const& rays, angle target) -> size_t;
 auto generate_cappi(
       volume const& vol
     , array2<latlon> const& latlons
@@ -1,108 +1,7 @@
 #include "corrections.h"
 
-auto correct_undetect(volume& vol) -> void {
-  for (auto& scan : vol.sweeps) {
-    for (size_t ibin = 0; ibin < scan.bins.size(); ++ibin) {
-      for (size_t iray = 0; iray < scan.rays.size(); ++iray) {
-        if (std::fabs(scan.data[iray][ibin] - undetect) < 0.001f) {
-          scan.data[iray][ibin] = nodata;
-        }
-      }
-    }
-  }
-}
-
-auto unfold(float v, float vref, float vnq, float vshift) -> float
-{
-  auto delv = v - vref;
-  float unfld = 0.0;
-  if(std::fabs(delv) < vnq){
-    unfld = v;
-  } else {
-    auto sign = (delv > 0 ? 1 : -1);
-    unfld = v - static_cast<int>(delv + sign * vnq / vshift) * vshift;
-  }
-
-  return unfld;
-}
-
-auto mad_filter(
-      volume &velocity
-      , const array1f& nyquist
-      , float delta_vmax
-      , size_t nfilter
-    ) -> void
-{
-  // Mean Average Deviation filtering technique to remove noise from Doppler.
-  int cnt = 0;
-  for (size_t iscan = 0; iscan < velocity.sweeps.size(); ++iscan)
-  {
-    auto vnyquist = nyquist[iscan];
-    auto vshift = 2 * vnyquist;
-    auto& scan = velocity.sweeps[iscan];
-    for(size_t iray = 0; iray < scan.rays.size(); ++iray)
-    {
-      for(size_t ibin = 0; ibin < scan.bins.size() - nfilter; ++ibin)
-      {
-        auto n1 = ibin;
-        auto n2 = (n1 + nfilter < scan.bins.size() ? n1 + nfilter : scan.bins.size());
-        array1f vselected{n2 - n1}, vplus{n2 - n1}, vminus{n2 - n1};
-        vselected.fill(nodata);
-        vplus.fill(nodata);
-        vminus.fill(nodata);
-
-        for(size_t i = 0 ; i < n2 - n1 ; ++i)
-        {
-          vselected[i] = scan.data[iray][i + n1];
-          if(vselected[i] >= 0)
-            vplus[i] = scan.data[iray][i + n1];
-          else
-            vminus[i] = scan.data[iray][i + n1];
-        }
-
-        auto vmean = mean(vselected);
-        if(std::isnan(vmean))
-          continue;
-        auto vmean_plus = mean(vplus);
-        auto vmean_minus = mean(vminus);
-
-        for(size_t i = 0 ; i < n2 - n1 ; ++i)
-        {
-          if(std::isnan(vselected[i]))
-            continue;
-          auto vk = vselected[i];
-          if(std::fabs(vk - vmean) >= delta_vmax)
-          {
-            auto vk_unfold = nodata;
-            auto dvk = 0.f;
-            if(vmean >= 0)
-            {
-              vk_unfold = unfold(vk, vmean_plus, vnyquist, vshift);
-              dvk = std::fabs(vk - vmean_plus);
-            }
-            else
-            {
-              vk_unfold = unfold(vk, vmean_minus, vnyquist, vshift);
-              dvk = std::fabs(vk - vmean_minus);
-            }
-            if(std::isnan(vk_unfold))
-              continue;
-            if(std::fabs(vk_unfold - vmean) < delta_vmax || dvk < delta_vmax)
-            {
-              cnt += 1;
-              velocity.sweeps[iscan].data[iray][ibin + i] = vk_unfold;
-            }
-            else
-            {
-              velocity.sweeps[iscan].data[iray][ibin + i] = nodata;
-            }
-          }
-        }
-      }
-    }
-  }
-}
-
+#include <numeric>
+#include <queue>
 
 auto speckle_filter(array2f& data, float min_dbz, int min_neighbours) -> void
 {
@@ -127,4 +26,182 @@ auto speckle_filter(array2f& data, float min_dbz, int min_neighbours) -> void
         data[y][x] = min_dbz;
     }
   }
-}
\ No newline at end of file
+}
+
+// Union-find over the gates of a sweep, with path halving and union by size.
+struct gate_sets{
+  vector<int> parent;
+  vector<int> size;
+
+  explicit gate_sets(size_t n) : parent(n), size(n, 1){
+    for (size_t i = 0; i < n; ++i)
+      parent[i] = i;
+  }
+
+  auto find(int a) -> int{
+    while (parent[a] != a){
+      parent[a] = parent[parent[a]];
+      a = parent[a];
+    }
+    return a;
+  }
+
+  auto join(int a, int b) -> void{
+    a = find(a);
+    b = find(b);
+    if (a == b)
+      return;
+    if (size[a] < size[b])
+      std::swap(a, b);
+    parent[b] = a;
+    size[a] += size[b];
+  }
+};
+
+auto region_dealias(
+      array2f& velocity
+    , vector<unsigned char>& failed
+    , float nyquist
+    , float missing
+    ) -> size_t
+{
+  const auto nbins = velocity.extents().x;
+  const auto nrays = velocity.extents().y;
+  const auto ngates = nbins * nrays;
+
+  // Neighbours closer than this belong to the same continuous region.
+  const auto max_jump = 0.5f * nyquist;
+
+  auto v = velocity.data();
+  auto valid = [&](size_t g){ return v[g] != missing && !std::isnan(v[g]); };
+  auto open = [&](size_t g){ return failed[g] && valid(g); };
+
+  if (!(nyquist > 0) || std::none_of(failed.begin(), failed.end(), [](unsigned char f){ return f != 0; }))
+    return 0;
+
+  // Segment the failed gates into continuous regions, rays wrap in azimuth.
+  gate_sets sets{ngates};
+  for (size_t j = 0; j < nrays; ++j){
+    const auto jn = (j + 1) % nrays;
+    for (size_t i = 0; i < nbins; ++i){
+      const auto g = j * nbins + i;
+      if (!open(g))
+        continue;
+      if (i + 1 < nbins && open(g + 1) && std::fabs(v[g + 1] - v[g]) < max_jump)
+        sets.join(g, g + 1);
+      const auto gn = jn * nbins + i;
+      if (gn != g && open(gn) && std::fabs(v[gn] - v[g]) < max_jump)
+        sets.join(g, gn);
+    }
+  }
+
+  // Number the regions. Each gathers the votes of its dealiased neighbours,
+  // the sum of their differences and their count, and the differences
+  // across its borders with the other regions.
+  vector<int> region(ngates, -1);
+  vector<size_t> size;
+  vector<double> sum;
+  vector<int> count;
+  for (size_t g = 0; g < ngates; ++g){
+    if (!open(g))
+      continue;
+    const auto root = sets.find(g);
+    if (region[root] < 0){
+      region[root] = size.size();
+      size.push_back(0);
+      sum.push_back(0.0);
+      count.push_back(0);
+    }
+    region[g] = region[root];
+    size[region[g]]++;
+  }
+
+  struct border{
+    int from, to;
+    double diff; // sum of v[from gate] - v[to gate]
+    int count;
+  };
+  vector<border> borders;
+  auto link = [&](size_t g, size_t gn){
+    if (!open(g) || !valid(gn))
+      return;
+    if (!failed[gn]){
+      sum[region[g]] += v[gn] - v[g];
+      count[region[g]]++;
+    }
+    else if (region[gn] != region[g])
+      borders.push_back({region[gn], region[g], v[gn] - v[g], 1});
+  };
+  for (size_t j = 0; j < nrays; ++j){
+    const auto jn = (j + 1) % nrays;
+    for (size_t i = 0; i < nbins; ++i){
+      const auto g = j * nbins + i;
+      const auto gn = jn * nbins + i;
+      if (i + 1 < nbins){
+        link(g, g + 1);
+        link(g + 1, g);
+      }
+      if (gn != g){
+        link(g, gn);
+        link(gn, g);
+      }
+    }
+  }
+
+  // One border per pair of regions, grouped by the region voting.
+  std::sort(borders.begin(), borders.end(), [](border const& a, border const& b){
+    return a.from != b.from ? a.from < b.from : a.to < b.to;
+  });
+  size_t nborders = 0;
+  for (size_t k = 0; k < borders.size(); ++k){
+    if (nborders > 0 && borders[nborders - 1].from == borders[k].from && borders[nborders - 1].to == borders[k].to){
+      borders[nborders - 1].diff += borders[k].diff;
+      borders[nborders - 1].count += borders[k].count;
+    }
+    else
+      borders[nborders++] = borders[k];
+  }
+  borders.resize(nborders);
+  const auto nregions = size.size();
+  vector<size_t> first(nregions + 1, 0);
+  for (auto const& b : borders)
+    first[b.from + 1]++;
+  std::partial_sum(first.begin(), first.end(), first.begin());
+
+  // A single pass over the regions, the largest first among those with a
+  // vote. Each is shifted by the multiple of nyquist that best agrees with
+  // its neighbours, as unfold_to_reference folds, then votes for the
+  // regions it borders.
+  std::priority_queue<std::pair<size_t, int>> ready;
+  for (size_t r = 0; r < nregions; ++r)
+    if (count[r] > 0)
+      ready.push({size[r], int(r)});
+  vector<char> done(nregions, 0);
+  vector<float> shift(nregions, 0.f);
+  while (!ready.empty()){
+    const auto r = ready.top().second;
+    ready.pop();
+    if (done[r])
+      continue;
+    done[r] = 1;
+    shift[r] = std::round(sum[r] / count[r] / nyquist) * nyquist;
+    for (auto k = first[r]; k < first[r + 1]; ++k){
+      auto const& b = borders[k];
+      if (done[b.to])
+        continue;
+      sum[b.to] += b.diff + b.count * shift[r];
+      count[b.to] += b.count;
+      ready.push({size[b.to], b.to});
+    }
+  }
+
+  size_t shifted = 0;
+  for (size_t g = 0; g < ngates; ++g){
+    if (region[g] < 0 || !done[region[g]])
+      continue;
+    v[g] += shift[region[g]];
+    failed[g] = 0;
+    shifted += shift[region[g]] != 0.f;
+  }
+  return shifted;
+}
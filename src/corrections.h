@@ -5,14 +5,18 @@
 #include "array_operations.h"
 using namespace bom;
 
-auto correct_undetect(volume& vol) -> void;
-auto unfold(float v, float vref, float vnq, float vshift) -> float;
-auto mad_filter(
-      volume &velocity
-      , const array1f& nyquist
-      , float delta_vmax = 5.f
-      , size_t nfilter = 10
-    ) -> void;
 auto speckle_filter(array2f& data, float min_dbz, int min_neighbours) -> void;
 
+// Fallback for the gates a reference could not unfold (failed != 0, indexed
+// ray * nbins + bin). They are grouped in continuous regions, which are
+// shifted by multiples of nyquist, as unfold_to_reference folds, to agree
+// with their dealiased neighbours, the largest regions first. Returns the
+// number of gates that changed.
+auto region_dealias(
+      array2f& velocity
+    , vector<unsigned char>& failed
+    , float nyquist
+    , float missing
+    ) -> size_t;
+
 #endif
\ No newline at end of file
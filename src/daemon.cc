@@ -0,0 +1,334 @@
+#include "daemon.h"
+#include "metrics.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <csignal>
+#include <deque>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <poll.h>
+#include <set>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static std::atomic<bool> stop_requested{false};
+
+static auto request_stop(int) -> void{
+  stop_requested = true;
+}
+
+// Site of a volume, the name up to its first underscore.
+static auto volume_site(std::filesystem::path const& path) -> string{
+  auto name = path.filename().string();
+  return name.substr(0, name.find('_'));
+}
+
+static auto is_volume(std::filesystem::path const& path) -> bool{
+  auto name = path.filename().string();
+  return !name.empty() && name[0] != '.' && path.extension() == ".h5" && name.find('_') != string::npos;
+}
+
+// A volume handed to a worker, one tab separated line on its job pipe.
+struct daemon_job{
+  std::filesystem::path vad, lag1, lag0, output, lag_output;
+};
+
+static auto write_line(int fd, string const& line) -> void{
+  auto ptr = line.data();
+  auto size = line.size();
+  while (size > 0){
+    auto n = write(fd, ptr, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw std::runtime_error("unable to write to daemon worker pipe");
+    ptr += n;
+    size -= n;
+  }
+}
+
+// Body of a worker process: jobs in, one result line per job out. A result
+// line is short enough to be written atomically on the shared pipe.
+static auto run_worker(size_t id, int jobs, int results, volume_processor const& process) -> void{
+  auto in = fdopen(jobs, "r");
+  char* buf = nullptr;
+  size_t cap = 0;
+  while (getline(&buf, &cap, in) > 0){
+    std::istringstream line{buf};
+    string vad, lag1, lag0, output, lag_output;
+    std::getline(line, vad, '\t');
+    std::getline(line, lag1, '\t');
+    std::getline(line, lag0, '\t');
+    std::getline(line, output, '\t');
+    std::getline(line, lag_output, '\n');
+
+    bool ok = true;
+    const auto start = std::chrono::steady_clock::now();
+    try{
+      process(vad, lag1, lag0, output, lag_output);
+    }
+    catch (std::exception& err){
+      trace::error("processing {} failed: {}", lag0, err.what());
+      ok = false;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    metrics::observe(metrics::stage::volume, elapsed.count());
+    metrics::record_memory();
+    std::cout.flush();
+    write_line(results, std::to_string(id) + ' ' + (ok ? "1 " : "0 ") + std::to_string(elapsed.count()) + '\n');
+  }
+  free(buf);
+  fclose(in);
+}
+
+namespace {
+  struct worker{
+    pid_t pid = -1;
+    int jobs = -1;  // write end of its job pipe
+    bool busy = false;
+    string site;
+    daemon_job job;
+  };
+}
+
+// Forks worker id. The child drops the pipe ends of the other workers, so
+// closing a job pipe in the daemon is seen as the end of the jobs. It also
+// drops listener, the metrics socket of the daemon (-1 without one), which
+// close-on-exec doesn't keep from a fork without exec.
+static auto spawn_worker(size_t id, int const results[2], int listener, vector<worker>& workers, volume_processor const& process) -> void{
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0)
+    throw std::runtime_error("unable to create daemon worker pipe");
+  std::cout.flush();
+  auto pid = fork();
+  if (pid < 0)
+    throw std::runtime_error("unable to fork daemon worker");
+  if (pid == 0){
+    close(fds[1]);
+    close(results[0]);
+    if (listener >= 0)
+      close(listener);
+    for (size_t i = 0; i < workers.size(); ++i)
+      if (i != id && workers[i].jobs >= 0)
+        close(workers[i].jobs);
+    // A stop reaches the workers as the end of their jobs, so the volume in
+    // progress completes.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    set_default_threads(std::max<size_t>(1, std::thread::hardware_concurrency() / workers.size()));
+    metrics::set_worker(id);
+    run_worker(id, fds[0], results[1], process);
+    std::cout.flush();
+    _exit(EXIT_SUCCESS);
+  }
+  close(fds[0]);
+  workers[id] = worker{};
+  workers[id].pid = pid;
+  workers[id].jobs = fds[1];
+}
+
+auto run_daemon(daemon_options const& opts, volume_processor const& process) -> void{
+  std::filesystem::create_directories(opts.output);
+
+  const int watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch < 0)
+    throw std::runtime_error("unable to initialise inotify");
+  std::map<int, std::filesystem::path> spools;
+  for (auto const& dir : opts.spools){
+    auto wd = inotify_add_watch(watch, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0)
+      throw std::runtime_error("unable to watch spool " + dir.string());
+    spools[wd] = dir;
+  }
+
+  // Volumes spooled while the daemon was down are queued when they are newer
+  // than the latest output of their site. The latest volume already done is
+  // the lag of the first one, its output with chain set.
+  std::map<string, std::filesystem::path> latest;
+  if (std::filesystem::is_directory(opts.output))
+    for (auto const& dir : std::filesystem::directory_iterator{opts.output})
+      if (dir.is_directory())
+        for (auto const& entry : std::filesystem::directory_iterator{dir.path()})
+          if (entry.is_regular_file() && is_volume(entry.path()) && volume_site(entry.path()) == dir.path().filename().string()){
+            auto& done = latest[volume_site(entry.path())];
+            if (done.empty() || done.filename() < entry.path().filename())
+              done = entry.path();
+          }
+
+  std::map<string, std::filesystem::path> last;
+  std::map<string, std::set<std::filesystem::path>> spooled;
+  for (auto const& dir : opts.spools)
+    for (auto const& entry : std::filesystem::directory_iterator{dir})
+      if (entry.is_regular_file() && is_volume(entry.path())){
+        const auto site = volume_site(entry.path());
+        auto done = latest.find(site);
+        if (done == latest.end() || done->second.filename() < entry.path().filename())
+          spooled[site].insert(entry.path());
+        else{
+          auto& lag = last[site];
+          if (lag.empty() || lag.filename() < entry.path().filename())
+            lag = entry.path();
+        }
+      }
+  if (opts.chain)
+    for (auto const& [site, done] : latest)
+      last[site] = done;
+
+  std::unique_ptr<metrics_server> server;
+  if (!opts.metrics.empty())
+    server = std::make_unique<metrics_server>(opts.metrics);
+  std::map<string, metrics::site_counts> sites;
+
+  int results[2];
+  if (pipe2(results, O_CLOEXEC) != 0)
+    throw std::runtime_error("unable to create daemon result pipe");
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, request_stop);
+  signal(SIGTERM, request_stop);
+
+  const size_t nworkers = opts.workers ? opts.workers : std::max(1u, std::thread::hardware_concurrency());
+  vector<worker> workers(nworkers);
+  for (size_t i = 0; i < nworkers; ++i)
+    spawn_worker(i, results, server ? server->fd() : -1, workers, process);
+  std::cout << "watching " << spools.size() << " spools with " << nworkers << " workers" << std::endl;
+
+  std::map<string, std::deque<std::filesystem::path>> pending;
+  size_t backlog = 0;
+  for (auto const& [site, paths] : spooled){
+    backlog += paths.size();
+    for (auto const& path : paths)
+      pending[site].push_back(path);
+  }
+  if (backlog > 0)
+    std::cout << "queued " << backlog << " volumes spooled while the daemon was down" << std::endl;
+
+  std::set<string> busy_sites;
+  size_t done = 0, failed = 0;
+
+  auto finish = [&](worker& w, bool ok, double seconds){
+    const auto input = w.job.lag0;
+    last[w.site] = opts.chain && ok ? w.job.output : input;
+    busy_sites.erase(w.site);
+    w.busy = false;
+    ++done;
+    failed += !ok;
+    ++(ok ? sites[w.site].processed : sites[w.site].failed);
+    std::cout << (ok ? "processed " : "failed ") << input.filename().string() << " in " << std::fixed << std::setprecision(2)
+              << seconds << " s (" << done << " volumes, " << failed << " failed)" << std::endl;
+  };
+
+  auto dispatch = [&]{
+    for (auto& [site, queue] : pending){
+      if (queue.empty() || busy_sites.count(site))
+        continue;
+      // The worker that ran the site last may still hold its frames.
+      const string name = site;
+      auto w = std::find_if(workers.begin(), workers.end(), [&](worker const& w){ return !w.busy && w.site == name; });
+      if (w == workers.end())
+        w = std::find_if(workers.begin(), workers.end(), [](worker const& w){ return !w.busy; });
+      if (w == workers.end())
+        return;
+
+      auto input = queue.front();
+      queue.pop_front();
+      daemon_job job;
+      job.lag0 = input;
+      job.lag1 = last.count(site) ? last[site] : input;
+      job.output = opts.output / site / input.filename();
+      if (last.count(site))
+        job.lag_output = opts.output / site / last[site].filename();
+      if (!opts.vad_dir.empty()){
+        auto stem = input.filename().string();
+        auto vad = opts.vad_dir / (stem.substr(0, stem.find('.')) + ".dat");
+        if (std::filesystem::exists(vad))
+          job.vad = vad;
+      }
+      std::filesystem::create_directories(job.output.parent_path());
+
+      w->busy = true;
+      w->site = site;
+      w->job = job;
+      busy_sites.insert(site);
+      write_line(w->jobs, job.vad.string() + '\t' + job.lag1.string() + '\t' + job.lag0.string() + '\t' + job.output.string() + '\t' + job.lag_output.string() + '\n');
+    }
+  };
+
+  string partial;
+  alignas(inotify_event) char events[4096];
+  while (!stop_requested){
+    pollfd fds[3] = {{watch, POLLIN, 0}, {results[0], POLLIN, 0}, {server ? server->fd() : -1, POLLIN, 0}};
+    if (poll(fds, 3, 1000) < 0 && errno != EINTR)
+      throw std::runtime_error("daemon poll failed");
+
+    if (fds[2].revents & POLLIN)
+      server->serve(sites);
+
+    if (fds[0].revents & POLLIN){
+      ssize_t n;
+      while ((n = read(watch, events, sizeof(events))) > 0){
+        for (char* p = events; p < events + n; ){
+          auto ev = reinterpret_cast<inotify_event*>(p);
+          p += sizeof(inotify_event) + ev->len;
+          if (ev->len == 0 || (ev->mask & IN_ISDIR))
+            continue;
+          // The watches start before the spools are listed, so a volume may
+          // be queued already.
+          auto path = spools[ev->wd] / ev->name;
+          if (is_volume(path) && !spooled[volume_site(path)].erase(path))
+            pending[volume_site(path)].push_back(path);
+        }
+      }
+    }
+
+    if (fds[1].revents & POLLIN){
+      char buf[512];
+      auto n = read(results[0], buf, sizeof(buf));
+      if (n > 0)
+        partial.append(buf, n);
+      for (size_t eol; (eol = partial.find('\n')) != string::npos; partial.erase(0, eol + 1)){
+        std::istringstream line{partial.substr(0, eol)};
+        size_t id;
+        int ok;
+        double seconds;
+        if (line >> id >> ok >> seconds && id < workers.size() && workers[id].busy)
+          finish(workers[id], ok, seconds);
+      }
+    }
+
+    // A worker that died takes its volume with it and is replaced.
+    int status;
+    for (pid_t pid; (pid = waitpid(-1, &status, WNOHANG)) > 0; ){
+      for (size_t i = 0; i < workers.size(); ++i){
+        if (workers[i].pid != pid)
+          continue;
+        trace::error("daemon worker {} died", pid);
+        close(workers[i].jobs);
+        if (workers[i].busy)
+          finish(workers[i], false, 0.0);
+        workers[i].jobs = -1;
+        spawn_worker(i, results, server ? server->fd() : -1, workers, process);
+      }
+    }
+
+    dispatch();
+
+    size_t queued = 0;
+    for (auto const& [site, queue] : pending)
+      queued += queue.size();
+    metrics::set(metrics::gauge::queued_volumes, queued);
+    metrics::set(metrics::gauge::busy_workers, busy_sites.size());
+  }
+
+  // Closing the job pipes lets the workers finish their volume and exit.
+  std::cout << "stopping, waiting for " << busy_sites.size() << " volumes in progress" << std::endl;
+  for (auto& w : workers)
+    close(w.jobs);
+  for (auto& w : workers)
+    waitpid(w.pid, nullptr, 0);
+  close(watch);
+  close(results[0]);
+  close(results[1]);
+}
@@ -0,0 +1,35 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "pch.h"
+#include "reprocess.h"
+
+using namespace bom;
+
+// Long running processing of the volumes landing in spool directories,
+// watched with inotify. Volumes are <site>_<date>_<time>.<ext>.h5 files,
+// closed after writing or renamed into a spool. Each is paired with the
+// previous volume of its site as lag and with <site>_<date>_<time>.dat of
+// the VAD directory when there is one.
+struct daemon_options{
+  vector<std::filesystem::path> spools;
+  std::filesystem::path vad_dir; // empty: profiles retrieved from the volumes
+  std::filesystem::path output;  // dealiased volumes, by site
+  size_t workers = 0;            // 0 uses every core
+  bool chain = true;             // outputs hold the volume, usable as lag
+  string metrics;                // metrics endpoint, see metrics_server
+};
+
+// Runs until SIGINT or SIGTERM, after which the volumes in progress are
+// completed. The volumes go to a pool of persistent worker processes, forked
+// once, as HDF5 is not thread safe, so what they cache (the land/sea mask,
+// the reference LUTs, the layer pyramids) stays warm from one volume to the
+// next. Volumes of a site run one at a time, in arrival order, preferably on
+// the worker that ran the site last, so with chain set each uses the
+// dealiased output of the one before. Volumes spooled while the daemon was
+// down, newer than the latest output of their site, are queued first. The
+// metrics reach the endpoint from the workers when metrics::share() was
+// called before.
+auto run_daemon(daemon_options const& opts, volume_processor const& process) -> void;
+
+#endif
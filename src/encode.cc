@@ -0,0 +1,172 @@
+#include "encode.h"
+
+auto read_output_encoding(io::configuration const& config) -> output_encoding{
+  output_encoding enc;
+  enc.type = config.optional("output_encoding", enc.type);
+  enc.deflate = config.optional("output_deflate", enc.deflate);
+  enc.shuffle = config.optional("output_shuffle", enc.shuffle);
+  if (enc.type != "f32" && enc.type != "u16")
+    throw std::invalid_argument("Invalid values for parameter in configuration file ('output_encoding')");
+  if (enc.deflate < 0 || enc.deflate > 9)
+    throw std::invalid_argument("Invalid values for parameter in configuration file ('output_deflate')");
+  return enc;
+}
+
+auto quantise(array2f const& data, float missing) -> quantised_sweep{
+  auto valid = [&](float v){ return v != missing && !std::isnan(v); };
+
+  float lo = std::numeric_limits<float>::max(), hi = std::numeric_limits<float>::lowest();
+  for (auto v : data){
+    if (valid(v)){
+      lo = std::min(lo, v);
+      hi = std::max(hi, v);
+    }
+  }
+
+  quantised_sweep q;
+  q.codes.resize(data.size());
+  if (lo > hi)
+    return q;
+
+  // value = gain * code + offset, with code 1 at the lowest value.
+  q.gain = hi > lo ? double(hi - lo) / 65534.0 : 1.0;
+  q.offset = lo - q.gain;
+  for (size_t i = 0; i < data.size(); ++i){
+    const auto v = data.data()[i];
+    if (!valid(v))
+      continue;
+    const auto code = std::clamp(std::lround((v - q.offset) / q.gain), 1L, 65535L);
+    q.codes[i] = code;
+    q.max_error = std::max(q.max_error, float(std::fabs(q.gain * code + q.offset - v)));
+  }
+  return q;
+}
+
+// Closes an HDF5 identifier on scope exit.
+struct h5_handle{
+  hid_t id;
+  herr_t (*close)(hid_t);
+  ~h5_handle(){ if (id >= 0) close(id); }
+};
+
+static auto set_attribute(hid_t loc, const char* name, double value) -> void{
+  auto space = h5_handle{H5Screate(H5S_SCALAR), H5Sclose};
+  auto attr = h5_handle{H5Acreate2(loc, name, H5T_NATIVE_DOUBLE, space.id, H5P_DEFAULT, H5P_DEFAULT), H5Aclose};
+  if (attr.id < 0 || H5Awrite(attr.id, H5T_NATIVE_DOUBLE, &value) < 0)
+    throw std::runtime_error(string("unable to write attribute ") + name);
+}
+
+// ODIM strings are fixed length and null terminated.
+static auto set_attribute(hid_t loc, const char* name, string const& value) -> void{
+  auto type = h5_handle{H5Tcopy(H5T_C_S1), H5Tclose};
+  H5Tset_size(type.id, value.size() + 1);
+  H5Tset_strpad(type.id, H5T_STR_NULLTERM);
+  auto space = h5_handle{H5Screate(H5S_SCALAR), H5Sclose};
+  auto attr = h5_handle{H5Acreate2(loc, name, type.id, space.id, H5P_DEFAULT, H5P_DEFAULT), H5Aclose};
+  if (attr.id < 0 || H5Awrite(attr.id, type.id, value.c_str()) < 0)
+    throw std::runtime_error(string("unable to write attribute ") + name);
+}
+
+static auto get_string_attribute(hid_t loc, const char* name) -> string{
+  if (H5Aexists(loc, name) <= 0)
+    return {};
+  auto attr = h5_handle{H5Aopen(loc, name, H5P_DEFAULT), H5Aclose};
+  auto type = h5_handle{H5Aget_type(attr.id), H5Tclose};
+  if (H5Tget_class(type.id) != H5T_STRING || H5Tis_variable_str(type.id))
+    return {};
+  string value(H5Tget_size(type.id), '\0');
+  H5Aread(attr.id, type.id, value.data());
+  return value.substr(0, value.find('\0'));
+}
+
+odim_data_writer::odim_data_writer(std::filesystem::path const& path)
+  : id_{H5Fopen(path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT)}
+{
+  if (id_ < 0)
+    throw std::runtime_error("unable to open " + path.string() + " for writing");
+}
+
+odim_data_writer::~odim_data_writer(){
+  H5Fclose(id_);
+}
+
+auto odim_data_writer::append(
+      size_t scan
+    , layout const& what
+    , hid_t type
+    , const void* values
+    , size_t rows
+    , size_t cols
+    , output_encoding const& enc
+    ) -> size_t
+{
+  const auto scan_name = "dataset" + std::to_string(scan + 1);
+  auto scan_group = h5_handle{H5Gopen2(id_, scan_name.c_str(), H5P_DEFAULT), H5Gclose};
+  if (scan_group.id < 0)
+    throw std::runtime_error("no " + scan_name + " in the output volume");
+
+  string data_name;
+  for (size_t n = 1; ; ++n){
+    data_name = "data" + std::to_string(n);
+    if (H5Lexists(scan_group.id, data_name.c_str(), H5P_DEFAULT) <= 0)
+      break;
+  }
+  auto group = h5_handle{H5Gcreate2(scan_group.id, data_name.c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), H5Gclose};
+
+  // Blocks of whole rays, about 64k values each.
+  const hsize_t dims[2] = {rows, cols};
+  const hsize_t chunk[2] = {std::clamp<hsize_t>(65536 / std::max<size_t>(cols, 1), 1, std::max<size_t>(rows, 1)), std::max<size_t>(cols, 1)};
+  auto dcpl = h5_handle{H5Pcreate(H5P_DATASET_CREATE), H5Pclose};
+  if (enc.deflate > 0 || enc.shuffle){
+    H5Pset_chunk(dcpl.id, 2, chunk);
+    if (enc.shuffle)
+      H5Pset_shuffle(dcpl.id);
+    if (enc.deflate > 0)
+      H5Pset_deflate(dcpl.id, enc.deflate);
+  }
+
+  auto space = h5_handle{H5Screate_simple(2, dims, nullptr), H5Sclose};
+  auto dset = h5_handle{H5Dcreate2(group.id, "data", type, space.id, H5P_DEFAULT, dcpl.id, H5P_DEFAULT), H5Dclose};
+  if (dset.id < 0 || H5Dwrite(dset.id, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, values) < 0)
+    throw std::runtime_error("unable to write " + what.quantity + " to " + scan_name + "/" + data_name);
+  set_attribute(dset.id, "CLASS", string("IMAGE"));
+  set_attribute(dset.id, "IMAGE_VERSION", string("1.2"));
+
+  auto what_group = h5_handle{H5Gcreate2(group.id, "what", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), H5Gclose};
+  set_attribute(what_group.id, "quantity", what.quantity);
+  set_attribute(what_group.id, "gain", what.gain);
+  set_attribute(what_group.id, "offset", what.offset);
+  set_attribute(what_group.id, "nodata", what.nodata);
+  set_attribute(what_group.id, "undetect", what.undetect);
+
+  return H5Dget_storage_size(dset.id);
+}
+
+auto moment_storage(std::filesystem::path const& path, string const& quantity) -> size_t{
+  H5E_auto2_t handler;
+  void* client;
+  H5Eget_auto2(H5E_DEFAULT, &handler, &client);
+  H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr);
+
+  size_t bytes = 0;
+  auto file = h5_handle{H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT), H5Fclose};
+  for (size_t k = 1; file.id >= 0; ++k){
+    const auto scan_name = "dataset" + std::to_string(k);
+    if (H5Lexists(file.id, scan_name.c_str(), H5P_DEFAULT) <= 0)
+      break;
+    for (size_t n = 1; ; ++n){
+      const auto name = scan_name + "/data" + std::to_string(n);
+      if (H5Lexists(file.id, name.c_str(), H5P_DEFAULT) <= 0)
+        break;
+      auto what = h5_handle{H5Gopen2(file.id, (name + "/what").c_str(), H5P_DEFAULT), H5Gclose};
+      if (what.id < 0 || get_string_attribute(what.id, "quantity") != quantity)
+        continue;
+      auto dset = h5_handle{H5Dopen2(file.id, (name + "/data").c_str(), H5P_DEFAULT), H5Dclose};
+      if (dset.id >= 0)
+        bytes += H5Dget_storage_size(dset.id);
+    }
+  }
+
+  H5Eset_auto2(H5E_DEFAULT, handler, client);
+  return bytes;
+}
@@ -0,0 +1,57 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include "pch.h"
+
+#include <hdf5.h>
+
+using namespace bom;
+
+// Encoding of the dealiased moment in the output volume.
+struct output_encoding{
+  string type = "f32"; // f32 or u16
+  int deflate = 0;     // zlib level, 0 leaves the data uncompressed
+  bool shuffle = false;
+};
+
+auto read_output_encoding(io::configuration const& config) -> output_encoding;
+
+// A sweep quantised to uint16 over the range of its values. Code 0 is
+// nodata and undetect, the values use codes 1 to 65535.
+struct quantised_sweep{
+  vector<uint16_t> codes;
+  double gain = 1.0;
+  double offset = 0.0;
+  float max_error = 0.f; // largest error of a decoded value
+};
+
+auto quantise(array2f const& data, float missing) -> quantised_sweep;
+
+// Data groups written straight through HDF5, which bom does not offer with
+// chunking and compression. The file is opened a second time next to the
+// bom handle, HDF5 shares the open file between both.
+class odim_data_writer{
+public:
+  explicit odim_data_writer(std::filesystem::path const& path);
+  ~odim_data_writer();
+
+  odim_data_writer(odim_data_writer const&) = delete;
+  auto operator=(odim_data_writer const&) -> odim_data_writer& = delete;
+
+  struct layout{
+    string quantity;
+    double gain, offset, nodata, undetect;
+  };
+
+  // Adds the next dataN group of /dataset<scan + 1>, rows are rays. Returns
+  // the bytes the dataset takes in the file.
+  auto append(size_t scan, layout const& what, hid_t type, const void* values, size_t rows, size_t cols, output_encoding const& enc) -> size_t;
+
+private:
+  hid_t id_;
+};
+
+// Bytes the datasets of a moment take in a volume file.
+auto moment_storage(std::filesystem::path const& path, string const& quantity) -> size_t;
+
+#endif
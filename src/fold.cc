@@ -0,0 +1,60 @@
+#include "fold.h"
+#include "gate_bits.h"
+#include "io.h"
+
+auto fold_index(array2f const& dealiased, sweep const& raw, float nyquist, float missing) -> array2<uint8_t>{
+  const auto [nbins, nrays] = dealiased.extents();
+  array2<uint8_t> folds{dealiased.extents()};
+  folds.fill(fold_nodata);
+  if (!(nyquist > 0.f))
+    return folds;
+
+  vector<float> buffer;
+  for (size_t j = 0; j < nrays; ++j){
+    const auto row = sweep_row(raw, j, buffer);
+    const auto valid = valid_row(raw, j);
+    for (size_t i = 0; i < nbins; ++i){
+      const auto v = dealiased[j][i];
+      if (v == missing || std::isnan(v) || !((valid[i / 64] >> (i % 64)) & 1))
+        continue;
+      const auto n = std::lround((v - row[i]) / nyquist);
+      folds[j][i] = std::clamp<long>(n + fold_offset, 1, 255);
+    }
+  }
+  return folds;
+}
+
+auto rebuild_velocity(sweep const& raw, sweep const& folds, float nyquist) -> array2f{
+  const auto extents = sweep_extents(raw);
+  array2f velocity{extents};
+  velocity.fill(nodata);
+
+  vector<float> buffer, fold_buffer;
+  for (size_t j = 0; j < extents.y && j < folds.rays.size(); ++j){
+    const auto row = sweep_row(raw, j, buffer);
+    const auto n = sweep_row(folds, j, fold_buffer);
+    for (size_t i = 0; i < extents.x && i < folds.bins.size(); ++i)
+      if (is_valid(raw, j, i) && is_valid(folds, j, i))
+        velocity[j][i] = row[i] + n[i] * nyquist;
+  }
+  return velocity;
+}
+
+auto read_dealiased(std::filesystem::path const& filename, io::configuration const& config, thread_pool* pool) -> volume{
+  const string velocity = config["velocity"];
+  io::odim::polar_volume vol_odim{filename, io_mode::read_only};
+  auto contents = read_odim(vol_odim, {velocity, "VRAD_FOLD"}, config, false, filename, pool);
+
+  auto& raw = contents.moments[velocity];
+  auto& folds = contents.moments["VRAD_FOLD"];
+  volume vol;
+  vol.location = contents.location;
+  for (size_t k = 0; k < raw.sweeps.size() && k < folds.sweeps.size(); ++k){
+    auto swp = std::move(raw.sweeps[k]);
+    swp.data = rebuild_velocity(swp, folds.sweeps[k], contents.nyquist[k]);
+    swp.packed = packed_data{};
+    build_gate_bits(swp, nodata);
+    vol.sweeps.push_back(std::move(swp));
+  }
+  return vol;
+}
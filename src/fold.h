@@ -0,0 +1,27 @@
+#ifndef FOLD_H
+#define FOLD_H
+
+#include "pch.h"
+#include "thread_pool.h"
+
+using namespace bom;
+
+// The dealiased velocity is the raw velocity plus n times the Nyquist
+// velocity. The fold-index product stores n alone, one byte per gate, as
+// code n + 128 so it decodes with gain 1 and offset -128. Code 0 is nodata.
+constexpr uint8_t fold_nodata = 0;
+constexpr int fold_offset = 128;
+
+// Fold index of every gate of a dealiased sweep, missing marking the gates
+// without a dealiased value.
+auto fold_index(array2f const& dealiased, sweep const& raw, float nyquist, float missing) -> array2<uint8_t>;
+
+// Dealiased velocity from the raw moment and the decoded fold index, NaN
+// where either has no value.
+auto rebuild_velocity(sweep const& raw, sweep const& folds, float nyquist) -> array2f;
+
+// Dealiased velocity of a volume holding the raw moment and VRAD_FOLD,
+// read in one pass. Sweeps lacking either are left empty.
+auto read_dealiased(std::filesystem::path const& filename, io::configuration const& config, thread_pool* pool = nullptr) -> volume;
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef GATE_BITS_H
+#define GATE_BITS_H
+
+#include "pch.h"
+#include "packed.h"
+using namespace bom;
+
+// Validity of the gates as bit-planes, derived once when a moment is
+// decoded so the kernels test bits instead of float sentinels. A word of
+// zero valid bits lets a kernel skip 64 gates at once.
+
+inline auto valid_row(sweep const& swp, size_t ray) -> const uint64_t*{
+  return swp.mask.valid.data() + ray * swp.mask.words;
+}
+
+inline auto is_valid(sweep const& swp, size_t ray, size_t bin) -> bool{
+  return (valid_row(swp, ray)[bin / 64] >> (bin % 64)) & 1;
+}
+
+inline auto is_undetect(sweep const& swp, size_t ray, size_t bin) -> bool{
+  return (swp.mask.undetect[ray * swp.mask.words + bin / 64] >> (bin % 64)) & 1;
+}
+
+// Undetect gates are those the file flags as undetect. Float moments that
+// decode undetect to NaN can't tell them from nodata, both are invalid.
+inline auto build_gate_bits(sweep& swp, float undetect_value) -> void{
+  const auto extents = sweep_extents(swp);
+  const auto nbins = extents.x;
+  const auto nrays = extents.y;
+
+  auto& m = swp.mask;
+  m.words = (nbins + 63) / 64;
+  m.valid.assign(m.words * nrays, 0);
+  m.undetect.assign(m.words * nrays, 0);
+
+  for (size_t j = 0; j < nrays; ++j){
+    auto valid = m.valid.data() + j * m.words;
+    auto undet = m.undetect.data() + j * m.words;
+
+    if (is_packed(swp)){
+      const auto& p = swp.packed;
+      with_codes(p, [&](auto const& codes){
+        const auto raw = codes[j];
+        for (size_t i = 0; i < nbins; ++i){
+          const uint64_t u = raw[i] == p.undetect;
+          const uint64_t v = raw[i] != p.nodata && !u;
+          valid[i / 64] |= v << (i % 64);
+          undet[i / 64] |= u << (i % 64);
+        }
+      });
+    } else {
+      const auto row = swp.data[j];
+      for (size_t i = 0; i < nbins; ++i){
+        const uint64_t u = row[i] == undetect_value;
+        const uint64_t v = !std::isnan(row[i]) && !u;
+        valid[i / 64] |= v << (i % 64);
+        undet[i / 64] |= u << (i % 64);
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,91 @@
+#include "geometry.h"
+
+// Spacing of a sequence when every value lies on start + i * spacing,
+// zero when it does not.
+template <typename F>
+static auto uniform_spacing(size_t n, F value) -> double{
+  if (n < 2)
+    return 0.0;
+  const auto start = value(0);
+  const auto scale = (value(n - 1) - start) / (n - 1);
+  for (size_t i = 1; i < n - 1; ++i)
+    if (std::fabs(value(i) - (start + i * scale)) > 1e-3 * std::fabs(scale))
+      return 0.0;
+  return scale;
+}
+
+auto set_geometry(sweep& swp, vector<float> const& slant_range, vector<angle> const& azimuth) -> void{
+  const auto nbins = slant_range.size();
+  auto& bins = swp.bins;
+  bins.slant_range = slant_range;
+  bins.ground_range.resize(nbins);
+  bins.altitude.resize(nbins);
+  for (size_t i = 0; i < nbins; ++i)
+    std::tie(bins.ground_range[i], bins.altitude[i]) = swp.beam.ground_range_altitude(slant_range[i]);
+  bins.start = nbins > 0 ? slant_range[0] : 0.f;
+  bins.scale = uniform_spacing(nbins, [&](size_t i){ return double(slant_range[i]); });
+
+  const auto nrays = azimuth.size();
+  auto& rays = swp.rays;
+  rays.azimuth = azimuth;
+  rays.sin_az.resize(nrays);
+  rays.cos_az.resize(nrays);
+  for (size_t j = 0; j < nrays; ++j){
+    rays.sin_az[j] = std::sin(azimuth[j].radians());
+    rays.cos_az[j] = std::cos(azimuth[j].radians());
+  }
+  rays.start = nrays > 0 ? azimuth[0] : 0_deg;
+  rays.scale = uniform_spacing(nrays, [&](size_t j){ return azimuth[j].degrees(); }) * 1_deg;
+
+  swp.cos_el = std::cos(swp.beam.elevation().radians());
+  swp.sin_el = std::sin(swp.beam.elevation().radians());
+}
+
+auto find_ground_range_bin(sweep const& swp, float target) -> size_t{
+  const auto& bins = swp.bins;
+  const auto n = bins.size();
+  const auto& g = bins.ground_range;
+  if (n == 0 || target >= g[n - 1])
+    return n;
+  if (target < g[0])
+    return 0;
+
+  // Evenly spaced bins: the slant range of the target under the 4/3 earth
+  // model gives the bin by arithmetic. Otherwise the ground range is close
+  // to linear in the bin index. Either guess is at most a bin or two away.
+  size_t i;
+  if (bins.scale != 0.f){
+    constexpr double effective_radius = 4.0 / 3.0 * 6371000.0;
+    const double theta = target / effective_radius;
+    const double r = effective_radius * std::sin(theta) / std::cos(theta + swp.beam.elevation().radians());
+    i = size_t(std::max(0.0, (r - bins.start) / bins.scale));
+  } else
+    i = size_t((target - g[0]) / (g[n - 1] - g[0]) * (n - 1));
+  i = std::min(i, n - 2);
+  while (i > 0 && g[i] > target)
+    --i;
+  while (g[i + 1] <= target)
+    ++i;
+  return std::fabs(g[i + 1] - target) < std::fabs(g[i] - target) ? i + 1 : i;
+}
+
+auto find_ray(ray_geometry const& rays, angle target) -> size_t{
+  const auto n = rays.size();
+  if (n == 0)
+    return 0;
+
+  // Evenly spaced rays around the whole circle, wrapping at 0/360.
+  const auto scale = rays.scale.degrees();
+  if (scale != 0.0 && std::fabs(std::fabs(scale) * n - 360.0) < 0.5 * std::fabs(scale)){
+    auto pos = std::lround(std::fmod((target - rays.start).degrees(), 360.0) / scale) % long(n);
+    return pos < 0 ? pos + n : pos;
+  }
+
+  // Irregular rays, sorted by azimuth: the closer of the two neighbours.
+  auto const& az = rays.azimuth;
+  auto diff = [&](size_t j){ return std::fabs(std::remainder((az[j] - target).degrees(), 360.0)); };
+  size_t hi = std::upper_bound(az.begin(), az.end(), target) - az.begin();
+  size_t lo = hi == 0 ? n - 1 : hi - 1;
+  hi = hi == n ? 0 : hi;
+  return diff(hi) < diff(lo) ? hi : lo;
+}
@@ -0,0 +1,17 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include "pch.h"
+using namespace bom;
+
+// Fill the bin and ray geometry of a sweep whose beam is already set, and
+// detect even spacing so lookups can use arithmetic instead of searches.
+auto set_geometry(sweep& swp, vector<float> const& slant_range, vector<angle> const& azimuth) -> void;
+
+// Bin with the closest ground range, bins.size() beyond the last bin.
+auto find_ground_range_bin(sweep const& swp, float target) -> size_t;
+
+// Ray with the closest azimuth.
+auto find_ray(ray_geometry const& rays, angle target) -> size_t;
+
+#endif
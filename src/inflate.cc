@@ -0,0 +1,128 @@
+#include "inflate.h"
+
+#include <zlib.h>
+
+chunk_file::chunk_file(std::filesystem::path const& path)
+  : id_{H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT)}
+{
+  if (id_ < 0)
+    throw std::runtime_error("unable to open " + path.string() + " for chunk reads");
+}
+
+chunk_file::~chunk_file(){
+  H5Fclose(id_);
+}
+
+// Closes an HDF5 identifier on scope exit.
+struct h5_closer{
+  hid_t id;
+  herr_t (*close)(hid_t);
+  ~h5_closer(){ if (id >= 0) close(id); }
+};
+
+auto fetch_chunks(chunk_file const& file, string const& path, chunked_dataset& ds) -> bool{
+  ds = chunked_dataset{};
+
+  // Errors here only mean falling back to the normal read, keep them quiet.
+  H5E_auto2_t handler;
+  void* client;
+  H5Eget_auto2(H5E_DEFAULT, &handler, &client);
+  H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr);
+  struct restore{ H5E_auto2_t h; void* c; ~restore(){ H5Eset_auto2(H5E_DEFAULT, h, c); } } on_exit{handler, client};
+
+  auto dset = h5_closer{H5Dopen2(file.id(), path.c_str(), H5P_DEFAULT), H5Dclose};
+  if (dset.id < 0)
+    return false;
+
+  auto type = h5_closer{H5Dget_type(dset.id), H5Tclose};
+  const auto tclass = H5Tget_class(type.id);
+  ds.elem = H5Tget_size(type.id);
+  ds.is_float = tclass == H5T_FLOAT;
+  if (H5Tget_order(type.id) != H5Tget_order(H5T_NATIVE_INT) && ds.elem > 1)
+    return false;
+  if (ds.is_float ? ds.elem != 4 : (tclass != H5T_INTEGER || H5Tget_sign(type.id) != H5T_SGN_NONE || ds.elem > 2))
+    return false;
+
+  auto space = h5_closer{H5Dget_space(dset.id), H5Sclose};
+  hsize_t dims[2];
+  if (H5Sget_simple_extent_ndims(space.id) != 2 || H5Sget_simple_extent_dims(space.id, dims, nullptr) < 0)
+    return false;
+  ds.rows = dims[0];
+  ds.cols = dims[1];
+
+  auto dcpl = h5_closer{H5Dget_create_plist(dset.id), H5Pclose};
+  hsize_t cdims[2];
+  if (H5Pget_layout(dcpl.id) != H5D_CHUNKED || H5Pget_chunk(dcpl.id, 2, cdims) != 2)
+    return false;
+  ds.chunk_rows = cdims[0];
+  ds.chunk_cols = cdims[1];
+
+  for (int i = 0; i < H5Pget_nfilters(dcpl.id); ++i){
+    unsigned flags, config;
+    size_t nvalues = 0;
+    auto filter = H5Pget_filter2(dcpl.id, i, &flags, &nvalues, nullptr, 0, nullptr, &config);
+    if (filter != H5Z_FILTER_DEFLATE && filter != H5Z_FILTER_SHUFFLE)
+      return false;
+    ds.filters.push_back(filter);
+  }
+
+  hsize_t nchunks = 0;
+  const auto expected = ((ds.rows + ds.chunk_rows - 1) / ds.chunk_rows) * ((ds.cols + ds.chunk_cols - 1) / ds.chunk_cols);
+  if (H5Dget_num_chunks(dset.id, space.id, &nchunks) < 0 || nchunks != expected)
+    return false;
+
+  ds.chunks.resize(nchunks);
+  for (hsize_t i = 0; i < nchunks; ++i){
+    auto& c = ds.chunks[i];
+    hsize_t offset[2], size;
+    haddr_t addr;
+    if (H5Dget_chunk_info(dset.id, space.id, i, offset, &c.mask, &addr, &size) < 0)
+      return false;
+    c.row = offset[0];
+    c.col = offset[1];
+    c.bytes.resize(size);
+    uint32_t mask;
+    if (H5Dread_chunk(dset.id, H5P_DEFAULT, offset, &mask, c.bytes.data()) < 0)
+      return false;
+  }
+  return true;
+}
+
+auto inflate_chunks(chunked_dataset const& ds, vector<unsigned char>& values) -> bool{
+  const auto chunk_size = ds.chunk_rows * ds.chunk_cols * ds.elem;
+  vector<unsigned char> a(chunk_size), b(chunk_size);
+  values.resize(ds.rows * ds.cols * ds.elem);
+
+  for (auto const& c : ds.chunks){
+    // Undo the filters in reverse, skipping those masked for this chunk.
+    const unsigned char* src = c.bytes.data();
+    size_t len = c.bytes.size();
+    for (size_t f = ds.filters.size(); f-- > 0; ){
+      if (c.mask & (1u << f))
+        continue;
+      auto& dst = src == a.data() ? b : a;
+      if (ds.filters[f] == H5Z_FILTER_DEFLATE){
+        uLongf out = chunk_size;
+        if (uncompress(dst.data(), &out, src, len) != Z_OK)
+          return false;
+        len = out;
+      } else {
+        // Shuffle stores byte k of every value together.
+        const auto n = len / ds.elem;
+        for (size_t k = 0; k < ds.elem; ++k)
+          for (size_t i = 0; i < n; ++i)
+            dst[i * ds.elem + k] = src[k * n + i];
+      }
+      src = dst.data();
+    }
+    if (len != chunk_size)
+      return false;
+
+    // Edge chunks are stored whole, copy only the part inside the dataset.
+    const auto nr = std::min(ds.chunk_rows, ds.rows - c.row);
+    const auto nc = std::min(ds.chunk_cols, ds.cols - c.col);
+    for (size_t r = 0; r < nr; ++r)
+      std::copy_n(src + r * ds.chunk_cols * ds.elem, nc * ds.elem, values.data() + ((c.row + r) * ds.cols + c.col) * ds.elem);
+  }
+  return true;
+}
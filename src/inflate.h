@@ -0,0 +1,53 @@
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include "pch.h"
+
+#include <hdf5.h>
+
+using namespace bom;
+
+// Direct access to the compressed chunks of ODIM datasets, so that deflate
+// runs on the thread pool instead of inside the single threaded HDF5
+// library. Only the fetch touches HDF5, the inflate is plain zlib.
+
+// Read only handle on the file, next to the one bom holds.
+class chunk_file{
+public:
+  explicit chunk_file(std::filesystem::path const& path);
+  ~chunk_file();
+
+  chunk_file(chunk_file const&) = delete;
+  auto operator=(chunk_file const&) -> chunk_file& = delete;
+
+  auto id() const -> hid_t { return id_; }
+
+private:
+  hid_t id_;
+};
+
+// Compressed chunks of one rank 2 dataset, as stored in the file.
+struct chunked_dataset{
+  struct chunk{
+    size_t row, col;             // of the first value
+    unsigned mask;               // filters skipped for this chunk
+    vector<unsigned char> bytes;
+  };
+
+  size_t rows = 0, cols = 0;
+  size_t chunk_rows = 0, chunk_cols = 0;
+  size_t elem = 0;               // bytes per value
+  bool is_float = false;
+  vector<H5Z_filter_t> filters;  // in the order applied on write
+  vector<chunk> chunks;
+};
+
+// False when the dataset needs the normal read: not chunked, chunks left
+// unallocated, a filter other than deflate and shuffle, or a type other
+// than u8, u16 and f32.
+auto fetch_chunks(chunk_file const& file, string const& path, chunked_dataset& ds) -> bool;
+
+// Values in their native type, row major. False on a corrupt chunk.
+auto inflate_chunks(chunked_dataset const& ds, vector<unsigned char>& values) -> bool;
+
+#endif
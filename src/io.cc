@@ -1,62 +1,302 @@
 #include "io.h"
+#include "gate_bits.h"
+#include "geometry.h"
+#include "inflate.h"
+#include "metrics.h"
+#include "thread_pool.h"
+
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Geometry of a scan, read in the walk and expanded on the workers.
+struct scan_layout{
+  radar::beam_propagation beam;
+  size_t bins, rays;
+  double range_start, range_scale;
+  angle ray_start, ray_scale;
+};
+
+// A moment of a scan fetched as compressed chunks, decoded on the workers.
+struct chunk_job{
+  size_t data = 0;      // index of the data group, for the fallback read
+  bool direct = false;
+  bool failed = false;
+  double gain, offset, nodata, undetect;
+  chunked_dataset chunks;
+};
+
+// Values of an inflated dataset into a sweep, as read or read_unpack would.
+template <typename T>
+static auto decode_values(const T* in, chunk_job const& job, float undetect_value, sweep& scan) -> void{
+  if (is_packed(scan)){
+    with_codes(scan.packed, [&](auto& codes){ std::copy_n(in, codes.size(), codes.data()); });
+    return;
+  }
+  auto out = scan.data.data();
+  for (size_t i = 0; i < scan.data.size(); ++i){
+    const auto raw = in[i];
+    out[i] = raw == T(job.nodata) ? nodata : (raw == T(job.undetect) ? undetect_value : job.gain * raw + job.offset);
+  }
+}
+
+// Mid time of the lowest sweep, as get_lowest_sweep_time.
+static auto lowest_sweep_time(array1f const& elevation, vector<std::array<string, 4>> const& times) -> string{
+  auto elev = 90.f;
+  bom::timestamp stdate, eddate;
+  for (size_t iscan = elevation.size() - 1; iscan > 0 && iscan < elevation.size(); --iscan){
+    if (elevation[iscan] < elev){
+      stdate = io::odim::strings_to_time(times[iscan][0], times[iscan][1]);
+      eddate = io::odim::strings_to_time(times[iscan][2], times[iscan][3]);
+    }
+    elev = elevation[iscan];
+  }
+  auto midpoint_time = stdate + (eddate - stdate) / 2;
+  return to_string(midpoint_time);
+}
 
-auto read_moment(io::odim::polar_volume const vol_odim, string moment, io::configuration const& config) -> volume{
-  auto vol = volume{};
+// A second handle for direct chunk reads, when the caller knows the path.
+static auto open_chunks(io::configuration const& config, std::filesystem::path const& path) -> std::unique_ptr<chunk_file>{
+  if (path.empty() || !config.optional("parallel_inflate", true))
+    return nullptr;
+  return std::make_unique<chunk_file>(path);
+}
+
+// Given only_scan, the moments of that scan alone are read, on this
+// thread. Given the metadata of the file as well, the other scans are not
+// even opened. Without chunks the datasets are read through the library.
+static auto read_scans(
+      io::odim::polar_volume const& vol_odim
+    , vector<string> const& moments
+    , io::configuration const& config
+    , bool packed
+    , chunk_file const* chunks
+    , int only_scan
+    , odim_contents const* metadata
+    , thread_pool* pool
+    ) -> odim_contents
+{
+  odim_contents contents;
+  if (metadata){
+    contents.location = metadata->location;
+    contents.elevation = metadata->elevation;
+    contents.nyquist = metadata->nyquist;
+    contents.lowest_sweep_time = metadata->lowest_sweep_time;
+  } else {
+    contents.location.lat = vol_odim.latitude() * 1_deg;
+    contents.location.lon = vol_odim.longitude() * 1_deg;
+    contents.location.alt = vol_odim.height();
+  }
 
-  vol.location.lat = vol_odim.latitude() * 1_deg;
-  vol.location.lon = vol_odim.longitude() * 1_deg;
-  vol.location.alt = vol_odim.height();
+  vector<float> undetect_values;
+  for (auto const& moment : moments)
+    undetect_values.push_back(moment.compare(config["velocity"]) != 0 ? nodata : undetect);
 
-  for (size_t iscan = 0; iscan < vol_odim.scan_count(); ++iscan)
-  {
+  const auto nscans = vol_odim.scan_count();
+  if (!metadata){
+    contents.elevation = array1f{nscans};
+    contents.nyquist = array1f{nscans};
+  }
+  vector<std::array<string, 4>> times(nscans);
+
+  // The HDF5 calls stay on this thread, the library serialises them anyway.
+  vector<scan_layout> layouts(nscans);
+  vector<vector<sweep>> found(nscans, vector<sweep>(moments.size()));
+  vector<vector<char>> has(nscans, vector<char>(moments.size(), 0));
+  vector<vector<chunk_job>> jobs(nscans, vector<chunk_job>(moments.size()));
+  for (size_t iscan = 0; iscan < nscans; ++iscan){
+    if (metadata && iscan != size_t(only_scan))
+      continue;
     auto scan_odim = vol_odim.scan_open(iscan);
-    auto scan = sweep{};
-
-    // if(std::fabs(scan_odim.elevation_angle() - 90) < 0.1f)
-    // {
-    //   // std::cout << "Skipping 90 deg scan" << std::endl;
-    //   continue;
-    // }
-
-    scan.beam = radar::beam_propagation{vol.location.alt, scan_odim.elevation_angle() * 1_deg};
-
-    scan.bins.resize(scan_odim.bin_count());
-    auto range_scale = scan_odim.range_scale();
-    auto range_start = scan_odim.range_start() * 1000 + range_scale * 0.5;
-    for (size_t i = 0; i < scan.bins.size(); ++i)
-    {
-      scan.bins[i].slant_range = range_start + i * range_scale;
-      std::tie(scan.bins[i].ground_range, scan.bins[i].altitude) = scan.beam.ground_range_altitude(scan.bins[i].slant_range);
+
+    if (!metadata){
+      auto& attributes = scan_odim.attributes();
+      contents.elevation[iscan] = scan_odim.elevation_angle();
+      if (auto iatt = attributes.find("NI"); iatt != attributes.end())
+        contents.nyquist[iscan] = attributes["NI"].get_real();
+      else
+        contents.nyquist[iscan] = -9999.;
+      if (iscan > 0){
+        times[iscan] = {
+            attributes["startdate"].get_string(), attributes["starttime"].get_string()
+          , attributes["enddate"].get_string(), attributes["endtime"].get_string()};
+      }
     }
 
-    scan.rays.resize(scan_odim.ray_count());
-    auto ray_scale = 360_deg / scan.rays.size();
-    auto ray_start = scan_odim.ray_start() * 1_deg + ray_scale * 0.5;
-    for (size_t i = 0; i < scan.rays.size(); ++i)
-      scan.rays[i] = ray_start + i * ray_scale;
+    // Metadata only queries stop here.
+    if (moments.empty() || (only_scan >= 0 && iscan != size_t(only_scan)))
+      continue;
+
+    auto& layout = layouts[iscan];
+    layout.beam = radar::beam_propagation{contents.location.alt, scan_odim.elevation_angle() * 1_deg};
+    layout.bins = scan_odim.bin_count();
+    layout.rays = scan_odim.ray_count();
+    layout.range_scale = scan_odim.range_scale();
+    layout.range_start = scan_odim.range_start() * 1000 + layout.range_scale * 0.5;
+    layout.ray_scale = 360_deg / layout.rays;
+    layout.ray_start = scan_odim.ray_start() * 1_deg + layout.ray_scale * 0.5;
 
-    for (size_t idata = 0; idata < scan_odim.data_count(); ++idata)
-    {
+    for (size_t idata = 0; idata < scan_odim.data_count(); ++idata){
       auto data_odim = scan_odim.data_open(idata);
-      if (data_odim.quantity() != moment)
+      auto im = std::find(moments.begin(), moments.end(), data_odim.quantity()) - moments.begin();
+      if (size_t(im) == moments.size() || has[iscan][im])
         continue;
 
-      scan.data.resize(vec2z{(size_t) scan_odim.bin_count(), (size_t) scan_odim.ray_count()});
-      if(moment.compare(config["velocity"]) != 0)
-      {
-        data_odim.read_unpack(scan.data.data(), nodata, nodata);
+      auto& scan = found[iscan][im];
+      auto& job = jobs[iscan][im];
+      const auto extents = vec2z{layout.bins, layout.rays};
+      const auto undetect_value = undetect_values[im];
+      job.data = idata;
+      job.gain = data_odim.gain();
+      job.offset = data_odim.offset();
+      job.nodata = data_odim.nodata();
+      job.undetect = data_odim.undetect();
+      job.direct = chunks && fetch_chunks(*chunks
+        , "/dataset" + std::to_string(iscan + 1) + "/data" + std::to_string(idata + 1) + "/data", job.chunks)
+        && job.chunks.rows == layout.rays && job.chunks.cols == layout.bins;
+
+      // Integer moments carry a gain or an offset, float ones are unpacked.
+      // The codes of 8-bit moments read as chunks stay 8-bit.
+      if (packed && (job.gain != 1.0 || job.offset != 0.0) && !(job.direct && job.chunks.is_float)){
+        if (job.direct && job.chunks.elem == 1)
+          scan.packed.raw8.resize(extents);
+        else
+          scan.packed.raw.resize(extents);
+        if (!job.direct)
+          data_odim.read(scan.packed.raw.data());
+        scan.packed.gain = job.gain;
+        scan.packed.offset = job.offset;
+        scan.packed.nodata = job.nodata;
+        scan.packed.undetect = job.undetect;
+        scan.packed.undetect_value = undetect_value;
+      } else {
+        scan.data.resize(extents);
+        if (!job.direct)
+          data_odim.read_unpack(scan.data.data(), undetect_value, nodata);
       }
-      else
-      {
-        data_odim.read_unpack(scan.data.data(), undetect, nodata);
+      has[iscan][im] = 1;
+    }
+  }
+  if (!metadata)
+    contents.lowest_sweep_time = lowest_sweep_time(contents.elevation, times);
+
+  // Inflate the fetched chunks, then the geometry once per scan, shared by
+  // its moments, and the gate bit-planes.
+  auto decode_scan = [&](size_t iscan){
+    auto const& layout = layouts[iscan];
+    if (std::find(has[iscan].begin(), has[iscan].end(), 1) == has[iscan].end())
+      return;
+
+    vector<unsigned char> values;
+    for (size_t im = 0; im < moments.size(); ++im){
+      auto& job = jobs[iscan][im];
+      if (!job.direct)
+        continue;
+      job.failed = !inflate_chunks(job.chunks, values);
+      if (!job.failed){
+        if (job.chunks.is_float)
+          decode_values(reinterpret_cast<const float*>(values.data()), job, undetect_values[im], found[iscan][im]);
+        else if (job.chunks.elem == 2)
+          decode_values(reinterpret_cast<const uint16_t*>(values.data()), job, undetect_values[im], found[iscan][im]);
+        else
+          decode_values(values.data(), job, undetect_values[im], found[iscan][im]);
       }
+      job.chunks = chunked_dataset{};
+    }
+
+    vector<float> slant_range(layout.bins);
+    for (size_t i = 0; i < slant_range.size(); ++i)
+      slant_range[i] = layout.range_start + i * layout.range_scale;
+    vector<angle> azimuth(layout.rays);
+    for (size_t i = 0; i < azimuth.size(); ++i)
+      azimuth[i] = layout.ray_start + i * layout.ray_scale;
+
+    sweep geometry;
+    geometry.beam = layout.beam;
+    set_geometry(geometry, slant_range, azimuth);
+
+    for (size_t im = 0; im < moments.size(); ++im){
+      if (!has[iscan][im])
+        continue;
+      auto& scan = found[iscan][im];
+      scan.beam = geometry.beam;
+      scan.bins = geometry.bins;
+      scan.rays = geometry.rays;
+      scan.cos_el = geometry.cos_el;
+      scan.sin_el = geometry.sin_el;
+      if (!jobs[iscan][im].failed)
+        build_gate_bits(scan, undetect_values[im]);
+    }
+  };
+  if (only_scan >= 0 && !moments.empty())
+    decode_scan(only_scan);
+  else if (!moments.empty()){
+    std::optional<thread_pool> local;
+    parallel_for(pool_or_local(pool, local, size_t(config.optional("threads", 0))), nscans, [&](size_t iscan, size_t){ decode_scan(iscan); });
+  }
 
-      vol.sweeps.push_back(std::move(scan));
-      break;
+  // Chunks that failed to inflate are read again through the library.
+  for (size_t iscan = 0; iscan < nscans; ++iscan){
+    for (size_t im = 0; im < moments.size(); ++im){
+      if (!jobs[iscan][im].failed)
+        continue;
+      trace::warning("inflate of scan {} moment {} failed, reading it through HDF5", iscan, moments[im]);
+      auto data_odim = vol_odim.scan_open(iscan).data_open(jobs[iscan][im].data);
+      auto& scan = found[iscan][im];
+      if (is_packed(scan))
+        with_codes(scan.packed, [&](auto& codes){ data_odim.read(codes.data()); });
+      else
+        data_odim.read_unpack(scan.data.data(), undetect_values[im], nodata);
+      build_gate_bits(scan, undetect_values[im]);
     }
   }
 
-  return vol;
+  for (size_t im = 0; im < moments.size(); ++im){
+    auto& vol = contents.moments[moments[im]];
+    vol.location = contents.location;
+    for (size_t iscan = 0; iscan < nscans; ++iscan)
+      if (has[iscan][im])
+        vol.sweeps.push_back(std::move(found[iscan][im]));
+  }
+  return contents;
+}
+
+auto read_odim(
+      io::odim::polar_volume const& vol_odim
+    , vector<string> const& moments
+    , io::configuration const& config
+    , bool packed
+    , std::filesystem::path const& path
+    , thread_pool* pool
+    ) -> odim_contents
+{
+  auto chunks = moments.empty() ? nullptr : open_chunks(config, path);
+  return read_scans(vol_odim, moments, config, packed, chunks.get(), -1, nullptr, pool);
+}
+
+odim_scan_reader::odim_scan_reader(
+      io::odim::polar_volume const& vol_odim
+    , io::configuration const& config
+    , bool packed
+    , std::filesystem::path const& path)
+  : vol_odim_{vol_odim}
+  , config_{config}
+  , packed_{packed}
+  , chunks_{open_chunks(config, path)}
+  , metadata_{read_scans(vol_odim, {}, config, packed, nullptr, -1, nullptr, nullptr)}
+{ }
+
+odim_scan_reader::~odim_scan_reader() = default;
+
+auto odim_scan_reader::read(size_t scan, vector<string> const& moments) const -> odim_contents{
+  if (scan >= metadata_.elevation.size())
+    throw std::out_of_range("scan " + std::to_string(scan) + " not in the volume");
+  return read_scans(vol_odim_, moments, config_, packed_, chunks_.get(), scan, &metadata_, nullptr);
+}
+
+auto read_moment(io::odim::polar_volume const vol_odim, string moment, io::configuration const& config, bool packed, thread_pool* pool) -> volume{
+  return std::move(read_odim(vol_odim, {moment}, config, packed, {}, pool).moments[moment]);
 }
 
 auto read_global_seamask(string const filename) -> seamask{
@@ -73,6 +313,18 @@ auto read_global_seamask(string const filename) -> seamask{
   return landsea;
 }
 
+auto cached_seamask(string const& filename) -> std::shared_ptr<seamask const>{
+  static std::mutex mutex;
+  static std::map<string, std::shared_ptr<seamask const>> cache;
+
+  std::lock_guard<std::mutex> lock{mutex};
+  auto& entry = cache[filename];
+  metrics::add(entry ? metrics::counter::seamask_hits : metrics::counter::seamask_misses);
+  if (!entry)
+    entry = std::make_shared<seamask const>(read_global_seamask(filename));
+  return entry;
+}
+
 auto check_is_ocean(seamask const& landsea, latlon loc) -> bool{
   vector<float> lon, lat;
   for(auto l: landsea.lon) lon.push_back(l);
@@ -83,14 +335,10 @@ auto check_is_ocean(seamask const& landsea, latlon loc) -> bool{
   return landsea.mask[ilat][ilon] < 0;
 }
 
-auto read_refl_corrected(io::odim::polar_volume const vol_odim, io::configuration const& config) -> volume{
-  // Read radar file
-  auto dbzh = read_moment(vol_odim, "DBZH", config);
-  auto dbzh_clean = read_moment(vol_odim, "DBZH_CLEAN", config);
-
+auto correct_sea_clutter(volume& dbzh, volume const& dbzh_clean, io::configuration const& config) -> void{
   // Read seamask.
   string filename = config.optional("topography", "/opt/swirl/data/AU_elevation_map.nc");
-  auto landsea = read_global_seamask(filename);
+  auto const& landsea = *cached_seamask(filename);
   auto radarloc = latlon{dbzh.location.lon, dbzh.location.lat};
 
   for(size_t i=0; i<dbzh.sweeps.size(); i++){
@@ -100,38 +348,37 @@ auto read_refl_corrected(io::odim::polar_volume const vol_odim, io::configuratio
 
     // std::cout << "Sweep: " << elev << std::endl;
     for(size_t k=0; k<dbzh.sweeps[i].bins.size(); k++){
-      if(dbzh.sweeps[i].bins[k].altitude > 4000)
+      if(dbzh.sweeps[i].bins.altitude[k] > 4000)
         break;
 
       for(size_t j=0; j<dbzh.sweeps[i].rays.size(); j++){
 
-        auto r0 = dbzh.sweeps[i].data[j][k];
-        if(std::isnan(r0))
-          continue;
-        if(std::abs(r0 - undetect) < 0.01)
+        if(!is_valid(dbzh.sweeps[i], j, k))
           continue;
 
         // we may have dbzh, but not dbzh_clean
-        if (!dbzh_clean.sweeps.empty()){
-          auto r1 = dbzh_clean.sweeps[i].data[j][k];
-          if(!std::isnan(r1))
-            continue;
-          if(std::abs(r1 - undetect) > 0.01)
-            continue;
-        }
+        if (!dbzh_clean.sweeps.empty() && is_valid(dbzh_clean.sweeps[i], j, k))
+          continue;
 
         auto gate_latlon = wgs84.bearing_range_to_latlon(
           radarloc,
-          dbzh.sweeps[i].rays[j],
-          dbzh.sweeps[i].bins[k].ground_range
+          dbzh.sweeps[i].rays.azimuth[j],
+          dbzh.sweeps[i].bins.ground_range[k]
         );
 
         if(check_is_ocean(landsea, gate_latlon))
-          dbzh.sweeps[i].data[j][k] = nodata;
+          set_gate_nodata(dbzh.sweeps[i], j, k);
       }
     }
   }
-  return dbzh;
+}
+
+auto read_refl_corrected(io::odim::polar_volume const vol_odim, io::configuration const& config, bool packed) -> volume{
+  // Read radar file
+  auto contents = read_odim(vol_odim, {"DBZH", "DBZH_CLEAN"}, config, packed);
+  auto& dbzh = contents.moments["DBZH"];
+  correct_sea_clutter(dbzh, contents.moments["DBZH_CLEAN"], config);
+  return std::move(dbzh);
 }
 
 
@@ -174,3 +421,73 @@ auto read_vad(std::filesystem::path const& filename) -> vadset{
   return data;
 }
 
+// Flow state file: a small header followed by the layer altitudes and the
+// u/v fields of every layer as int16 in hundredths of a pixel.
+constexpr char flow_state_magic[4] = {'V', 'D', 'F', 'S'};
+constexpr uint32_t flow_state_version = 1;
+constexpr float flow_state_scale = 0.01f;
+
+auto read_flow_state(std::filesystem::path const& filename) -> flow_stack{
+  std::ifstream file(filename, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("unable to open flow state file " + filename.string());
+
+  char magic[4];
+  uint32_t version, nlayers, nx, ny;
+  file.read(magic, 4);
+  file.read(reinterpret_cast<char*>(&version), sizeof(version));
+  file.read(reinterpret_cast<char*>(&nlayers), sizeof(nlayers));
+  file.read(reinterpret_cast<char*>(&nx), sizeof(nx));
+  file.read(reinterpret_cast<char*>(&ny), sizeof(ny));
+  if (!file || !std::equal(magic, magic + 4, flow_state_magic) || version != flow_state_version)
+    throw std::runtime_error("invalid flow state file " + filename.string());
+
+  flow_stack stack;
+  stack.altitude.resize(nlayers);
+  stack.extents = vec2z{nx, ny};
+  stack.u.resize(size_t(nlayers) * nx * ny);
+  stack.v.resize(size_t(nlayers) * nx * ny);
+  file.read(reinterpret_cast<char*>(stack.altitude.data()), sizeof(float) * nlayers);
+
+  vector<int16_t> packed(size_t(nx) * ny);
+  for (uint32_t i = 0; i < nlayers; ++i){
+    for (auto field : {&stack.u, &stack.v}){
+      file.read(reinterpret_cast<char*>(packed.data()), sizeof(int16_t) * packed.size());
+      auto data = field->data() + i * packed.size();
+      for (size_t j = 0; j < packed.size(); ++j)
+        data[j] = packed[j] * flow_state_scale;
+    }
+  }
+  if (!file)
+    throw std::runtime_error("truncated flow state file " + filename.string());
+
+  return stack;
+}
+
+auto write_flow_state(std::filesystem::path const& filename, flow_stack const& stack) -> void{
+  std::ofstream file(filename, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("unable to create flow state file " + filename.string());
+
+  const uint32_t nlayers = stack.altitude.size();
+  const uint32_t nx = stack.extents.x;
+  const uint32_t ny = stack.extents.y;
+  file.write(flow_state_magic, 4);
+  file.write(reinterpret_cast<const char*>(&flow_state_version), sizeof(flow_state_version));
+  file.write(reinterpret_cast<const char*>(&nlayers), sizeof(nlayers));
+  file.write(reinterpret_cast<const char*>(&nx), sizeof(nx));
+  file.write(reinterpret_cast<const char*>(&ny), sizeof(ny));
+  file.write(reinterpret_cast<const char*>(stack.altitude.data()), sizeof(float) * nlayers);
+
+  vector<int16_t> packed(size_t(nx) * ny);
+  for (uint32_t i = 0; i < nlayers; ++i){
+    for (auto field : {&stack.u, &stack.v}){
+      auto data = field->data() + i * packed.size();
+      for (size_t j = 0; j < packed.size(); ++j){
+        auto val = std::round(data[j] / flow_state_scale);
+        packed[j] = static_cast<int16_t>(std::clamp(val, -32767.0f, 32767.0f));
+      }
+      file.write(reinterpret_cast<const char*>(packed.data()), sizeof(int16_t) * packed.size());
+    }
+  }
+}
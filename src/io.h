@@ -3,9 +3,14 @@
 
 #include "pch.h"
 #include "array_operations.h"
+#include "thread_pool.h"
+
+#include <memory>
 
 using namespace bom;
 
+class chunk_file;
+
 struct seamask{
     array1f lat;
     array1f lon;
@@ -13,10 +18,65 @@ struct seamask{
     seamask(vec2z shape) : lat{shape.y}, lon{shape.x}, mask{shape} { }
 };
 
-auto read_moment(io::odim::polar_volume const vol_odim, string moment, io::configuration const& config) -> volume;
+// Metadata and moments of a volume file, gathered in a single walk of its
+// scans. A moment missing from a scan has no sweep for it.
+struct odim_contents{
+  latlonalt location;
+  array1f elevation;
+  array1f nyquist;
+  string lowest_sweep_time;
+  std::unordered_map<string, volume> moments;
+};
+
+// No data is read when moments is empty. Given the path of the file, the
+// datasets are inflated in parallel unless parallel_inflate is false. The
+// scans are decoded on pool, or on a pool of their own without one.
+auto read_odim(
+      io::odim::polar_volume const& vol_odim
+    , vector<string> const& moments
+    , io::configuration const& config
+    , bool packed = false
+    , std::filesystem::path const& path = {}
+    , thread_pool* pool = nullptr
+    ) -> odim_contents;
+
+// Reads a volume one scan at a time. The metadata of every scan is walked
+// once and the file opened for direct chunk reads once, on construction.
+// A scan is read and decoded on the calling thread, so going through the
+// scans costs one walk and no thread pools.
+class odim_scan_reader{
+public:
+  odim_scan_reader(
+        io::odim::polar_volume const& vol_odim
+      , io::configuration const& config
+      , bool packed = false
+      , std::filesystem::path const& path = {});
+  ~odim_scan_reader();
+
+  // Metadata of every scan, without moments.
+  auto metadata() const -> odim_contents const& { return metadata_; }
+
+  // Metadata of every scan, with the moments of scan only.
+  auto read(size_t scan, vector<string> const& moments) const -> odim_contents;
+
+private:
+  io::odim::polar_volume const& vol_odim_;
+  io::configuration const& config_;
+  bool packed_;
+  std::unique_ptr<chunk_file> chunks_;
+  odim_contents metadata_;
+};
+
+auto read_moment(io::odim::polar_volume const vol_odim, string moment, io::configuration const& config, bool packed = false, thread_pool* pool = nullptr) -> volume;
 auto read_global_seamask(string const filename) -> seamask;
+
+// The mask of a file is read once per process and shared from then on.
+auto cached_seamask(string const& filename) -> std::shared_ptr<seamask const>;
 auto check_is_ocean(seamask const& landsea, latlon loc) -> bool;
-auto read_refl_corrected(io::odim::polar_volume const vol_odim, io::configuration const& config) -> volume;
+auto correct_sea_clutter(volume& dbzh, volume const& dbzh_clean, io::configuration const& config) -> void;
+auto read_refl_corrected(io::odim::polar_volume const vol_odim, io::configuration const& config, bool packed = false) -> volume;
 auto read_vad(std::filesystem::path const& filename) -> vadset;
+auto read_flow_state(std::filesystem::path const& filename) -> flow_stack;
+auto write_flow_state(std::filesystem::path const& filename, flow_stack const& stack) -> void;
 
 #endif
\ No newline at end of file
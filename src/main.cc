@@ -1,12 +1,26 @@
+#include <future>
 #include <getopt.h>
 #include "pch.h"
 
+#include "archive.h"
 #include "array_operations.h"
 #include "cappi.h"
 #include "corrections.h"
+#include "daemon.h"
 #include "metadata.h"
+#include "metrics.h"
+#include "gate_bits.h"
 #include "io.h"
-#include "brox/brox_optic_flow.h"
+#include "reference.h"
+#include "reprocess.h"
+#include "resources.h"
+#include "stream.h"
+#include "thread_pool.h"
+#include "tracking.h"
+#include "vad.h"
+#include "fold.h"
+#include "publish.h"
+#include "writer.h"
 
 using namespace bom;
 
@@ -67,6 +81,85 @@ speckle_iterations 3
 # Matrix orientation
 origin xy
 
+# keep integer ODIM moments packed and decode them inside the kernels
+packed false
+
+# inflate the compressed datasets on the worker threads instead of in HDF5
+parallel_inflate true
+
+# reference of the unfold: vad, temporal (the VRAD_DEALIAS of lag1 remapped
+# to lag0, falling back to vad when lag1 has none, and for the sweeps lag1
+# has none within 0.2 degrees of) or both (vad, with lag1 for the gates it
+# cannot unfold)
+dealias_reference vad
+
+# shift continuous regions of gates the reference cannot unfold to agree
+# with their dealiased neighbours
+region_fallback true
+
+# worker threads of the reading, VAD retrieval, dealiasing and layer
+# tracking of a volume, all on one pool (0 uses every core, split between
+# the worker processes of the reprocessing and the daemon, which also caps
+# a larger count)
+threads 0
+
+# where the dealiased moment goes: in_place (appended to lag0), copy (a copy
+# of lag0 with the moment added) or moment (the moment alone). Defaults to
+# copy when an output file is given
+# output_mode copy
+
+# encoding of the dealiased moment: f32, or u16 quantised over the range of
+# each sweep (the largest error is reported)
+output_encoding u16
+
+# deflate level (0 to 9) and byte shuffle of the chunked output, 0 and false
+# write plain f32 datasets through bom
+output_deflate 6
+output_shuffle true
+
+# moments written: velocity (VRAD_DEALIAS), fold (VRAD_FOLD, the multiple
+# of the Nyquist velocity to add to the raw velocity, one byte per gate) or
+# both. The fold index alone needs the raw velocity next to it, so it does
+# not suit output_mode moment
+output_product velocity
+
+# POSIX shared memory ring (/dev/shm/<name>) the dealiased sweeps are
+# published to as soon as they are unfolded, see publish.h for its layout.
+# Empty to publish nothing
+# publish_ring vad-dealias
+publish_slots 16
+publish_slot_bytes 8388608
+
+# streaming (--stream): sweeps of a volume, the volume ending early when no
+# sweep arrives for stream_timeout seconds. 0 ends it on the timeout only
+stream_sweeps 0
+stream_timeout 600
+
+# read, dealias and write lag0 one sweep at a time, keeping the memory to a
+# small multiple of one sweep. Supports dealias_reference vad only and no
+# flow tracking; without a VAD profile file the sweeps are read once per fit
+low_memory false
+
+# dealiased sweeps waiting for the background writer
+write_queue 2
+
+# worker processes of the archive reprocessing (0 uses every core)
+reprocess_workers 0
+
+# persistent worker processes of the daemon (0 uses every core)
+daemon_workers 0
+
+# track the flow in the reprocessing and daemon modes, into <output>.flow
+# next to each dealiased volume, warm started from the flow of the previous
+# volume of the site. The layer pyramids of the last flow_cache_volumes
+# volumes a worker saw are kept, so each volume's CAPPIs are built once
+track_flow false
+flow_cache_volumes 4
+
+# where the daemon serves its metrics in the Prometheus text format, over
+# HTTP: unix:<socket path>, tcp:<host>:<port> or :<port>. Empty for none
+# metrics_listen unix:/run/vad-dealias/metrics.sock
+
 # parameters for optical flow algorithm
 optical_flow
 {
@@ -77,6 +170,30 @@ optical_flow
   tol 0.005
   initer 3
   outiter 15
+
+  # scales and outer iterations used when warm starting from a prior flow.
+  # The prior is within a pixel or so of the flow, so the finest scale is
+  # usually enough and the coarser ones are not built
+  warm_scales 1
+  warm_outiter 3
+
+  # only solve the flow on tiles around echo above min_dbz
+  sparse false
+
+  # linear solver of the inner iterations: sor, multigrid or pcg
+  solver sor
+}
+
+# in-process VAD retrieval, used when no VAD profile file is given
+vad
+{
+  layers 21
+  dz 500
+  rmin 1000
+  rmax 100000
+  scale_height 7590
+  min_gates 100
+  iterations 2
 }
 
 # Land/sea mask file
@@ -89,7 +206,12 @@ constexpr auto usage_string =
 R"(Optical flow tracking of radar volume at multiple altitudes
 
 usage:
-  track-layers [options] config.conf lag1.vol.h5 lag0.vol.h5 out.nc
+  vad-dealias [options] config.conf [vad.dat] lag1.vol.h5 lag0.vol.h5
+
+  Without a VAD profile file the profile is retrieved from lag0.vol.h5.
+  The VAD profile and the volumes may be given as archive.zip:member, the
+  member is then inflated into memory instead of being unzipped to disk.
+  lag0 then needs --write.
 
 available options:
   -h, --help
@@ -101,21 +223,77 @@ available options:
   -t, --trace=level
       Set logging level [log]
         none | status | error | warning | log | debug
+
+  -f, --flow=file
+      Track the CAPPI layer stack between lag1 and lag0 and write the flow
+      to a state file
+
+  -p, --prior=file
+      Warm start the tracking from the flow state file of the previous
+      time step
+
+  -w, --write=file
+      Write the dealiased volume to file instead of into lag0, as a full
+      copy or as the dealiased moment alone (see output_mode)
+
+  -r, --reprocess=dir
+      Reprocess the <site>_<date>.pvol.zip archives found under dir. Only
+      config.conf is then given on the command line. The dealiased
+      volumes are written under the output directory, and volumes
+      finished by an earlier run are skipped.
+
+  -o, --output=dir
+      Output directory of the reprocessing and of the daemon
+
+  -c, --checkpoint=file
+      Reprocessing state file [output/reprocess.state]
+
+  -d, --daemon=spool
+      Run until interrupted, dealiasing every volume that lands in the
+      spool directory (the option may be repeated) against the previous
+      volume of its site. Only config.conf is then given on the command
+      line, the dealiased volumes are written under the output directory
+      and the VAD profiles are taken from --vad-dir when given
+
+  -s, --stream=source
+      Dealias the sweeps of a volume one at a time as they arrive, from a
+      directory of per-sweep ODIM files or from shm:<ring>, a shared
+      memory ring fed by the ingest. Only config.conf and an optional VAD
+      profile are given on the command line, the volume is assembled into
+      the --write file. See stream_sweeps and stream_timeout
+
+  -V, --vad-dir=dir
+      Directory of the <site>_<date>_<time>.dat VAD profiles used by the
+      reprocessing, without it the profiles are retrieved from the volumes
 )";
 
-constexpr auto short_options = "hgt:";
+constexpr auto short_options = "hgt:f:p:w:r:o:c:d:s:V:";
 constexpr struct option long_options[] =
 {
     { "help",     no_argument,       0, 'h' }
   , { "generate", no_argument,       0, 'g' }
   , { "trace",    required_argument, 0, 't' }
+  , { "flow",     required_argument, 0, 'f' }
+  , { "prior",    required_argument, 0, 'p' }
+  , { "write",    required_argument, 0, 'w' }
+  , { "reprocess", required_argument, 0, 'r' }
+  , { "output",   required_argument, 0, 'o' }
+  , { "checkpoint", required_argument, 0, 'c' }
+  , { "daemon",   required_argument, 0, 'd' }
+  , { "stream",   required_argument, 0, 's' }
+  , { "vad-dir",  required_argument, 0, 'V' }
   , { 0, 0, 0, 0 }
 };
 
+// The sea clutter is removed from the reflectivity of the volumes the flow
+// is tracked on, with topography and DBZH, so that both volumes of a pair
+// are read the same way and the frames of a volume are reused as it moves
+// from lag0 of one pair to lag1 of the next.
 auto read_volume(
   const std::filesystem::path& path,
   const io::configuration& config,
-  const bool ismainfile
+  const bool remove_sea_clutter,
+  thread_pool* pool = nullptr
 ) -> radarset {
   // Logging: Replace with appropriate logging mechanism
   // logDebug("Reading: {}", path.string());
@@ -124,26 +302,28 @@ auto read_volume(
   radarset dset;
   const std::string& reflname = config["moment"];
   std::string topo_fname = config.optional("topography", "");
+  const bool packed = config.optional("packed", false);
 
-  // Get Nyquist
-  dset.elevation = get_elevation(vol_odim);
-  dset.nyquist = get_nyquist(vol_odim);
-  dset.lowest_sweep_time = get_lowest_sweep_time(vol_odim);
-
+  // Every moment and the scan metadata in one walk of the file.
   const auto& velocity_moment = config["velocity"];
-  dset.vradh = read_moment(vol_odim, velocity_moment, config);
+  const bool sea_clutter = !topo_fname.empty() && remove_sea_clutter && reflname == "DBZH";
+  vector<string> moments{velocity_moment, reflname};
+  if (sea_clutter)
+    moments.push_back("DBZH_CLEAN");
+  auto contents = read_odim(vol_odim, moments, config, packed, path, pool);
+
+  dset.elevation = contents.elevation;
+  dset.nyquist = contents.nyquist;
+  dset.lowest_sweep_time = contents.lowest_sweep_time;
+  dset.vradh = std::move(contents.moments[velocity_moment]);
+  dset.dbzh = std::move(contents.moments[reflname]);
 
   if (topo_fname.empty()) {
     std::cout << "No topgraphy provided. Not correcting for sea-clutter" << std::endl;
-    dset.dbzh = read_moment(vol_odim, reflname, config);
-  } else {
-    if (ismainfile && reflname == "DBZH") {
-      // Correct for sea-clutter
-      dset.dbzh = read_refl_corrected(vol_odim, config);
-    } else {
-      // Read reflectivity without any modification.
-      dset.dbzh = read_moment(vol_odim, reflname, config);
-    }
+  } else if (sea_clutter) {
+    // Correct for sea-clutter
+    correct_sea_clutter(dset.dbzh, contents.moments["DBZH_CLEAN"], config);
+    dset.clutter_corrected = true;
   }
 
   const auto& attributes = vol_odim.attributes();
@@ -171,31 +351,31 @@ std::pair<std::vector<std::vector<T>>, std::vector<std::vector<T>>>{
   return {X, Y};
 }
 
-auto generate_vad_field(const radarset dset2, const vadset df) -> vector<array2f>{
+auto generate_vad_field(const radarset& dset2, const vadset& df) -> vector<array2f>{
   vector<array2f>  vadfield;
 
   // Create the VAD velocity field.
   for(size_t k=0; k < dset2.vradh.sweeps.size(); k++){
-    auto r = get_range(dset2.vradh.sweeps[k]);
-    auto azi = get_azimuth(dset2.vradh.sweeps[k]);
-    auto el = dset2.vradh.sweeps[k].beam.elevation();
-    auto cel = cos(M_PI / 180. * el);
-    auto sel = sin(M_PI / 180. * el);
+    auto const& swp = dset2.vradh.sweeps[k];
+    auto const& r = swp.bins.ground_range;
+    auto const& saz = swp.rays.sin_az;
+    auto const& caz = swp.rays.cos_az;
+    auto cel = swp.cos_el;
+    auto sel = swp.sin_el;
 
     // Generated anew for every sweep
-    auto vrz = array2f{vec2z{r.size(), azi.size()}};  // vec2 dimensions are reversed.
+    auto vrz = array2f{vec2z{r.size(), saz.size()}};  // vec2 dimensions are reversed.
     for(size_t i=0; i<r.size(); i++){
-      auto alti = dset2.vradh.sweeps[k].bins[i].altitude;
-      auto pos = argmin2(df.z, alti);
+      auto pos = argmin2(df.z, swp.bins.altitude[i]);
 
-      for(size_t j=0; j<azi.size(); j++){
+      for(size_t j=0; j<saz.size(); j++){
         vrz[j][i] = (
           0.5 * r[i] * cel * df.div[pos]
           - df.vt[pos] * sel
-          + df.u0[pos] * sin(M_PI / 180. * azi[j]) * cel
-          + df.v0[pos] * cos(M_PI / 180. * azi[j]) * cel
-          - 0.5 * r[i] * cel * cos(2 * M_PI / 180. * azi[j]) * df.det[pos]
-          + 0.5 * r[i] * cel * sin(2 * M_PI / 180. * azi[j]) * df.des[pos]
+          + df.u0[pos] * saz[j] * cel
+          + df.v0[pos] * caz[j] * cel
+          - 0.5 * r[i] * cel * (caz[j] * caz[j] - saz[j] * saz[j]) * df.det[pos]
+          + 0.5 * r[i] * cel * (2 * saz[j] * caz[j]) * df.des[pos]
         );
       }
     }
@@ -204,78 +384,430 @@ auto generate_vad_field(const radarset dset2, const vadset df) -> vector<array2f
   return vadfield;
 }
 
-void unfold_velocity(vector<array2f> &nvel, const vector<array2f> vadfield, const array1f nyquist_vec) {
-  int count = 0;
-  for(size_t k=0; k < nvel.size(); k++){
-    auto [nx, ny] = nvel[k].extents();
-    auto nyquist = nyquist_vec[k];
+// Fold a velocity towards a reference. Returns false when none of the
+// fold orders brings it within 0.6 * nyquist, the velocity is then left
+// unchanged.
+auto unfold_to_reference(float& vel, float vr, float nyquist) -> bool{
+  if(!(std::abs(vr - vel) > 0.6 * nyquist))
+    return true;
+
+  for(size_t n=1; n < 5; n++){
+    auto velp = vel + n * nyquist;
+    if(std::abs(vr - velp) <= 0.6 * nyquist){
+      vel = velp;
+      return true;
+    }
+    auto velm = vel - n * nyquist;
+    if(std::abs(vr - velm) <= 0.6 * nyquist){
+      vel = velm;
+      return true;
+    }
+  }
+  return false;
+}
 
-    for(size_t j=0; j < ny; j++){
-      for(size_t i=0; i < nx; i++){
-        auto vel = nvel[k][j][i];
-        if(std::isnan(vel) || std::abs(vel - undetect) < 0.1f){
-          nvel[k][j][i] = -9999.;
+// Unfold a sweep against a reference field into nvel. Gates where it
+// fails, or where it has no value, are tried against the optional fallback
+// reference, and those still unresolved are flagged in the optional failed
+// mask. The validity bit-planes of the source sweep decide which gates
+// hold a velocity, and those alone are decoded, from the codes of a packed
+// sweep. Returns the number of gates the fallback unfolded.
+auto unfold_sweep(
+  array2f& nvel,
+  const sweep& source,
+  const array2f& reference,
+  const float nyquist,
+  const array2f* fallback = nullptr,
+  vector<unsigned char>* failed = nullptr
+) -> int {
+  int rescued = 0;
+  nvel.resize(sweep_extents(source));
+  auto [nx, ny] = nvel.extents();
+  if(failed)
+    failed->assign(nx * ny, 0);
+
+  // Ray j, value(i) giving the velocity of a valid gate.
+  auto unfold_ray = [&](size_t j, auto const& value){
+    auto valid = valid_row(source, j);
+    for(size_t w=0; w < source.mask.words; w++){
+      auto i0 = w * 64, i1 = std::min(nx, i0 + 64);
+      auto bits = valid[w];
+      if(bits == 0){
+        std::fill(nvel[j] + i0, nvel[j] + i1, -9999.f);
+        continue;
+      }
+      for(size_t i=i0; i < i1; i++){
+        if(!((bits >> (i - i0)) & 1)){
+          nvel[j][i] = -9999.;
           continue;
         }
-        auto vr = vadfield[k][j][i];
-
-        if(std::abs(vr - vel) > 0.6 * nyquist){
-          for(size_t n=1; n < 5; n++){
-            auto velp = vel + n * nyquist;
-            if(std::abs(vr - velp) <= 0.6 * nyquist){
-              nvel[k][j][i] = velp;
-              count++;
-              break;
-            }
-            auto velm = vel - n * nyquist;
-            if(std::abs(vr - velm) <= 0.6 * nyquist){
-              nvel[k][j][i] = velm;
-              count++;
-              break;
-            }
-          }
+        const float vel = value(i);
+        auto vr = reference[j][i];
+
+        auto unfolded = vel;
+        auto ok = !std::isnan(vr) && unfold_to_reference(unfolded, vr, nyquist);
+        if(!ok && fallback){
+          unfolded = vel;
+          auto vf = (*fallback)[j][i];
+          ok = !std::isnan(vf) && unfold_to_reference(unfolded, vf, nyquist);
+          rescued += ok;
         }
+        if(!ok && failed)
+          (*failed)[j * nx + i] = 1;
+        nvel[j][i] = unfolded;
       }
     }
+  };
+
+  if(!is_packed(source)){
+    for(size_t j=0; j < ny; j++){
+      const auto row = source.data[j];
+      unfold_ray(j, [row](size_t i){ return row[i]; });
+    }
+    return rescued;
   }
-  // std::cout << count << " changed." << std::endl;
+  const auto gain = source.packed.gain, offset = source.packed.offset;
+  with_codes(source.packed, [&](auto const& codes){
+    for(size_t j=0; j < ny; j++){
+      const auto raw = codes[j];
+      unfold_ray(j, [raw, gain, offset](size_t i){ return gain * raw[i] + offset; });
+    }
+  });
+  return rescued;
+}
+
+// Unfold one sweep into nvel, then shift the regions of gates no reference
+// could unfold when region_fallback is set. Counts the gates for the metrics.
+// Returns the gates rescued by the fallback reference and those unfolded
+// by region growing.
+auto dealias_sweep(
+  array2f& nvel,
+  const sweep& source,
+  const array2f& reference,
+  const float nyquist,
+  const array2f* fallback,
+  const bool region_fallback
+) -> std::pair<int, size_t> {
+  metrics::timer time{metrics::stage::dealias};
+  vector<unsigned char> failed;
+  auto rescued = unfold_sweep(nvel, source, reference, nyquist, fallback, &failed);
+  size_t gates = 0;
+  for(auto bits : source.mask.valid)
+    gates += __builtin_popcountll(bits);
+  const auto failures = std::count(failed.begin(), failed.end(), 1);
+  const size_t regions = region_fallback ? region_dealias(nvel, failed, nyquist, -9999.f) : 0;
+
+  metrics::add(metrics::counter::gates, gates);
+  metrics::add(metrics::counter::unfold_failures, failures);
+  metrics::add(metrics::counter::region_unfolded, regions);
+  return {rescued, regions};
+}
+
+auto open_publisher(io::configuration const& config) -> std::unique_ptr<sweep_publisher>{
+  const string ring = config.optional("publish_ring", "");
+  if(ring.empty())
+    return nullptr;
+  return std::make_unique<sweep_publisher>(ring, size_t(config.optional("publish_slots", 16)), size_t(config.optional("publish_slot_bytes", 8 << 20)));
+}
+
+// Velocity of scan k alone, with its Nyquist velocity.
+auto read_velocity_sweep(
+  odim_scan_reader const& reader,
+  io::configuration const& config,
+  size_t k
+) -> radarset {
+  const auto& velocity_moment = config["velocity"];
+  auto contents = reader.read(k, {velocity_moment});
+
+  radarset dset;
+  dset.vradh = std::move(contents.moments[velocity_moment]);
+  dset.nyquist = array1f{1};
+  dset.nyquist[0] = contents.nyquist[k];
+  dset.elevation = array1f{1};
+  dset.elevation[0] = contents.elevation[k];
+  return dset;
+}
+
+// Bounded memory dealiasing of lag0: one sweep is read, dealiased, handed
+// to the writer and freed before the next, so the peak stays a small
+// multiple of the largest sweep (the raw and dealiased velocity, the VAD
+// field and the sweeps queued for the writer). Without a VAD profile file
+// the retrieval reads the sweeps once per fit. Only the vad reference is
+// supported, and no flow tracking, as both need whole volumes.
+auto process_file_low_memory(
+  io::configuration const& config,
+  std::filesystem::path const& vad_file,
+  std::filesystem::path const& odim_file2,
+  std::filesystem::path const& output_file
+) -> void{
+  if(config.optional("dealias_reference", "vad") != "vad")
+    throw std::invalid_argument("low_memory supports dealias_reference vad only");
+  reset_peak_resident();
+  const auto baseline = resident_bytes();
+
+  // The reads are spread over the retrieval and the dealiasing, their time
+  // is summed into one observation of the volume, as on the other paths.
+  auto read_start = std::chrono::steady_clock::now();
+  io::odim::polar_volume vol_odim{odim_file2, io_mode::read_only};
+  const odim_scan_reader reader{vol_odim, config, config.optional("packed", false), odim_file2};
+  const auto nscans = vol_odim.scan_count();
+  double read_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - read_start).count();
+  auto load = [&](size_t k){
+    auto start = std::chrono::steady_clock::now();
+    auto one = read_velocity_sweep(reader, config, k);
+    read_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return one;
+  };
+  auto vad_start = std::chrono::steady_clock::now();
+  const auto vad_reads = read_seconds;
+  thread_pool pool{size_t(config.optional("threads", 0))};
+  auto profile = vad_file.empty() ? retrieve_vad(config, nscans, load, &pool) : read_vad(vad_file);
+  metrics::observe(metrics::stage::vad, std::chrono::duration<double>(std::chrono::steady_clock::now() - vad_start).count() - (read_seconds - vad_reads));
+
+  const auto output = parse_output_mode(config.optional("output_mode", output_file.empty() ? "in_place" : "copy"));
+  if(output == output_mode::in_place && !output_file.empty())
+    throw std::invalid_argument("output_mode in_place writes into lag0 and takes no output file");
+  const auto products = read_output_products(config);
+  const bool region_fallback = config.optional("region_fallback", true);
+  auto publisher = open_publisher(config);
+  const auto queue = size_t(config.optional("write_queue", 2));
+  sweep_writer writer{odim_file2, output_file, output, read_output_encoding(config), queue};
+
+  size_t largest = 0, regions = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for(size_t k=0; k < nscans; k++){
+    auto one = load(k);
+    if(one.vradh.sweeps.empty())
+      continue;
+    auto const& swp = one.vradh.sweeps[0];
+    auto vadfield = generate_vad_field(one, profile);
+    array2f nvel;
+    regions += dealias_sweep(nvel, swp, vadfield[0], one.nyquist[0], nullptr, region_fallback).second;
+    largest = std::max(largest, nvel.size() * sizeof(float));
+    if(publisher)
+      publisher->publish(one, 0, nvel, -9999.f);
+    auto folds = products.fold ? fold_index(nvel, swp, one.nyquist[0], -9999.f) : array2<uint8_t>{};
+    writer.push(k, products.velocity ? std::move(nvel) : array2f{}, std::move(folds));
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  writer.finish();
+  metrics::observe(metrics::stage::read, read_seconds);
+
+  if(region_fallback)
+    std::cout << regions << " gates unfolded by region growing" << std::endl;
+  std::chrono::duration<double> duration = end - start;
+  std::cout << "Time taken by function: " << duration.count() << " seconds" << std::endl;
+  const auto peak = peak_resident_bytes();
+  std::cout << "Peak memory " << (peak > baseline ? peak - baseline : 0) / 1048576.0 << " MiB over the baseline"
+    << " (largest sweep " << largest / 1048576.0 << " MiB, " << queue << " queued for the writer)" << std::endl;
+  std::cout << "Completed." << std::endl;
 }
 
 auto process_file(
   io::configuration const& config,
   std::filesystem::path const& vad_file,
   std::filesystem::path const& odim_file1,
-  std::filesystem::path const& odim_file2
+  std::filesystem::path const& odim_file2,
+  std::filesystem::path const& output_file,
+  std::filesystem::path const& flow_file,
+  std::filesystem::path const& prior_file,
+  frame_cache* frames = nullptr
 ) -> void{
-  auto dset1 = read_volume(odim_file1, config, true);
-  auto dset2 = read_volume(odim_file2, config, false);
-  auto df = read_vad(vad_file);
-  auto vadfield = generate_vad_field(dset2, df);
-  vector<array2f> nvel;
-  for(auto v: dset2.vradh.sweeps){
-    nvel.push_back(v.data);
+  if(config.optional("low_memory", false)){
+    if(!flow_file.empty())
+      throw std::invalid_argument("low_memory does not track the flow, it needs whole volumes");
+    return process_file_low_memory(config, vad_file, odim_file2, output_file);
+  }
+
+  // One pool for every stage of the volume, sized for this process.
+  thread_pool pool{size_t(config.optional("threads", 0))};
+
+  auto read_start = std::chrono::steady_clock::now();
+  auto dset1 = read_volume(odim_file1, config, true, &pool);
+  auto dset2 = read_volume(odim_file2, config, !flow_file.empty(), &pool);
+  auto read_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - read_start).count();
+  vector<array2f> nvel(dset2.vradh.sweeps.size());
+
+  // Reference of the unfold: the VAD model, the previous dealiased volume
+  // remapped to this geometry, or the VAD model with the previous volume as
+  // a second opinion.
+  const string mode = config.optional("dealias_reference", "vad");
+  if(mode != "vad" && mode != "temporal" && mode != "both")
+    throw std::invalid_argument("Invalid values for parameter in configuration file ('dealias_reference')");
+
+  vector<array2f> temporal;
+  if(mode != "vad"){
+    read_start = std::chrono::steady_clock::now();
+    auto lag = read_reference(odim_file1, config, &pool);
+    read_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - read_start).count();
+    if(lag.sweeps.empty())
+      trace::warning("no VRAD_DEALIAS or VRAD_FOLD in {}, using the VAD reference", odim_file1.string());
+    else
+      temporal = remap_reference(dset2.vradh, lag);
+  }
+
+  metrics::observe(metrics::stage::read, read_seconds);
+
+  // Sweeps with no lag sweep at their elevation fall back to the VAD.
+  const auto unmatched = std::count_if(temporal.begin(), temporal.end(), [](auto const& ref){ return ref.size() == 0; });
+  if(mode == "temporal" && unmatched > 0)
+    trace::warning("{} of {} sweeps have no lag sweep at their elevation, using the VAD reference for them", unmatched, temporal.size());
+
+  vector<array2f> vadfield;
+  if(mode != "temporal" || temporal.empty() || unmatched > 0){
+    metrics::timer time{metrics::stage::vad};
+    auto df = vad_file.empty() ? retrieve_vad(config, dset2, &pool) : read_vad(vad_file);
+    vadfield = generate_vad_field(dset2, df);
   }
 
+  const bool region_fallback = config.optional("region_fallback", true);
+
+  // The sweeps are dealiased on the pool and handed to the background
+  // writer in scan order, sweep k being written while the following ones
+  // are still dealiased. Regions of gates no reference could unfold follow
+  // their neighbours.
+  const auto output = parse_output_mode(config.optional("output_mode", output_file.empty() ? "in_place" : "copy"));
+  if(output == output_mode::in_place && !output_file.empty())
+    throw std::invalid_argument("output_mode in_place writes into lag0 and takes no output file");
+  // Finished sweeps also go to local consumers through shared memory.
+  auto publisher = open_publisher(config);
+
+  const auto products = read_output_products(config);
+  sweep_writer writer{odim_file2, output_file, output, read_output_encoding(config), size_t(config.optional("write_queue", 2))};
+  int rescued = 0;
+  size_t regions = 0;
   auto start = std::chrono::high_resolution_clock::now();
-  unfold_velocity(nvel, vadfield, dset2.nyquist);
+  vector<std::future<std::pair<int, size_t>>> dealiased(nvel.size());
+  for(size_t k=0; k < nvel.size(); k++){
+    auto done = std::make_shared<std::promise<std::pair<int, size_t>>>();
+    dealiased[k] = done->get_future();
+    pool.submit([&, k, done](size_t){
+      try{
+        const bool matched = !temporal.empty() && temporal[k].size() > 0;
+        auto const& reference = matched && mode == "temporal" ? temporal[k] : vadfield[k];
+        auto fallback = matched && mode == "both" ? &temporal[k] : nullptr;
+        done->set_value(dealias_sweep(nvel[k], dset2.vradh.sweeps[k], reference, dset2.nyquist[k], fallback, region_fallback));
+      }
+      catch(...){
+        done->set_exception(std::current_exception());
+      }
+    });
+  }
+  for(size_t k=0; k < nvel.size(); k++){
+    auto [fixed, grown] = dealiased[k].get();
+    rescued += fixed;
+    regions += grown;
+    if(publisher)
+      publisher->publish(dset2, k, nvel[k], -9999.f);
+    auto folds = products.fold ? fold_index(nvel[k], dset2.vradh.sweeps[k], dset2.nyquist[k], -9999.f) : array2<uint8_t>{};
+    writer.push(k, products.velocity ? std::move(nvel[k]) : array2f{}, std::move(folds));
+  }
   auto end = std::chrono::high_resolution_clock::now();
+  writer.finish();
+
+  // The dealiased moment should not outgrow the moment it came from.
+  const auto input_bytes = moment_storage(odim_file2, config["velocity"].string());
+  std::cout << "Dealiased moments written in " << writer.bytes() << " bytes (" << input_bytes << " bytes of input moment), largest quantisation error " << writer.max_error() << " m/s" << std::endl;
+  if(input_bytes > 0 && writer.bytes() > input_bytes)
+    trace::warning("dealiased moment is larger than the input moment, see output_encoding and output_deflate");
+
+  if(mode == "both" && !temporal.empty())
+    std::cout << rescued << " gates unfolded against the fallback reference" << std::endl;
+  if(region_fallback)
+    std::cout << regions << " gates unfolded by region growing" << std::endl;
   std::chrono::duration<double> duration = end - start;
   std::cout << "Time taken by function: " << duration.count() << " seconds" << std::endl;
 
-  io::odim::polar_volume vol_odim{odim_file2, io_mode::read_write};
-  for(size_t k=0; k < nvel.size(); k++){
-    auto scan_odim = vol_odim.scan_open(k);
-    const auto nbins = dset2.dbzh.sweeps[k].bins.size();
-    const auto nrays = dset2.dbzh.sweeps[k].rays.size();
-    size_t dims[2] = {nrays, nbins};
-    auto data = scan_odim.data_append(io::odim::data::data_type::f32, 2, dims);
-    data.write(nvel[k].data());
-    data.set_quantity("VRAD_DEALIAS");
-    data.set_nodata(-9999.);
-    data.set_undetect(-9999.);
-    data.set_gain(1);
-    data.set_offset(0);
+  if(!flow_file.empty()){
+    flow_stack prior;
+    if(!prior_file.empty() && std::filesystem::exists(prior_file))
+      prior = read_flow_state(prior_file);
+    auto stack = track_layers(config, dset1, dset2, prior.altitude.size() ? &prior : nullptr, frames, &pool);
+    write_flow_state(flow_file, stack);
+  }
+  std::cout << "Completed." << std::endl;
+}
+
+// One volume of the reprocessing or the daemon. With track_flow the flow
+// goes next to the output and is seeded from the flow written next to
+// lag_output, the output of the lag volume, the pyramids of which are still
+// in frames. lag1 itself may be a memory file of an archive member. The
+// first volume of a site is its own lag, a pair without motion, so no flow
+// is tracked for it.
+auto process_series_volume(
+  io::configuration const& config,
+  std::filesystem::path const& vad_file,
+  std::filesystem::path const& lag1,
+  std::filesystem::path const& lag0,
+  std::filesystem::path const& output,
+  std::filesystem::path const& lag_output,
+  frame_cache& frames
+) -> void{
+  if(!config.optional("track_flow", false))
+    return process_file(config, vad_file, lag1, lag0, output, "", "");
+  if(lag_output.empty()){
+    std::cout << "No lag volume for " << output.filename().string() << ", flow tracking starts with the next one" << std::endl;
+    return process_file(config, vad_file, lag1, lag0, output, "", "");
+  }
+
+  auto flow_file = output;
+  auto prior_file = lag_output;
+  flow_file.replace_extension(".flow");
+  prior_file.replace_extension(".flow");
+  process_file(config, vad_file, lag1, lag0, output, flow_file, prior_file, &frames);
+}
+
+// Dealias the sweeps of a volume one at a time as they arrive, against the
+// VAD profile of the file or, without one, the profile retrieved from the
+// sweeps received so far. The dealiased moment is assembled into
+// output_file as the sweeps are done.
+auto process_stream(
+  io::configuration const& config,
+  std::filesystem::path const& vad_file,
+  stream_options const& opts,
+  std::filesystem::path const& output_file
+) -> void{
+  auto source = open_sweep_source(opts, [&](auto const& path){ return read_volume(path, config, false); });
+  auto publisher = open_publisher(config);
+  const auto products = read_output_products(config);
+  const bool region_fallback = config.optional("region_fallback", true);
+  sweep_writer writer{{}, output_file, output_mode::moment, read_output_encoding(config), size_t(config.optional("write_queue", 2))};
+
+  vadset profile;
+  if(!vad_file.empty())
+    profile = read_vad(vad_file);
+
+  // Normal equations of the sweeps so far, for the VAD retrieval.
+  std::unique_ptr<incremental_vad> retrieval;
+  if(vad_file.empty())
+    retrieval = std::make_unique<incremental_vad>(config);
+
+  size_t scan = 0;
+  streamed_sweep item;
+  while((opts.sweeps == 0 || scan < opts.sweeps) && source->next(item, opts.timeout)){
+    auto start = std::chrono::high_resolution_clock::now();
+    auto& dset = item.dset;
+    if(retrieval)
+      profile = retrieval->add(dset);
+
+    auto vadfield = generate_vad_field(dset, profile);
+    for(size_t k=0; k < dset.vradh.sweeps.size(); k++, scan++){
+      array2f nvel;
+      dealias_sweep(nvel, dset.vradh.sweeps[k], vadfield[k], dset.nyquist[k], nullptr, region_fallback);
+      if(publisher)
+        publisher->publish(dset, k, nvel, -9999.f);
+      auto folds = products.fold ? fold_index(nvel, dset.vradh.sweeps[k], dset.nyquist[k], -9999.f) : array2<uint8_t>{};
+      writer.push(scan, products.velocity ? std::move(nvel) : array2f{}, std::move(folds), item.origin);
+    }
+
+    std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+    std::cout << "Sweep " << scan << " dealiased in " << duration.count() << " seconds" << std::endl;
   }
+  writer.finish();
+
+  if(scan == 0)
+    throw std::runtime_error("no sweep arrived from " + opts.source);
+  std::cout << "Volume of " << scan << " sweeps written to " << output_file.string() << std::endl;
   std::cout << "Completed." << std::endl;
 }
 
@@ -300,6 +832,11 @@ int main(int argc, char* argv[])
 {
   try
   {
+    std::filesystem::path flow_file, prior_file, output_file;
+    reprocess_options reprocessing;
+    string stream_source;
+    daemon_options daemon;
+
     // process command line
     while (true)
     {
@@ -318,13 +855,125 @@ int main(int argc, char* argv[])
       case 't':
         trace::set_min_level(from_string<trace::level>(optarg));
         break;
+      case 'f':
+        flow_file = optarg;
+        break;
+      case 'p':
+        prior_file = optarg;
+        break;
+      case 'w':
+        output_file = optarg;
+        break;
+      case 'r':
+        reprocessing.archives = optarg;
+        break;
+      case 'o':
+        reprocessing.output = optarg;
+        break;
+      case 'c':
+        reprocessing.checkpoint = optarg;
+        break;
+      case 'd':
+        daemon.spools.push_back(optarg);
+        break;
+      case 's':
+        stream_source = optarg;
+        break;
+      case 'V':
+        reprocessing.vad_dir = optarg;
+        break;
       case '?':
         std::cerr << try_again;
         return EXIT_FAILURE;
       }
     }
 
-    if (argc - optind != 4)
+    // Volumes a crashed run held in memory would otherwise stay in /dev/shm.
+    remove_stale_memory_files();
+
+    // Archive reprocessing, the volumes come from the manifest.
+    if (!reprocessing.archives.empty())
+    {
+      if (argc - optind != 1 || reprocessing.output.empty())
+      {
+        std::cerr << "reprocessing needs config.conf and an output directory\n" << try_again;
+        return EXIT_FAILURE;
+      }
+      auto config = io::configuration{std::ifstream{argv[optind]}};
+      check_configuration_file(config);
+      if (reprocessing.checkpoint.empty())
+        reprocessing.checkpoint = reprocessing.output / "reprocess.state";
+      reprocessing.workers = config.optional("reprocess_workers", 0);
+      const auto output = parse_output_mode(config.optional("output_mode", "copy"));
+      if (output == output_mode::in_place)
+      {
+        std::cerr << "reprocessing writes to the output directory, output_mode cannot be in_place\n";
+        return EXIT_FAILURE;
+      }
+      reprocessing.chain = output == output_mode::copy;
+      frame_cache frames{size_t(config.optional("flow_cache_volumes", 4))};
+      reprocess(reprocessing, [&](auto const& vad, auto const& lag1, auto const& lag0, auto const& output, auto const& lag_output){
+        process_series_volume(config, vad, lag1, lag0, output, lag_output, frames);
+      });
+      return EXIT_SUCCESS;
+    }
+
+    // Daemon, the volumes come from the spools as they land.
+    if (!daemon.spools.empty())
+    {
+      if (argc - optind != 1 || reprocessing.output.empty())
+      {
+        std::cerr << "the daemon needs config.conf and an output directory\n" << try_again;
+        return EXIT_FAILURE;
+      }
+      auto config = io::configuration{std::ifstream{argv[optind]}};
+      check_configuration_file(config);
+      const auto output = parse_output_mode(config.optional("output_mode", "copy"));
+      if (output == output_mode::in_place)
+      {
+        std::cerr << "the daemon writes to the output directory, output_mode cannot be in_place\n";
+        return EXIT_FAILURE;
+      }
+      daemon.output = reprocessing.output;
+      daemon.vad_dir = reprocessing.vad_dir;
+      daemon.workers = config.optional("daemon_workers", 0);
+      daemon.chain = output == output_mode::copy;
+      daemon.metrics = config.optional("metrics_listen", "");
+
+      // Both set up before the workers fork, the metrics so the workers
+      // update the block the daemon serves, the mask so they share its pages.
+      metrics::share();
+      const string topography = config.optional("topography", "");
+      if (!topography.empty())
+        cached_seamask(topography);
+
+      frame_cache frames{size_t(config.optional("flow_cache_volumes", 4))};
+      run_daemon(daemon, [&](auto const& vad, auto const& lag1, auto const& lag0, auto const& output, auto const& lag_output){
+        process_series_volume(config, vad, lag1, lag0, output, lag_output, frames);
+      });
+      return EXIT_SUCCESS;
+    }
+
+    // Streaming, the sweeps come from the source as the radar writes them.
+    if (!stream_source.empty())
+    {
+      const int nargs = argc - optind;
+      if ((nargs != 1 && nargs != 2) || output_file.empty())
+      {
+        std::cerr << "streaming needs config.conf, an optional VAD profile and an output file (--write)\n" << try_again;
+        return EXIT_FAILURE;
+      }
+      auto config = io::configuration{std::ifstream{argv[optind]}};
+      check_configuration_file(config);
+      std::unique_ptr<memory_file> vad_member;
+      auto vad_file = nargs == 2 ? open_input(argv[optind+1], vad_member) : std::filesystem::path{};
+      process_stream(config, vad_file, read_stream_options(stream_source, config), output_file);
+      return EXIT_SUCCESS;
+    }
+
+    // The VAD profile is optional, without it it is retrieved from lag0.
+    const int nargs = argc - optind;
+    if (nargs != 3 && nargs != 4)
     {
       std::cerr << "missing required parameter\n" << try_again;
       return EXIT_FAILURE;
@@ -334,11 +983,25 @@ int main(int argc, char* argv[])
     if(check_configuration_file(config) != true)
       return EXIT_FAILURE;
 
+    // Archive members are held in memory for the whole run. Without an
+    // output file the dealiased moment is written into lag0, which then has
+    // to be a real file.
+    const int first_volume = optind + nargs - 2;
+    std::unique_ptr<memory_file> vad_member, lag1_member, lag0_member;
+    auto vad_file = nargs == 4 ? open_input(argv[optind+1], vad_member) : std::filesystem::path{};
+    auto lag1_file = open_input(argv[first_volume], lag1_member);
+    auto lag0_file = open_input(argv[first_volume+1], lag0_member);
+    if (lag0_member && output_file.empty())
+      throw std::invalid_argument("lag0 from an archive needs an output file (--write)");
+
     process_file(
           config
-        , argv[optind+1]
-        , argv[optind+2]
-        , argv[optind+3]
+        , vad_file
+        , lag1_file
+        , lag0_file
+        , output_file
+        , flow_file
+        , prior_file
         );
   }
   catch (std::exception& err)
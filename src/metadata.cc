@@ -1,13 +1,5 @@
 #include "metadata.h"
 
-auto get_azimuth(sweep swp) -> vector<double>{
-  vector<double> azi;
-  for(const auto& bin : swp.rays) {
-      azi.push_back(bin.degrees());
-  }
-  return azi;
-}
-
 auto get_date() -> std::string {
   std::time_t rawtime = std::time(nullptr);
   std::tm* timeinfo = std::localtime(&rawtime);
@@ -68,14 +60,6 @@ auto get_nyquist(io::odim::polar_volume const vol_odim) -> array1f{
   return nyquist;
 }
 
-auto get_range(sweep swp) -> vector<double>{
-  vector<double> r;
-  for(size_t i=0; i<swp.bins.size(); i++) {
-      r.push_back(swp.bins[i].ground_range);
-  }
-  return r;
-}
-
 auto init_altitudes(io::configuration const& config) -> array1f
 {
   auto alts = array1f{config["layer_count"]};
@@ -0,0 +1,227 @@
+#include "metrics.h"
+#include "resources.h"
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+  // Upper bounds of the histogram buckets, seconds. +Inf is the count.
+  constexpr std::array<double, 11> bounds{0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0};
+
+  struct histogram{
+    std::atomic<uint64_t> buckets[bounds.size()];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_us;
+  };
+
+  struct block{
+    histogram stages[size_t(metrics::stage::count)];
+    std::atomic<uint64_t> counters[size_t(metrics::counter::count)];
+    std::atomic<int64_t> gauges[size_t(metrics::gauge::count)];
+    std::atomic<uint64_t> worker_peak[metrics::max_workers];
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free
+    , "the metrics need lock free atomics to be shared between processes");
+
+  // Zero initialised, as the shared mapping is.
+  block local;
+  block* current = &local;
+  size_t worker = 0;
+
+  const char* stage_names[] = {"read", "vad", "dealias", "write", "volume"};
+}
+
+auto metrics::share() -> void{
+  auto ptr = mmap(nullptr, sizeof(block), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    throw std::runtime_error("unable to map the shared metrics");
+  current = static_cast<block*>(ptr);
+}
+
+auto metrics::set_worker(size_t id) -> void{
+  worker = std::min(id, max_workers - 1);
+}
+
+auto metrics::observe(stage s, double seconds) -> void{
+  auto& h = current->stages[size_t(s)];
+  for (size_t i = 0; i < bounds.size(); ++i)
+    if (seconds <= bounds[i]){
+      h.buckets[i].fetch_add(1, std::memory_order_relaxed);
+      break;
+    }
+  h.count.fetch_add(1, std::memory_order_relaxed);
+  h.sum_us.fetch_add(uint64_t(std::max(seconds, 0.0) * 1e6), std::memory_order_relaxed);
+}
+
+auto metrics::add(counter c, uint64_t n) -> void{
+  current->counters[size_t(c)].fetch_add(n, std::memory_order_relaxed);
+}
+
+auto metrics::set(gauge g, int64_t value) -> void{
+  current->gauges[size_t(g)].store(value, std::memory_order_relaxed);
+}
+
+auto metrics::record_memory() -> void{
+  current->worker_peak[worker].store(peak_resident_bytes(), std::memory_order_relaxed);
+}
+
+auto metrics::render(std::map<string, site_counts> const& sites) -> string{
+  auto const& b = *current;
+  auto counter = [&](metrics::counter c){ return b.counters[size_t(c)].load(std::memory_order_relaxed); };
+  std::ostringstream out;
+
+  out << "# HELP vad_dealias_stage_seconds Time spent in each stage of a volume.\n"
+      << "# TYPE vad_dealias_stage_seconds histogram\n";
+  for (size_t s = 0; s < size_t(stage::count); ++s){
+    auto const& h = b.stages[s];
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < bounds.size(); ++i){
+      cumulative += h.buckets[i].load(std::memory_order_relaxed);
+      out << "vad_dealias_stage_seconds_bucket{stage=\"" << stage_names[s] << "\",le=\"" << bounds[i] << "\"} " << cumulative << '\n';
+    }
+    const auto count = h.count.load(std::memory_order_relaxed);
+    out << "vad_dealias_stage_seconds_bucket{stage=\"" << stage_names[s] << "\",le=\"+Inf\"} " << count << '\n'
+        << "vad_dealias_stage_seconds_sum{stage=\"" << stage_names[s] << "\"} " << h.sum_us.load(std::memory_order_relaxed) * 1e-6 << '\n'
+        << "vad_dealias_stage_seconds_count{stage=\"" << stage_names[s] << "\"} " << count << '\n';
+  }
+
+  out << "# HELP vad_dealias_gates_total Valid gates dealiased.\n"
+      << "# TYPE vad_dealias_gates_total counter\n"
+      << "vad_dealias_gates_total " << counter(counter::gates) << '\n'
+      << "# HELP vad_dealias_unfold_failures_total Gates no reference could unfold.\n"
+      << "# TYPE vad_dealias_unfold_failures_total counter\n"
+      << "vad_dealias_unfold_failures_total " << counter(counter::unfold_failures) << '\n'
+      << "# HELP vad_dealias_region_unfolded_total Failed gates unfolded by region growing.\n"
+      << "# TYPE vad_dealias_region_unfolded_total counter\n"
+      << "vad_dealias_region_unfolded_total " << counter(counter::region_unfolded) << '\n'
+      << "# HELP vad_dealias_flow_linear_solves_total Linear systems solved by the flow tracking.\n"
+      << "# TYPE vad_dealias_flow_linear_solves_total counter\n"
+      << "vad_dealias_flow_linear_solves_total " << counter(counter::linear_solves) << '\n'
+      << "# HELP vad_dealias_flow_linear_iterations_total Iterations of the linear solver of the flow tracking.\n"
+      << "# TYPE vad_dealias_flow_linear_iterations_total counter\n"
+      << "vad_dealias_flow_linear_iterations_total " << counter(counter::linear_iterations) << '\n'
+      << "# HELP vad_dealias_flow_linear_capped_total Linear systems left above tol at the iteration limit.\n"
+      << "# TYPE vad_dealias_flow_linear_capped_total counter\n"
+      << "vad_dealias_flow_linear_capped_total " << counter(counter::linear_capped) << '\n';
+
+  const std::pair<const char*, std::pair<metrics::counter, metrics::counter>> caches[] = {
+      {"reference_lut", {counter::lut_hits, counter::lut_misses}}
+    , {"seamask", {counter::seamask_hits, counter::seamask_misses}}
+    , {"cappi_frame", {counter::cappi_hits, counter::cappi_misses}}
+    };
+  out << "# HELP vad_dealias_cache_lookups_total Cache lookups by result.\n"
+      << "# TYPE vad_dealias_cache_lookups_total counter\n";
+  for (auto const& [name, c] : caches)
+    out << "vad_dealias_cache_lookups_total{cache=\"" << name << "\",result=\"hit\"} " << counter(c.first) << '\n'
+        << "vad_dealias_cache_lookups_total{cache=\"" << name << "\",result=\"miss\"} " << counter(c.second) << '\n';
+  out << "# HELP vad_dealias_cache_hit_ratio Share of the cache lookups that hit.\n"
+      << "# TYPE vad_dealias_cache_hit_ratio gauge\n";
+  for (auto const& [name, c] : caches){
+    const auto total = counter(c.first) + counter(c.second);
+    out << "vad_dealias_cache_hit_ratio{cache=\"" << name << "\"} " << (total ? double(counter(c.first)) / total : 0.0) << '\n';
+  }
+
+  out << "# HELP vad_dealias_queued_volumes Volumes waiting for a worker.\n"
+      << "# TYPE vad_dealias_queued_volumes gauge\n"
+      << "vad_dealias_queued_volumes " << b.gauges[size_t(gauge::queued_volumes)].load(std::memory_order_relaxed) << '\n'
+      << "# HELP vad_dealias_busy_workers Workers processing a volume.\n"
+      << "# TYPE vad_dealias_busy_workers gauge\n"
+      << "vad_dealias_busy_workers " << b.gauges[size_t(gauge::busy_workers)].load(std::memory_order_relaxed) << '\n';
+
+  out << "# HELP vad_dealias_volumes_total Volumes processed by site.\n"
+      << "# TYPE vad_dealias_volumes_total counter\n";
+  for (auto const& [site, c] : sites)
+    out << "vad_dealias_volumes_total{site=\"" << site << "\"} " << c.processed << '\n';
+  out << "# HELP vad_dealias_volume_failures_total Volumes that failed by site.\n"
+      << "# TYPE vad_dealias_volume_failures_total counter\n";
+  for (auto const& [site, c] : sites)
+    out << "vad_dealias_volume_failures_total{site=\"" << site << "\"} " << c.failed << '\n';
+
+  out << "# HELP vad_dealias_resident_bytes Resident memory of the serving process.\n"
+      << "# TYPE vad_dealias_resident_bytes gauge\n"
+      << "vad_dealias_resident_bytes " << resident_bytes() << '\n'
+      << "# HELP vad_dealias_worker_peak_resident_bytes Peak resident memory of each worker.\n"
+      << "# TYPE vad_dealias_worker_peak_resident_bytes gauge\n";
+  for (size_t i = 0; i < max_workers; ++i)
+    if (auto peak = b.worker_peak[i].load(std::memory_order_relaxed))
+      out << "vad_dealias_worker_peak_resident_bytes{worker=\"" << i << "\"} " << peak << '\n';
+
+  return out.str();
+}
+
+metrics_server::metrics_server(string const& address){
+  if (address.rfind("unix:", 0) == 0){
+    unix_path_ = address.substr(5);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (unix_path_.string().size() >= sizeof(addr.sun_path))
+      throw std::invalid_argument("metrics socket path too long: " + unix_path_.string());
+    std::strcpy(addr.sun_path, unix_path_.c_str());
+    std::filesystem::remove(unix_path_);
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd_ < 0 || bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd_, 16) != 0)
+      throw std::runtime_error("unable to listen on " + address);
+    return;
+  }
+
+  auto spec = address.rfind("tcp:", 0) == 0 ? address.substr(4) : address;
+  auto colon = spec.rfind(':');
+  if (colon == string::npos)
+    throw std::invalid_argument("invalid metrics address " + address);
+  auto host = spec.substr(0, colon), port = spec.substr(colon + 1);
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* found = nullptr;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0 || !found)
+    throw std::invalid_argument("invalid metrics address " + address);
+  fd_ = socket(found->ai_family, found->ai_socktype | SOCK_CLOEXEC, 0);
+  int on = 1;
+  const bool ok = fd_ >= 0
+    && setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0
+    && bind(fd_, found->ai_addr, found->ai_addrlen) == 0
+    && listen(fd_, 16) == 0;
+  freeaddrinfo(found);
+  if (!ok)
+    throw std::runtime_error("unable to listen on " + address);
+}
+
+metrics_server::~metrics_server(){
+  close(fd_);
+  if (!unix_path_.empty())
+    std::filesystem::remove(unix_path_);
+}
+
+auto metrics_server::serve(std::map<string, metrics::site_counts> const& sites) -> void{
+  const int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (client < 0)
+    return;
+
+  // Whatever the request, the answer is the metrics. A slow client is
+  // given a short while to send it, so it can't stall the daemon.
+  timeval timeout{0, 200000};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  char request[4096];
+  (void) !read(client, request, sizeof(request));
+
+  const auto body = metrics::render(sites);
+  const auto response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+    + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+  for (size_t sent = 0; sent < response.size(); ){
+    auto n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+  close(client);
+}
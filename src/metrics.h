@@ -0,0 +1,89 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "pch.h"
+
+#include <map>
+
+using namespace bom;
+
+// Counters, gauges and latency histograms of the processing. They live in
+// one block of atomics that share() moves to a shared anonymous mapping, so
+// when it is called before the daemon forks its workers update the same
+// block the daemon serves. Updates are relaxed atomic adds, there are no
+// locks. Without share() the block is private to the process.
+namespace metrics{
+
+  enum class stage{ read, vad, dealias, write, volume, count };
+  enum class counter{
+      gates              // valid gates dealiased
+    , unfold_failures    // gates no reference could unfold
+    , region_unfolded    // of those, gates unfolded by region growing
+    , lut_hits           // reference LUT cache
+    , lut_misses
+    , seamask_hits       // land/sea mask cache
+    , seamask_misses
+    , cappi_hits         // CAPPI layer frames of the flow tracking
+    , cappi_misses
+    , linear_solves      // linear systems of the flow tracking
+    , linear_iterations  // iterations of the linear solver
+    , linear_capped      // systems left above tol at the iteration limit
+    , count
+  };
+  enum class gauge{ queued_volumes, busy_workers, count };
+
+  constexpr size_t max_workers = 256;
+
+  auto share() -> void;
+
+  // Slot of this process for the per-worker gauges.
+  auto set_worker(size_t id) -> void;
+
+  auto observe(stage s, double seconds) -> void;
+  auto add(counter c, uint64_t n = 1) -> void;
+  auto set(gauge g, int64_t value) -> void;
+
+  // Peak resident memory of this process into its worker slot.
+  auto record_memory() -> void;
+
+  // Volumes processed and failed by site, counted by the daemon itself.
+  struct site_counts{
+    uint64_t processed = 0;
+    uint64_t failed = 0;
+  };
+
+  // Prometheus text exposition of everything above.
+  auto render(std::map<string, site_counts> const& sites) -> string;
+
+  // Times a scope into a stage histogram.
+  class timer{
+  public:
+    explicit timer(stage s) : stage_{s}, start_{std::chrono::steady_clock::now()} { }
+    ~timer(){ observe(stage_, std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count()); }
+
+  private:
+    stage stage_;
+    std::chrono::steady_clock::time_point start_;
+  };
+}
+
+// Endpoint serving the metrics over HTTP on a Unix socket (unix:<path>) or
+// TCP (tcp:<host>:<port>, or :<port> for every interface). The daemon polls
+// fd() and calls serve() when it is readable.
+class metrics_server{
+public:
+  explicit metrics_server(string const& address);
+  ~metrics_server();
+
+  metrics_server(metrics_server const&) = delete;
+  auto operator=(metrics_server const&) -> metrics_server& = delete;
+
+  auto fd() const -> int { return fd_; }
+  auto serve(std::map<string, metrics::site_counts> const& sites) -> void;
+
+private:
+  int fd_;
+  std::filesystem::path unix_path_;
+};
+
+#endif
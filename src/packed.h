@@ -0,0 +1,81 @@
+#ifndef PACKED_H
+#define PACKED_H
+
+#include "pch.h"
+using namespace bom;
+
+// Kernels on moments kept packed (uint8/uint16 with gain and offset). The
+// values are decoded as read_unpack would: nodata gates to NaN, undetect
+// gates to packed_data::undetect_value.
+
+inline auto is_packed(sweep const& swp) -> bool{
+  return swp.packed.raw.size() > 0 || swp.packed.raw8.size() > 0;
+}
+
+// Calls f with the codes of a packed moment, at the width they are stored.
+template <typename F>
+inline auto with_codes(packed_data const& p, F&& f){
+  return p.raw8.size() > 0 ? f(p.raw8) : f(p.raw);
+}
+
+template <typename F>
+inline auto with_codes(packed_data& p, F&& f){
+  return p.raw8.size() > 0 ? f(p.raw8) : f(p.raw);
+}
+
+inline auto sweep_extents(sweep const& swp) -> vec2z{
+  if (!is_packed(swp))
+    return swp.data.extents();
+  return with_codes(swp.packed, [](auto const& codes){ return codes.extents(); });
+}
+
+// Decode one ray. Branch free, so the integer to float conversion and the
+// selects run in vector registers.
+inline auto decode_row(packed_data const& p, size_t ray, float* out) -> void{
+  with_codes(p, [&](auto const& codes){
+    const auto raw = codes[ray];
+    const auto n = codes.extents().x;
+    for (size_t i = 0; i < n; ++i){
+      const float v = p.gain * raw[i] + p.offset;
+      out[i] = raw[i] == p.nodata ? nodata : (raw[i] == p.undetect ? p.undetect_value : v);
+    }
+  });
+}
+
+inline auto gate_value(sweep const& swp, size_t ray, size_t bin) -> float{
+  if (!is_packed(swp))
+    return swp.data[ray][bin];
+  const auto& p = swp.packed;
+  const uint16_t raw = with_codes(p, [&](auto const& codes) -> uint16_t{ return codes[ray][bin]; });
+  return raw == p.nodata ? nodata : (raw == p.undetect ? p.undetect_value : p.gain * raw + p.offset);
+}
+
+// Mark a gate as missing, in the packed values when there are any.
+inline auto set_gate_nodata(sweep& swp, size_t ray, size_t bin) -> void{
+  if (is_packed(swp))
+    with_codes(swp.packed, [&](auto& codes){ codes[ray][bin] = swp.packed.nodata; });
+  else
+    swp.data[ray][bin] = nodata;
+  if (!swp.mask.valid.empty())
+    swp.mask.valid[ray * swp.mask.words + bin / 64] &= ~(uint64_t(1) << (bin % 64));
+}
+
+// A ray of the moment, decoded into buffer when the sweep is packed.
+inline auto sweep_row(sweep const& swp, size_t ray, vector<float>& buffer) -> const float*{
+  if (!is_packed(swp))
+    return swp.data[ray];
+  buffer.resize(sweep_extents(swp).x);
+  decode_row(swp.packed, ray, buffer.data());
+  return buffer.data();
+}
+
+inline auto unpack(sweep const& swp) -> array2f{
+  if (!is_packed(swp))
+    return swp.data;
+  auto data = array2f{sweep_extents(swp)};
+  for (size_t j = 0; j < data.extents().y; ++j)
+    decode_row(swp.packed, j, data[j]);
+  return data;
+}
+
+#endif
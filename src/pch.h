@@ -31,17 +31,58 @@ using namespace bom;
 constexpr float nodata = std::numeric_limits<float>::quiet_NaN();
 constexpr float undetect = -32.0f;
 
-struct bin_info{
-  float slant_range;
-  float ground_range;
-  float altitude;
+// Bin geometry, one contiguous array per field. scale is the slant range
+// spacing when the bins are evenly spaced, zero otherwise.
+struct bin_geometry{
+  vector<float> slant_range; // @ bin centers
+  vector<float> ground_range;
+  vector<float> altitude;
+  float start = 0.f;
+  float scale = 0.f;
+
+  auto size() const -> size_t { return slant_range.size(); }
+};
+
+// Ray geometry with the trigonometry of the azimuths. scale is the azimuth
+// spacing when the rays are evenly spaced, zero otherwise.
+struct ray_geometry{
+  vector<angle> azimuth; // @ ray centers
+  vector<float> sin_az;
+  vector<float> cos_az;
+  angle start = 0_deg;
+  angle scale = 0_deg;
+
+  auto size() const -> size_t { return azimuth.size(); }
+};
+
+// Moment kept as its raw ODIM values, see packed.h for the kernels. 8-bit
+// moments are kept in raw8 at their width, the others in raw.
+struct packed_data{
+  array2<uint16_t> raw;
+  array2<uint8_t>  raw8;
+  float gain = 1.f;
+  float offset = 0.f;
+  uint16_t nodata = 0;
+  uint16_t undetect = 0;
+  float undetect_value = ::nodata; // value of undetect gates once decoded
+};
+
+// One bit per gate, each ray padded to whole 64-bit words. See gate_bits.h.
+struct gate_bits{
+  size_t words = 0;          // words per ray
+  vector<uint64_t> valid;    // gate holds a value
+  vector<uint64_t> undetect; // gate flagged undetect
 };
 
 struct sweep{
   radar::beam_propagation beam;
-  array1<bin_info>        bins; // @ bin centers
-  array1<angle>           rays; // @ ray centers
-  array2f                 data;  
+  bin_geometry            bins;
+  ray_geometry            rays;
+  float                   cos_el = 1.f; // of the beam elevation
+  float                   sin_el = 0.f;
+  array2f                 data;   // empty when the moment is packed
+  packed_data             packed; // raw values when read packed
+  gate_bits               mask;   // validity of the gates, set at decode
 };
 
 struct volume{
@@ -59,6 +100,7 @@ struct radarset{
   string time;
   string lowest_sweep_time;
   float beamwidth;
+  bool clutter_corrected = false; // dbzh had the sea clutter removed
 };
 
 struct vadset{
@@ -73,4 +115,11 @@ struct vadset{
   vector<float> des;
 };
 
+struct flow_stack{
+  array1f altitude;
+  vec2z   extents; // grid size of every layer
+  array1f u;       // [layer][y][x]
+  array1f v;       // [layer][y][x]
+};
+
 #endif // PCH_H
\ No newline at end of file
@@ -0,0 +1,255 @@
+#include "publish.h"
+
+#include <cstring>
+#include <climits>
+#include <thread>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace shm_ring;
+
+static constexpr size_t slot_alignment = 64;
+
+static auto align(size_t n, size_t to) -> size_t{
+  return (n + to - 1) / to * to;
+}
+
+static auto slot_at(header const* ring, uint64_t sweep) -> slot*{
+  auto base = reinterpret_cast<char*>(const_cast<header*>(ring)) + align(sizeof(header), slot_alignment);
+  return reinterpret_cast<slot*>(base + (sweep - 1) % ring->slots * size_t(ring->slot_bytes));
+}
+
+static auto futex(std::atomic<uint32_t> const& word, int op, uint32_t value, const timespec* timeout) -> long{
+  return syscall(SYS_futex, reinterpret_cast<const uint32_t*>(&word), op, value, timeout, nullptr, 0);
+}
+
+static auto map_ring(int fd, size_t size, int prot, string const& name) -> header*{
+  auto ptr = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED){
+    close(fd);
+    throw std::runtime_error("unable to map shared memory ring " + name);
+  }
+  return static_cast<header*>(ptr);
+}
+
+static auto same_layout(header const* ring, size_t slots, size_t slot_bytes) -> bool{
+  return ring->magic == magic && ring->version == version && ring->slots == slots && ring->slot_bytes == slot_bytes;
+}
+
+static auto copy_string(char* to, size_t size, string const& from) -> void{
+  std::memset(to, 0, size);
+  std::memcpy(to, from.data(), std::min(from.size(), size - 1));
+}
+
+sweep_publisher::sweep_publisher(string const& name, size_t slots, size_t slot_bytes)
+  : name_{name[0] == '/' ? name : "/" + name}
+{
+  if (slots == 0 || slot_bytes <= sizeof(slot) || slot_bytes > UINT32_MAX)
+    throw std::invalid_argument("invalid shared memory ring layout for " + name_);
+
+  slot_bytes = align(slot_bytes, slot_alignment);
+  size_ = align(sizeof(header), slot_alignment) + slots * slot_bytes;
+
+  fd_ = shm_open(name_.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd_ < 0)
+    throw std::runtime_error("unable to open shared memory ring " + name_);
+
+  // Alone on the ring, lay it out again unless it has our layout already,
+  // which keeps the count of sweeps consumers know about. Otherwise wait
+  // for a publisher laying it out and join it.
+  struct stat st;
+  if (flock(fd_, LOCK_EX | LOCK_NB) == 0){
+    const bool fresh = fstat(fd_, &st) != 0 || size_t(st.st_size) != size_;
+    if (fresh && ftruncate(fd_, size_) != 0){
+      close(fd_);
+      throw std::runtime_error("unable to size shared memory ring " + name_);
+    }
+    ring_ = map_ring(fd_, size_, PROT_READ | PROT_WRITE, name_);
+    if (fresh || !same_layout(ring_, slots, slot_bytes)){
+      ring_->magic = 0;
+      ring_->slots = slots;
+      ring_->slot_bytes = slot_bytes;
+      ring_->version = version;
+      ring_->published.store(0);
+      ring_->claimed.store(0);
+      ring_->notify.store(0);
+      for (uint64_t n = 1; n <= slots; ++n)
+        slot_at(ring_, n)->sequence.store(0);
+      std::atomic_thread_fence(std::memory_order_release);
+      ring_->magic = magic;
+    }
+  }
+  else{
+    flock(fd_, LOCK_SH);
+    if (fstat(fd_, &st) != 0 || size_t(st.st_size) != size_){
+      close(fd_);
+      throw std::invalid_argument("shared memory ring " + name_ + " is in use with another layout");
+    }
+    ring_ = map_ring(fd_, size_, PROT_READ | PROT_WRITE, name_);
+  }
+
+  // The exclusive lock is dropped before the shared one is taken, so another
+  // publisher may have laid the ring out again in between.
+  flock(fd_, LOCK_SH);
+  if (fstat(fd_, &st) != 0 || size_t(st.st_size) != size_ || !same_layout(ring_, slots, slot_bytes)){
+    munmap(ring_, size_);
+    close(fd_);
+    throw std::invalid_argument("shared memory ring " + name_ + " is in use with another layout");
+  }
+}
+
+sweep_publisher::~sweep_publisher(){
+  munmap(ring_, size_);
+  close(fd_);
+}
+
+auto sweep_publisher::publish(radarset const& dset, size_t scan, array2f const& velocity, float missing) -> bool{
+  auto const& swp = dset.vradh.sweeps[scan];
+  const auto [nbins, nrays] = velocity.extents();
+  const auto data_offset = align(sizeof(slot) + nrays * sizeof(float), 16);
+  if (data_offset + velocity.size() * sizeof(float) > ring_->slot_bytes){
+    trace::warning("sweep {} does not fit a slot of the shared memory ring {}, not published", scan, name_);
+    return false;
+  }
+
+  // With more publishers than slots, the publisher of sweep n + slots may
+  // reach the slot before the one of sweep n is done with it. The slot is
+  // taken from an even sequence only, and a sweep older than the one it
+  // holds is dropped. A publisher that died while writing leaves an odd
+  // sequence behind, taken over after a second.
+  const auto n = ring_->claimed.fetch_add(1, std::memory_order_relaxed) + 1;
+  auto s = slot_at(ring_, n);
+  const auto stale = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  auto seq = s->sequence.load(std::memory_order_relaxed);
+  while (true){
+    if (seq >= 2 * n){
+      trace::warning("sweep {} was overtaken by newer sweeps in the shared memory ring {}, not published", scan, name_);
+      return false;
+    }
+    if ((seq & 1) && std::chrono::steady_clock::now() < stale){
+      std::this_thread::yield();
+      seq = s->sequence.load(std::memory_order_relaxed);
+      continue;
+    }
+    if (s->sequence.compare_exchange_weak(seq, 2 * n + 1, std::memory_order_relaxed))
+      break;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  copy_string(s->source, sizeof(s->source), dset.source);
+  copy_string(s->date, sizeof(s->date), dset.date);
+  copy_string(s->time, sizeof(s->time), dset.time);
+  s->lat = dset.vradh.location.lat.degrees();
+  s->lon = dset.vradh.location.lon.degrees();
+  s->height = dset.vradh.location.alt;
+  s->scan = scan;
+  s->rays = nrays;
+  s->bins = nbins;
+  s->elevation = swp.beam.elevation().degrees();
+  s->nyquist = scan < dset.nyquist.size() ? dset.nyquist[scan] : nodata;
+  s->range_start = swp.bins.size() > 0 ? swp.bins.slant_range[0] : 0.f;
+  s->range_scale = swp.bins.size() > 1 ? swp.bins.slant_range[1] - swp.bins.slant_range[0] : 0.f;
+  s->missing = missing;
+  s->data_offset = data_offset;
+
+  auto base = reinterpret_cast<char*>(s);
+  auto azimuth = reinterpret_cast<float*>(base + sizeof(slot));
+  for (size_t j = 0; j < nrays; ++j)
+    azimuth[j] = j < swp.rays.size() ? swp.rays.azimuth[j].degrees() : nodata;
+  std::memcpy(base + data_offset, velocity.data(), velocity.size() * sizeof(float));
+
+  s->sequence.store(2 * n, std::memory_order_release);
+  auto published = ring_->published.load(std::memory_order_relaxed);
+  while (published < n && !ring_->published.compare_exchange_weak(published, n, std::memory_order_release, std::memory_order_relaxed))
+    ;
+  ring_->notify.fetch_add(1, std::memory_order_release);
+  futex(ring_->notify, FUTEX_WAKE, INT_MAX, nullptr);
+  return true;
+}
+
+sweep_subscriber::sweep_subscriber(string const& name){
+  const auto path = name[0] == '/' ? name : "/" + name;
+  auto fd = shm_open(path.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    throw std::runtime_error("no shared memory ring " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(header)){
+    close(fd);
+    throw std::runtime_error("invalid shared memory ring " + path);
+  }
+  size_ = st.st_size;
+  ring_ = map_ring(fd, size_, PROT_READ, path);
+  close(fd);
+  if (ring_->magic != magic || ring_->version != version
+      || align(sizeof(header), slot_alignment) + size_t(ring_->slots) * ring_->slot_bytes > size_){
+    munmap(ring_, size_);
+    throw std::runtime_error("invalid shared memory ring " + path);
+  }
+}
+
+sweep_subscriber::~sweep_subscriber(){
+  munmap(ring_, size_);
+}
+
+auto sweep_subscriber::published() const -> uint64_t{
+  return ring_->published.load(std::memory_order_acquire);
+}
+
+auto sweep_subscriber::wait(uint64_t seen, int timeout_ms) const -> uint64_t{
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (true){
+    const auto word = ring_->notify.load(std::memory_order_acquire);
+    const auto count = published();
+    if (count > seen)
+      return count;
+
+    timespec ts, *timeout = nullptr;
+    if (timeout_ms >= 0){
+      auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (left <= 0)
+        return count;
+      ts.tv_sec = left / 1000000000;
+      ts.tv_nsec = left % 1000000000;
+      timeout = &ts;
+    }
+    // Returns at once when a publish bumped the word since it was read.
+    futex(ring_->notify, FUTEX_WAIT, word, timeout);
+  }
+}
+
+auto sweep_subscriber::open(uint64_t sweep, view& out) const -> bool{
+  if (sweep == 0 || sweep > published())
+    return false;
+  auto s = slot_at(ring_, sweep);
+  if (s->sequence.load(std::memory_order_acquire) != 2 * sweep)
+    return false;
+  auto base = reinterpret_cast<const char*>(s);
+  const uint64_t data_offset = s->data_offset;
+  out = view{s, sweep, reinterpret_cast<const float*>(base + sizeof(shm_ring::slot))
+    , reinterpret_cast<const float*>(base + (data_offset < ring_->slot_bytes ? data_offset : 0)), ring_->slot_bytes};
+  return out.valid();
+}
+
+auto sweep_subscriber::pending(uint64_t sweep) const -> bool{
+  if (sweep == 0 || sweep > ring_->claimed.load(std::memory_order_acquire))
+    return false;
+  const auto seq = slot_at(ring_, sweep)->sequence.load(std::memory_order_acquire);
+  return seq < 2 * sweep || seq == 2 * sweep + 1;
+}
+
+auto sweep_subscriber::view::fits(uint32_t rays, uint32_t bins, uint64_t data_offset) const -> bool{
+  return data_offset >= sizeof(shm_ring::slot) + uint64_t(rays) * sizeof(float)
+    && data_offset <= bytes
+    && uint64_t(rays) * bins <= (bytes - data_offset) / sizeof(float)
+    && reinterpret_cast<const char*>(data) == reinterpret_cast<const char*>(slot) + data_offset;
+}
+
+auto sweep_subscriber::view::valid() const -> bool{
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot->sequence.load(std::memory_order_relaxed) == 2 * sweep;
+}
@@ -0,0 +1,130 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include "pch.h"
+
+#include <atomic>
+
+using namespace bom;
+
+// Dealiased sweeps handed to local consumers through a POSIX shared memory
+// ring (/dev/shm/<name>), next to the HDF5 output that stays the durable
+// copy. The ring is a header followed by a fixed number of slots, each a
+// slot header, the azimuths of the rays and the velocities, ray by ray,
+// -9999 marking gates without a value. Sweep n (from 1) goes to slot
+// (n - 1) % slots and overwrites the oldest one.
+//
+// Several processes may publish into one ring, such as the workers of the
+// daemon. A publisher claims sweep n from the claimed count, then takes its
+// slot with a sequence lock: the sequence is 2n + 1 while sweep n is
+// written and 2n once it is complete. Readers check the sequence is the
+// same even value before and after reading. The published count is the
+// highest sweep completed, so a sweep below it may still be in progress
+// when publishers overlap. Every publish bumps the notify word of the
+// header, a process shared futex consumers wait on.
+//
+// Publishers hold a shared flock on the ring. It is laid out again only
+// under an exclusive one, that is when no publisher is using it.
+namespace shm_ring{
+  constexpr uint32_t magic = 0x56414431; // "VAD1"
+  constexpr uint32_t version = 3;
+
+  struct header{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_bytes;             // header, azimuths and data of a slot
+    std::atomic<uint64_t> published; // highest sweep completed
+    std::atomic<uint64_t> claimed;   // sweeps handed to publishers so far
+    std::atomic<uint32_t> notify;    // futex word, bumped by every publish
+    uint32_t pad;
+  };
+
+  struct slot{
+    std::atomic<uint64_t> sequence;
+    char     source[64];   // of the volume, as in /what/source
+    char     date[16];     // /what/date and /what/time of the volume
+    char     time[16];
+    double   lat;          // of the radar, degrees
+    double   lon;
+    float    height;       // m
+    uint32_t scan;         // index of the sweep in the volume
+    uint32_t rays;
+    uint32_t bins;
+    float    elevation;    // degrees
+    float    nyquist;      // m/s
+    float    range_start;  // m, center of the first bin
+    float    range_scale;  // m
+    float    missing;      // value of the gates without a value
+    uint64_t data_offset;  // bytes from the slot start, azimuths come first
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free
+    , "the ring needs lock free atomics to be shared between processes");
+}
+
+// Writer side, one per process publishing into the ring.
+class sweep_publisher{
+public:
+  // Creates the ring, or joins an existing one of the same layout. A ring
+  // of another layout is laid out again when no publisher holds it, and
+  // throws otherwise.
+  sweep_publisher(string const& name, size_t slots, size_t slot_bytes);
+  ~sweep_publisher();
+
+  sweep_publisher(sweep_publisher const&) = delete;
+  auto operator=(sweep_publisher const&) -> sweep_publisher& = delete;
+
+  // Copies the sweep into the next slot and wakes the consumers. Sweeps too
+  // large for a slot are skipped, returning false.
+  auto publish(radarset const& dset, size_t scan, array2f const& velocity, float missing) -> bool;
+
+private:
+  string name_;
+  size_t size_;
+  int fd_;
+  shm_ring::header* ring_;
+};
+
+// Consumer side. Slots are read in place, a view being valid until its
+// slot is overwritten, which valid() tells after the data was used.
+class sweep_subscriber{
+public:
+  explicit sweep_subscriber(string const& name);
+  ~sweep_subscriber();
+
+  sweep_subscriber(sweep_subscriber const&) = delete;
+  auto operator=(sweep_subscriber const&) -> sweep_subscriber& = delete;
+
+  struct view{
+    shm_ring::slot const* slot;
+    uint64_t              sweep;
+    const float*          azimuth; // per ray, degrees
+    const float*          data;    // [ray][bin]
+    size_t                bytes;   // of the slot
+
+    auto valid() const -> bool;
+
+    // The rays, bins and data offset read from the slot stay within it.
+    // They are read before the sequence is checked, so may be torn.
+    auto fits(uint32_t rays, uint32_t bins, uint64_t data_offset) const -> bool;
+  };
+
+  auto published() const -> uint64_t;
+
+  // Blocks until more than `seen` sweeps were published or the timeout
+  // (ms, negative to wait forever) expires. Returns the published count.
+  auto wait(uint64_t seen, int timeout_ms = -1) const -> uint64_t;
+
+  // Sweep n, false when it is not complete or was overwritten already.
+  auto open(uint64_t sweep, view& out) const -> bool;
+
+  // Sweep n is claimed by a publisher that has not completed it yet.
+  auto pending(uint64_t sweep) const -> bool;
+
+private:
+  size_t size_;
+  shm_ring::header* ring_;
+};
+
+#endif
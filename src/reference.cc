@@ -0,0 +1,142 @@
+#include "reference.h"
+#include "io.h"
+#include "fold.h"
+#include "geometry.h"
+#include "metrics.h"
+#include "packed.h"
+
+#include <map>
+#include <mutex>
+
+// Lag sweeps further than this in elevation are not used as a reference.
+constexpr double max_elevation_difference = 0.2; // degrees
+
+auto read_reference(std::filesystem::path const& filename, io::configuration const& config, thread_pool* pool) -> volume{
+  io::odim::polar_volume vol_odim{filename, io_mode::read_only};
+  auto lag = read_moment(vol_odim, "VRAD_DEALIAS", config, false, pool);
+  if (lag.sweeps.empty())
+    return read_dealiased(filename, config, pool);
+  return lag;
+}
+
+auto geometry_key(volume const& vol) -> string{
+  std::ostringstream key;
+  key << std::fixed << std::setprecision(2);
+  for (auto const& swp : vol.sweeps){
+    key << swp.beam.elevation().degrees() << ' ' << swp.rays.size() << ' ' << swp.bins.size();
+    if (swp.rays.size() > 0)
+      key << ' ' << swp.rays.azimuth[0].degrees();
+    if (swp.bins.size() > 0)
+      key << ' ' << swp.bins.slant_range[0] << ' ' << swp.bins.slant_range[swp.bins.size() - 1];
+    key << ';';
+  }
+  return key.str();
+}
+
+auto build_luts(volume const& current, volume const& lag) -> vector<sweep_lut>{
+  vector<sweep_lut> luts(current.sweeps.size());
+
+  for (size_t k = 0; k < current.sweeps.size(); ++k){
+    auto const& swp = current.sweeps[k];
+    auto& lut = luts[k];
+
+    // Lag sweep with the closest elevation.
+    lut.sweep = -1;
+    double best = max_elevation_difference;
+    for (size_t l = 0; l < lag.sweeps.size(); ++l){
+      auto diff = std::fabs(swp.beam.elevation().degrees() - lag.sweeps[l].beam.elevation().degrees());
+      if (diff <= best){
+        best = diff;
+        lut.sweep = l;
+      }
+    }
+    if (lut.sweep < 0)
+      continue;
+
+    auto const& ref = lag.sweeps[lut.sweep];
+
+    // Closest lag ray, across the 0/360 wrap.
+    lut.rays.assign(swp.rays.size(), -1);
+    for (size_t j = 0; j < swp.rays.size(); ++j)
+      if (ref.rays.size() > 0)
+        lut.rays[j] = find_ray(ref.rays, swp.rays.azimuth[j]);
+
+    // Lag bin holding the same slant range, by arithmetic when the bins
+    // are evenly spaced, else the closer of the two neighbours, up to half
+    // a bin past either end.
+    lut.bins.assign(swp.bins.size(), -1);
+    auto const& sr = ref.bins.slant_range;
+    if (ref.bins.scale != 0.f){
+      for (size_t i = 0; i < swp.bins.size(); ++i){
+        auto ii = std::lround((swp.bins.slant_range[i] - ref.bins.start) / ref.bins.scale);
+        if (ii >= 0 && ii < long(ref.bins.size()))
+          lut.bins[i] = ii;
+      }
+    } else if (sr.size() > 1){
+      const auto n = sr.size();
+      for (size_t i = 0; i < swp.bins.size(); ++i){
+        const auto r = swp.bins.slant_range[i];
+        const size_t hi = std::clamp<size_t>(std::upper_bound(sr.begin(), sr.end(), r) - sr.begin(), 1, n - 1);
+        if (r >= 1.5f * sr[0] - 0.5f * sr[1] && r < 1.5f * sr[n - 1] - 0.5f * sr[n - 2])
+          lut.bins[i] = std::fabs(r - sr[hi - 1]) < std::fabs(sr[hi] - r) ? hi - 1 : hi;
+      }
+    }
+  }
+  return luts;
+}
+
+auto reference_luts(volume const& current, volume const& lag) -> std::shared_ptr<vector<sweep_lut> const>{
+  // A handful of scan strategies is all a site ever runs.
+  constexpr size_t max_cached = 8;
+  static std::mutex mutex;
+  static std::map<string, std::shared_ptr<vector<sweep_lut> const>> cache;
+
+  const auto key = geometry_key(current) + '|' + geometry_key(lag);
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto i = cache.find(key);
+    if (i != cache.end()){
+      metrics::add(metrics::counter::lut_hits);
+      return i->second;
+    }
+  }
+  metrics::add(metrics::counter::lut_misses);
+
+  auto luts = std::make_shared<vector<sweep_lut> const>(build_luts(current, lag));
+
+  std::lock_guard<std::mutex> lock{mutex};
+  if (cache.size() >= max_cached)
+    cache.clear();
+  cache.emplace(key, luts);
+  return luts;
+}
+
+auto remap_reference(volume const& current, volume const& lag) -> vector<array2f>{
+  const auto luts = reference_luts(current, lag);
+
+  vector<array2f> reference;
+  for (size_t k = 0; k < current.sweeps.size(); ++k){
+    auto const& swp = current.sweeps[k];
+    auto const& lut = (*luts)[k];
+
+    array2f field;
+    if (lut.sweep >= 0){
+      field = array2f{vec2z{swp.bins.size(), swp.rays.size()}};
+      for (auto& val : field)
+        val = nodata;
+
+      auto const& ref = lag.sweeps[lut.sweep];
+      vector<float> buffer;
+      for (size_t j = 0; j < swp.rays.size(); ++j){
+        if (lut.rays[j] < 0)
+          continue;
+        auto row = sweep_row(ref, lut.rays[j], buffer);
+        for (size_t i = 0; i < swp.bins.size(); ++i)
+          if (lut.bins[i] >= 0)
+            field[j][i] = row[lut.bins[i]];
+      }
+    }
+    reference.push_back(std::move(field));
+  }
+  return reference;
+}
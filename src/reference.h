@@ -0,0 +1,33 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include "pch.h"
+#include "thread_pool.h"
+
+#include <memory>
+
+using namespace bom;
+
+// Where a gate of the current volume is found in the lag volume. The maps
+// are separable, so a gate (ray, bin) maps to (rays[ray], bins[bin]) of
+// the lag sweep, -1 meaning no match.
+struct sweep_lut{
+  int sweep;
+  vector<int> rays;
+  vector<int> bins;
+};
+
+// Dealiased velocity of a volume, rebuilt from its fold index when it has
+// no VRAD_DEALIAS.
+auto read_reference(std::filesystem::path const& filename, io::configuration const& config, thread_pool* pool = nullptr) -> volume;
+
+// LUTs are cached by the geometry of both volumes, which changes only with
+// the scan strategy.
+auto reference_luts(volume const& current, volume const& lag) -> std::shared_ptr<vector<sweep_lut> const>;
+
+// Previous dealiased velocity on the gates of the current volume, NaN
+// where the lag volume has no matching gate or no value. A sweep with no
+// lag sweep close enough in elevation is left empty.
+auto remap_reference(volume const& current, volume const& lag) -> vector<array2f>;
+
+#endif
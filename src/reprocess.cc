@@ -0,0 +1,203 @@
+#include "reprocess.h"
+#include "archive.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Checkpoint key of a volume.
+static auto item_key(reprocess_item const& item) -> string{
+  return item.archive.filename().string() + ':' + item.member;
+}
+
+auto build_manifest(reprocess_options const& opts) -> vector<reprocess_item>{
+  // Archives by site, in date order.
+  std::map<string, std::map<string, std::filesystem::path>> archives;
+  for (auto const& entry : std::filesystem::recursive_directory_iterator(opts.archives)){
+    auto name = entry.path().filename().string();
+    const string suffix = ".pvol.zip";
+    if (!entry.is_regular_file() || name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+      continue;
+    auto stem = name.substr(0, name.size() - suffix.size());
+    auto pos = stem.rfind('_');
+    if (pos == string::npos)
+      continue;
+    archives[stem.substr(0, pos)][stem.substr(pos + 1)] = entry.path();
+  }
+
+  vector<reprocess_item> manifest;
+  for (auto const& [site, days] : archives){
+    std::filesystem::path lag_archive;
+    string lag_member;
+    for (auto const& [day, path] : days){
+      vector<string> members;
+      const auto archive = zip_archive{path};
+      for (auto const& m : archive.members())
+        if (m.name.size() > 3 && m.name.compare(m.name.size() - 3, 3, ".h5") == 0)
+          members.push_back(m.name);
+      std::sort(members.begin(), members.end());
+
+      for (auto const& member : members){
+        reprocess_item item{site, day, path, member, lag_archive, lag_member, {}};
+        if (!opts.vad_dir.empty()){
+          auto stem = std::filesystem::path(member).filename().string();
+          stem = stem.substr(0, stem.find('.'));
+          auto vad = opts.vad_dir / (stem + ".dat");
+          if (std::filesystem::exists(vad))
+            item.vad = vad;
+        }
+        manifest.push_back(std::move(item));
+        lag_archive = path;
+        lag_member = member;
+      }
+    }
+  }
+  return manifest;
+}
+
+static auto read_checkpoint(std::filesystem::path const& path) -> std::set<string>{
+  std::set<string> done;
+  std::ifstream file(path);
+  string line;
+  while (std::getline(file, line))
+    if (!line.empty())
+      done.insert(line);
+  return done;
+}
+
+static auto count_lines(std::filesystem::path const& path) -> size_t{
+  std::ifstream file(path);
+  return std::count(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>(), '\n');
+}
+
+// Volumes of one shard of days, in order. Returns the number of failures.
+static auto run_shard(
+      reprocess_options const& opts
+    , vector<reprocess_item const*> const& items
+    , volume_processor const& process
+    ) -> size_t
+{
+  // Whole lines appended with O_APPEND, so the shards share the file.
+  const int checkpoint = open(opts.checkpoint.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (checkpoint < 0)
+    throw std::runtime_error("unable to open checkpoint " + opts.checkpoint.string());
+
+  size_t failures = 0;
+  std::filesystem::path previous;
+  for (auto item : items){
+    try{
+      auto dir = opts.output / item->site;
+      std::filesystem::create_directories(dir);
+      auto output = dir / std::filesystem::path(item->member).filename();
+
+      auto source = zip_archive{item->archive};
+      auto volume = source.extract(*source.find(item->member));
+
+      // The previous output holds VRAD_DEALIAS, the raw lag volume does not.
+      std::unique_ptr<memory_file> lag;
+      std::filesystem::path lag_path = volume->path();
+      auto lag_output = item->lag_member.empty() ? std::filesystem::path{} : dir / std::filesystem::path(item->lag_member).filename();
+      if (!item->lag_member.empty() && opts.chain && previous == lag_output)
+        lag_path = lag_output;
+      else if (!item->lag_member.empty()){
+        auto lag_source = zip_archive{item->lag_archive};
+        lag = lag_source.extract(*lag_source.find(item->lag_member));
+        lag_path = lag->path();
+      }
+
+      process(item->vad, lag_path, volume->path(), output, lag_output);
+      previous = output;
+
+      auto line = item_key(*item) + '\n';
+      if (write(checkpoint, line.data(), line.size()) != ssize_t(line.size()))
+        throw std::runtime_error("unable to write checkpoint " + opts.checkpoint.string());
+    }
+    catch (std::exception& err){
+      trace::error("reprocessing {} failed: {}", item_key(*item), err.what());
+      previous.clear();
+      ++failures;
+    }
+  }
+  close(checkpoint);
+  return failures;
+}
+
+auto reprocess(reprocess_options const& opts, volume_processor const& process) -> void{
+  std::filesystem::create_directories(opts.output);
+  const auto manifest = build_manifest(opts);
+  const auto done = read_checkpoint(opts.checkpoint);
+
+  {
+    std::ofstream file(opts.output / "manifest.txt");
+    for (auto const& item : manifest)
+      file << item.site << ' ' << item.day << ' ' << item_key(item) << ' ' << (item.vad.empty() ? "-" : item.vad.string()) << '\n';
+  }
+
+  // Pending volumes by day, each day going whole to one shard.
+  std::map<std::pair<string, string>, vector<reprocess_item const*>> days;
+  size_t pending = 0;
+  for (auto const& item : manifest){
+    if (done.count(item_key(item)))
+      continue;
+    days[{item.site, item.day}].push_back(&item);
+    ++pending;
+  }
+  std::cout << "reprocessing " << pending << " of " << manifest.size() << " volumes in " << days.size() << " days" << std::endl;
+  if (pending == 0)
+    return;
+
+  size_t workers = opts.workers ? opts.workers : std::max(1u, std::thread::hardware_concurrency());
+  workers = std::min(workers, days.size());
+  vector<vector<reprocess_item const*>> shards(workers);
+  size_t iday = 0;
+  for (auto const& [key, items] : days){
+    auto& shard = shards[iday++ % workers];
+    shard.insert(shard.end(), items.begin(), items.end());
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto initial = count_lines(opts.checkpoint);
+  auto report = [&]{
+    const auto finished = count_lines(opts.checkpoint) - initial;
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << finished << " of " << pending << " volumes, " << std::fixed << std::setprecision(2)
+              << finished / std::max(elapsed.count(), 1e-9) << " volumes/s" << std::endl;
+  };
+
+  // Even a single shard runs in a worker process, so the progress is
+  // reported as it goes.
+  vector<pid_t> children;
+  for (auto const& shard : shards){
+    std::cout.flush();
+    auto pid = fork();
+    if (pid < 0)
+      throw std::runtime_error("unable to fork reprocessing worker");
+    if (pid == 0){
+      // The cores are shared with the other workers.
+      set_default_threads(std::max<size_t>(1, std::thread::hardware_concurrency() / workers));
+      auto failures = run_shard(opts, shard, process);
+      std::cout.flush();
+      _exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    children.push_back(pid);
+  }
+
+  // Progress every ten seconds while the workers run.
+  size_t running = children.size(), failed = 0;
+  for (size_t tick = 1; running > 0; ++tick){
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    int status;
+    while (waitpid(-1, &status, WNOHANG) > 0){
+      --running;
+      failed += !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    }
+    if (tick % 10 == 0 || running == 0)
+      report();
+  }
+  if (failed)
+    trace::warning("{} of {} workers had failures, rerun to retry them", failed, children.size());
+}
@@ -0,0 +1,52 @@
+#ifndef REPROCESS_H
+#define REPROCESS_H
+
+#include "pch.h"
+
+#include <functional>
+
+using namespace bom;
+
+// Reprocessing of archived volumes: daily <site>_<date>.pvol.zip archives
+// found under a directory, with the VAD profiles <site>_<date>_<time>.dat
+// from an optional directory.
+struct reprocess_options{
+  std::filesystem::path archives;
+  std::filesystem::path vad_dir;    // empty: profiles retrieved from the volumes
+  std::filesystem::path output;     // dealiased volumes
+  std::filesystem::path checkpoint; // finished volumes, one per line
+  size_t workers = 0;               // 0 uses every core
+  bool chain = true;                // outputs hold the volume, usable as lag
+};
+
+// One volume of the manifest. The lag volume is the previous one of the
+// same site, possibly in the archive of the day before.
+struct reprocess_item{
+  string site;
+  string day;
+  std::filesystem::path archive;
+  string member;
+  std::filesystem::path lag_archive; // empty for the first volume of a site
+  string lag_member;
+  std::filesystem::path vad;         // empty when there is no profile
+};
+
+// The lag volume may be held in memory, so the output it was, or will be,
+// dealiased into is given apart, empty when there is no lag volume.
+using volume_processor = std::function<void(
+      std::filesystem::path const& vad
+    , std::filesystem::path const& lag1
+    , std::filesystem::path const& lag0
+    , std::filesystem::path const& output
+    , std::filesystem::path const& lag_output
+    )>;
+
+auto build_manifest(reprocess_options const& opts) -> vector<reprocess_item>;
+
+// Runs the manifest, skipping the volumes already in the checkpoint. The
+// days are sharded across worker processes, as HDF5 is not thread safe,
+// and the volumes of a day run in order so, when chain is set, each can use
+// the dealiased output of the previous one as its temporal reference.
+auto reprocess(reprocess_options const& opts, volume_processor const& process) -> void;
+
+#endif
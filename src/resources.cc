@@ -0,0 +1,25 @@
+#include "resources.h"
+
+#include <cstring>
+
+static auto status_bytes(const char* key) -> size_t{
+  std::ifstream status{"/proc/self/status"};
+  string line;
+  const auto len = strlen(key);
+  while (std::getline(status, line))
+    if (line.compare(0, len, key) == 0 && line.size() > len && line[len] == ':')
+      return std::stoull(line.substr(len + 1)) * 1024; // kB
+  return 0;
+}
+
+auto resident_bytes() -> size_t{
+  return status_bytes("VmRSS");
+}
+
+auto peak_resident_bytes() -> size_t{
+  return status_bytes("VmHWM");
+}
+
+auto reset_peak_resident() -> void{
+  std::ofstream{"/proc/self/clear_refs"} << "5";
+}
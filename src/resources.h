@@ -0,0 +1,17 @@
+#ifndef RESOURCES_H
+#define RESOURCES_H
+
+#include "pch.h"
+
+using namespace bom;
+
+// Resident memory of the process, from /proc/self/status. Zero where the
+// kernel does not report it.
+auto resident_bytes() -> size_t;
+auto peak_resident_bytes() -> size_t;
+
+// Starts a new peak from the current resident memory, so the peak of one
+// volume can be told apart from the ones before it.
+auto reset_peak_resident() -> void;
+
+#endif
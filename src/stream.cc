@@ -0,0 +1,152 @@
+#include "stream.h"
+#include "gate_bits.h"
+#include "geometry.h"
+#include "metrics.h"
+#include "publish.h"
+
+#include <cstring>
+#include <set>
+
+auto read_stream_options(string const& source, io::configuration const& config) -> stream_options{
+  stream_options opts;
+  opts.source = source;
+  opts.sweeps = config.optional("stream_sweeps", 0);
+  opts.timeout = config.optional("stream_timeout", opts.timeout);
+  return opts;
+}
+
+// Per-sweep files of a directory, polled as they are renamed into it.
+class directory_source : public sweep_source{
+public:
+  directory_source(std::filesystem::path dir, sweep_reader read)
+    : dir_{std::move(dir)}
+    , read_{std::move(read)}
+  {
+    if (!std::filesystem::is_directory(dir_))
+      throw std::invalid_argument("sweep directory " + dir_.string() + " does not exist");
+  }
+
+  auto next(streamed_sweep& out, double timeout) -> bool override{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+    while (true){
+      std::set<std::filesystem::path> arrived;
+      for (auto const& entry : std::filesystem::directory_iterator{dir_}){
+        auto const& path = entry.path();
+        const auto ext = path.extension();
+        if (entry.is_regular_file() && path.filename().string()[0] != '.' && (ext == ".h5" || ext == ".hdf" || ext == ".hdf5") && !taken_.count(path))
+          arrived.insert(path);
+      }
+      if (!arrived.empty()){
+        auto path = *arrived.begin();
+        taken_.insert(path);
+        metrics::timer time{metrics::stage::read};
+        out.dset = read_(path);
+        out.origin = sweep_origin{};
+        out.origin.file = path;
+        return true;
+      }
+      if (std::chrono::steady_clock::now() >= deadline)
+        return false;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+
+private:
+  std::filesystem::path dir_;
+  sweep_reader read_;
+  std::set<std::filesystem::path> taken_;
+};
+
+// Sweeps of a shared memory ring, copied out of their slot. Only sweeps
+// published after the source is opened are taken.
+class ring_source : public sweep_source{
+public:
+  explicit ring_source(string const& name)
+    : ring_{name}
+    , seen_{ring_.published()}
+  { }
+
+  auto next(streamed_sweep& out, double timeout) -> bool override{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+    while (true){
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      const auto published = ring_.wait(seen_, std::max<long>(left, 0));
+      if (published == seen_)
+        return false;
+
+      const auto n = seen_ + 1;
+      seen_ = n;
+      // With several publishers, a sweep below the published count may still
+      // be in progress.
+      sweep_subscriber::view view;
+      const auto stale = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+      bool opened;
+      while (!(opened = ring_.open(n, view)) && ring_.pending(n) && std::chrono::steady_clock::now() < stale)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      if (opened){
+        metrics::timer time{metrics::stage::read};
+        if (copy(view, out) && view.valid())
+          return true;
+      }
+      if (ring_.pending(n))
+        trace::warning("sweep {} of the shared memory ring was not completed by its publisher", n);
+      else
+        trace::warning("sweep {} of the shared memory ring was overwritten before it was read", n);
+    }
+  }
+
+private:
+  static auto copy(sweep_subscriber::view const& view, streamed_sweep& out) -> bool{
+    // The sizes come from a slot a publisher may be overwriting, so they are
+    // read once and checked before the data they size is read.
+    auto const& s = *view.slot;
+    const uint32_t nrays = s.rays, nbins = s.bins;
+    const uint64_t data_offset = s.data_offset;
+    if (!view.valid() || !view.fits(nrays, nbins, data_offset))
+      return false;
+
+    auto text = [](const char* str, size_t size){ return string(str, strnlen(str, size)); };
+    auto& dset = out.dset;
+    dset = radarset{};
+    dset.source = text(s.source, sizeof(s.source));
+    dset.date = text(s.date, sizeof(s.date));
+    dset.time = text(s.time, sizeof(s.time));
+    dset.vradh.location = latlonalt{s.lat * 1_deg, s.lon * 1_deg, s.height};
+    dset.nyquist = array1f{1};
+    dset.nyquist[0] = s.nyquist;
+    dset.elevation = array1f{1};
+    dset.elevation[0] = s.elevation;
+
+    sweep swp;
+    swp.beam = radar::beam_propagation{s.height, s.elevation * 1_deg};
+    vector<float> slant_range(nbins);
+    for (size_t i = 0; i < slant_range.size(); ++i)
+      slant_range[i] = s.range_start + i * s.range_scale;
+    vector<angle> azimuth(nrays);
+    for (size_t j = 0; j < azimuth.size(); ++j)
+      azimuth[j] = view.azimuth[j] * 1_deg;
+    set_geometry(swp, slant_range, azimuth);
+
+    swp.data = array2f{vec2z{nbins, nrays}};
+    const float missing = s.missing;
+    for (size_t i = 0; i < swp.data.size(); ++i){
+      const auto v = view.data[i];
+      swp.data.data()[i] = v == missing ? nodata : v;
+    }
+    build_gate_bits(swp, nodata);
+    dset.vradh.sweeps.push_back(std::move(swp));
+
+    out.origin = sweep_origin{{}, dset.source, dset.date, dset.time, dset.vradh.location
+      , s.elevation, s.range_start, s.range_scale, s.nyquist};
+    return true;
+  }
+
+  sweep_subscriber ring_;
+  uint64_t seen_;
+};
+
+auto open_sweep_source(stream_options const& opts, sweep_reader read) -> std::unique_ptr<sweep_source>{
+  if (opts.source.rfind("shm:", 0) == 0)
+    return std::make_unique<ring_source>(opts.source.substr(4));
+  return std::make_unique<directory_source>(opts.source, std::move(read));
+}
@@ -0,0 +1,43 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "pch.h"
+#include "writer.h"
+
+#include <functional>
+#include <memory>
+
+using namespace bom;
+
+// Sweeps taken one at a time as the radar writes them, either as per-sweep
+// ODIM files landing in a directory or from a shared memory ring (see
+// publish.h) fed by the ingest. Files are expected to be renamed into the
+// directory once complete, names starting with a dot are ignored, and they
+// are taken in name order.
+struct stream_options{
+  string source;          // directory, or shm:<ring name>
+  size_t sweeps = 0;      // sweeps of a volume, 0 to end it on the timeout
+  double timeout = 600.0; // s without a new sweep ending the volume
+};
+
+auto read_stream_options(string const& source, io::configuration const& config) -> stream_options;
+
+// A sweep as it arrived, a radarset holding it alone.
+struct streamed_sweep{
+  radarset     dset;
+  sweep_origin origin;
+};
+
+class sweep_source{
+public:
+  virtual ~sweep_source() = default;
+
+  // Waits up to timeout seconds for the next sweep, false when none came.
+  virtual auto next(streamed_sweep& out, double timeout) -> bool = 0;
+};
+
+using sweep_reader = std::function<radarset(std::filesystem::path const&)>;
+
+auto open_sweep_source(stream_options const& opts, sweep_reader read) -> std::unique_ptr<sweep_source>;
+
+#endif
@@ -0,0 +1,84 @@
+#include "thread_pool.h"
+
+static size_t process_threads = 0;
+
+auto default_threads() -> size_t{
+  return process_threads ? process_threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+auto set_default_threads(size_t threads) -> void{
+  process_threads = threads;
+}
+
+thread_pool::thread_pool(size_t threads){
+  if (threads == 0 || threads > default_threads())
+    threads = default_threads();
+
+  for (size_t i = 0; i < threads; ++i)
+    workers_.emplace_back([this, i] { run(i); });
+}
+
+thread_pool::~thread_pool(){
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_)
+    worker.join();
+}
+
+auto thread_pool::submit(task job) -> void{
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    tasks_.push(std::move(job));
+  }
+  cv_.notify_one();
+}
+
+auto thread_pool::run(size_t worker) -> void{
+  while (true){
+    task job;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty())
+        return;
+      job = std::move(tasks_.front());
+      tasks_.pop();
+    }
+    job(worker);
+  }
+}
+
+auto pool_or_local(thread_pool* pool, std::optional<thread_pool>& local, size_t threads) -> thread_pool&{
+  return pool ? *pool : local.emplace(threads);
+}
+
+auto parallel_for(thread_pool& pool, size_t count, std::function<void(size_t item, size_t worker)> const& fn) -> void{
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t remaining = count;
+  std::exception_ptr error;
+
+  for (size_t i = 0; i < count; ++i){
+    pool.submit([&, i](size_t worker){
+      try{
+        fn(i, worker);
+      }
+      catch (...){
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!error)
+          error = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock{mutex};
+      if (--remaining == 0)
+        done.notify_one();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock{mutex};
+  done.wait(lock, [&] { return remaining == 0; });
+  if (error)
+    std::rethrow_exception(error);
+}
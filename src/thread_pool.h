@@ -0,0 +1,52 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "pch.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <queue>
+
+using namespace bom;
+
+// Fixed set of worker threads fed from a queue. Every task is given the
+// index of the worker running it, so callers can keep per-thread state.
+// Asked for 0 threads, or for more than default_threads(), a pool takes
+// default_threads(), so the threads configured never oversubscribe the
+// share of the cores of a worker process.
+class thread_pool{
+public:
+  using task = std::function<void(size_t worker)>;
+
+  explicit thread_pool(size_t threads = 0);
+  ~thread_pool();
+
+  thread_pool(thread_pool const&) = delete;
+  auto operator=(thread_pool const&) -> thread_pool& = delete;
+
+  auto size() const -> size_t { return workers_.size(); }
+  auto submit(task job) -> void;
+
+private:
+  auto run(size_t worker) -> void;
+
+  vector<std::thread> workers_;
+  std::queue<task> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+};
+
+// Every core, unless lowered by worker processes that share the machine.
+auto default_threads() -> size_t;
+auto set_default_threads(size_t threads) -> void;
+
+// The pool of the caller, one per volume passed down to the stages, or
+// without one a pool of the given threads made in local.
+auto pool_or_local(thread_pool* pool, std::optional<thread_pool>& local, size_t threads) -> thread_pool&;
+
+auto parallel_for(thread_pool& pool, size_t count, std::function<void(size_t item, size_t worker)> const& fn) -> void;
+
+#endif
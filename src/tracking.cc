@@ -0,0 +1,252 @@
+#include "tracking.h"
+#include "corrections.h"
+#include "metadata.h"
+#include "cappi.h"
+#include "metrics.h"
+#include "thread_pool.h"
+#include "brox/brox_optic_flow.h"
+
+#include <atomic>
+
+auto read_flow_options(io::configuration const& config) -> flow_options{
+  const auto& block = config["optical_flow"];
+
+  flow_options opts;
+  opts.alpha = block["alpha"];
+  opts.gamma = block["gamma"];
+  opts.scales = block["scales"];
+  opts.zfactor = block["zfactor"];
+  opts.tol = block["tol"];
+  opts.initer = block["initer"];
+  opts.outiter = block["outiter"];
+  opts.warm_scales = block.optional("warm_scales", 1);
+  opts.warm_outiter = block.optional("warm_outiter", 3);
+  opts.sparse = block.optional("sparse", false);
+
+  string solver = block.optional("solver", "sor");
+  if (solver == "sor")
+    opts.solver = BROX_SOR;
+  else if (solver == "multigrid")
+    opts.solver = BROX_MULTIGRID;
+  else if (solver == "pcg")
+    opts.solver = BROX_PCG;
+  else
+    throw std::invalid_argument("Invalid values for parameter in configuration file ('optical_flow.solver')");
+  return opts;
+}
+
+auto grid_latlons(io::configuration const& config) -> array2<latlon>{
+  auto proj = map_projection{map_projection::default_context, config["proj4"].string()};
+
+  size_t nx, ny;
+  double left, top, dx, dy;
+  std::istringstream{config["size"].string()} >> nx >> ny;
+  std::istringstream{config["left_top"].string()} >> left >> top;
+  std::istringstream{config["cell_delta"].string()} >> dx >> dy;
+
+  // Cell centres, left_top is the outer corner of the grid.
+  auto latlons = array2<latlon>{vec2z{nx, ny}};
+  for (size_t y = 0; y < ny; ++y)
+    for (size_t x = 0; x < nx; ++x)
+      latlons[y][x] = proj.inverse(vec2d{left + (x + 0.5) * dx, top + (y + 0.5) * dy});
+
+  return latlons;
+}
+
+auto prepare_cappi(array2f& cappi, float min_dbz, int min_neighbours, int iterations) -> void{
+  for (auto& val : cappi)
+    if (std::isnan(val) || val < min_dbz)
+      val = min_dbz;
+
+  for (int i = 0; i < iterations; ++i)
+    speckle_filter(cappi, min_dbz, min_neighbours);
+}
+
+auto echo_mask(array2f const& cappi1, array2f const& cappi0, float min_dbz, vector<unsigned char>& mask) -> size_t{
+  mask.resize(cappi1.size());
+
+  size_t count = 0;
+  for (size_t i = 0; i < mask.size(); ++i){
+    mask[i] = cappi1.data()[i] > min_dbz || cappi0.data()[i] > min_dbz;
+    count += mask[i];
+  }
+  return count;
+}
+
+// A cached frame keeps the prepared CAPPI for the echo mask of the sparse mode.
+struct frame_cache::entry{
+  array2f cappi;
+  brox_frame frame;
+};
+
+frame_cache::frame_cache(size_t volumes)
+  : volumes_{std::max<size_t>(volumes, 1)}
+{ }
+
+auto frame_cache::find(string const& volume, size_t layer) const -> std::shared_ptr<entry const>{
+  std::lock_guard<std::mutex> lock{mutex_};
+  auto i = frames_.find({volume, layer});
+  return i != frames_.end() ? i->second : nullptr;
+}
+
+auto frame_cache::insert(string const& volume, size_t layer, std::shared_ptr<entry const> frame) -> void{
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (std::find(order_.begin(), order_.end(), volume) == order_.end()){
+    order_.push_back(volume);
+
+    // Drop the frames of the oldest volume once the cache is full.
+    while (order_.size() > volumes_){
+      for (auto i = frames_.begin(); i != frames_.end();)
+        i = i->first.first == order_.front() ? frames_.erase(i) : std::next(i);
+      order_.pop_front();
+    }
+  }
+  frames_[{volume, layer}] = std::move(frame);
+}
+
+auto track_layers(
+      io::configuration const& config
+    , radarset const& lag1
+    , radarset const& lag0
+    , flow_stack const* prior
+    , frame_cache* cache
+    , thread_pool* pool
+    ) -> flow_stack
+{
+  const auto opts = read_flow_options(config);
+  const auto latlons = grid_latlons(config);
+  const auto max_alt_dist = float(config["max_alt_dist"]);
+  const auto idw_pwr = float(config["idw_pwr"]);
+  const auto min_dbz = float(config["min_dbz"]);
+  const int min_neighbours = config.optional("speckle_min_neighbours", 3);
+  const int speckle_iterations = config.optional("speckle_iterations", 3);
+  const auto nx = latlons.extents().x;
+  const auto ny = latlons.extents().y;
+  const auto npix = nx * ny;
+
+  flow_stack stack;
+  stack.altitude = init_altitudes(config);
+  stack.extents = latlons.extents();
+  const auto nlayers = stack.altitude.size();
+  stack.u.resize(nlayers * npix);
+  stack.v.resize(nlayers * npix);
+
+  // A prior from a different grid or layer stack can't seed this one.
+  if (prior && (prior->altitude.size() != nlayers || prior->extents.x != nx || prior->extents.y != ny)){
+    trace::warning("prior flow does not match the tracking grid, ignoring it");
+    prior = nullptr;
+  }
+
+  std::optional<thread_pool> local;
+  auto& workers = pool_or_local(pool, local, size_t(config.optional("threads", 0)));
+  vector<brox_workspace> workspaces(workers.size());
+  vector<brox_stats> stats(nlayers);
+  vector<size_t> echo(nlayers, 0);
+  vector<char> warm_started(nlayers, 0);
+  const brox_warm_start warm{opts.warm_scales, opts.warm_outiter};
+  std::atomic<int> cached{0};
+
+  // Pyramid of one layer of a volume down to the given number of scales,
+  // from the cache when it holds one as deep.
+  auto frame = [&](radarset const& dset, size_t i, int scales) -> std::shared_ptr<frame_cache::entry const>{
+    // A volume read with and without the sea clutter removed gives two
+    // different frames, so both volumes of a pair are read alike (see
+    // read_volume) for the frames of lag0 to serve as lag1 of the next pair.
+    const auto key = dset.source + '/' + dset.date + dset.time + (dset.clutter_corrected ? "/clean" : "");
+    if (cache){
+      if (auto f = cache->find(key, i); f && f->frame.scales_requested >= scales){
+        metrics::add(metrics::counter::cappi_hits);
+        ++cached;
+        return f;
+      }
+      metrics::add(metrics::counter::cappi_misses);
+    }
+
+    auto f = std::make_shared<frame_cache::entry>();
+    f->cappi = generate_cappi(dset.dbzh, latlons, max_alt_dist, idw_pwr, stack.altitude[i], 2500.f, lag0.beamwidth);
+    prepare_cappi(f->cappi, min_dbz, min_neighbours, speckle_iterations);
+    build_frame(f->cappi.data(), nx, ny, scales, opts.zfactor, f->frame);
+
+    if (cache)
+      cache->insert(key, i, f);
+    return f;
+  };
+
+  // Track one layer into its slot of the stack, optionally seeded.
+  auto track = [&](size_t i, size_t worker, const float* seed_u, const float* seed_v){
+    // A warm start only runs the finest scales, the coarser ones aren't built.
+    const auto scales = seed_u ? std::min(opts.scales, std::max(opts.warm_scales, 1)) : opts.scales;
+    auto frame1 = frame(lag1, i, scales);
+    auto frame0 = frame(lag0, i, scales);
+
+    // The sparse mode only solves around the pixels with echo.
+    vector<unsigned char> mask;
+    if (opts.sparse)
+      echo[i] = echo_mask(frame1->cappi, frame0->cappi, min_dbz, mask);
+
+    auto u = stack.u.data() + i * npix;
+    auto v = stack.v.data() + i * npix;
+    if (seed_u){
+      std::copy(seed_u, seed_u + npix, u);
+      std::copy(seed_v, seed_v + npix, v);
+      warm_started[i] = 1;
+    }
+
+    brox_optic_flow(
+          frame1->frame, frame0->frame, u, v
+        , opts.alpha, opts.gamma, opts.tol, opts.initer, opts.outiter
+        , false, seed_u ? &warm : nullptr, &stats[i], opts.sparse ? mask.data() : nullptr
+        , &workspaces[worker], opts.solver);
+  };
+
+  auto start = std::chrono::high_resolution_clock::now();
+  if (prior){
+    // Every layer is seeded from the previous time step.
+    parallel_for(workers, nlayers, [&](size_t i, size_t worker){
+      track(i, worker, prior->u.data() + i * npix, prior->v.data() + i * npix);
+    });
+  } else {
+    // Even layers start cold, then odd layers are seeded from the layer below.
+    parallel_for(workers, (nlayers + 1) / 2, [&](size_t i, size_t worker){
+      track(2 * i, worker, nullptr, nullptr);
+    });
+    parallel_for(workers, nlayers / 2, [&](size_t i, size_t worker){
+      auto below = 2 * i * npix;
+      track(2 * i + 1, worker, stack.u.data() + below, stack.v.data() + below);
+    });
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> duration = end - start;
+
+  int warm_layers = 0, outer_iter = 0, early_exits = 0, linear_solves = 0, linear_iter = 0, linear_capped = 0;
+  float linear_residual = 0.f;
+  size_t echo_pixels = 0;
+  for (size_t i = 0; i < nlayers; ++i){
+    trace::debug("layer {}: {} scales, {} outer iterations, {} linear iterations in {} solves, {} capped, largest residual {}"
+      , i, stats[i].scales, stats[i].outer_iter, stats[i].linear_iter, stats[i].linear_solves, stats[i].linear_capped, stats[i].linear_residual);
+    warm_layers += warm_started[i];
+    outer_iter += stats[i].outer_iter;
+    early_exits += stats[i].early_exits;
+    linear_solves += stats[i].linear_solves;
+    linear_iter += stats[i].linear_iter;
+    linear_capped += stats[i].linear_capped;
+    linear_residual = std::max(linear_residual, stats[i].linear_residual);
+    echo_pixels += echo[i];
+  }
+  metrics::add(metrics::counter::linear_solves, linear_solves);
+  metrics::add(metrics::counter::linear_iterations, linear_iter);
+  metrics::add(metrics::counter::linear_capped, linear_capped);
+
+  std::cout << "Tracked " << nlayers << " layers on " << workers.size() << " threads (" << warm_layers << " warm started, "
+            << outer_iter << " outer iterations, " << early_exits << " early exits) in "
+            << duration.count() << " seconds" << std::endl;
+  std::cout << "Linear solver: " << linear_iter << " iterations in " << linear_solves << " solves ("
+            << (linear_solves ? double(linear_iter) / linear_solves : 0.0) << " per solve), " << linear_capped
+            << " left above tol, largest residual " << linear_residual << std::endl;
+  if (cache)
+    std::cout << "Reused " << cached << " of " << 2 * nlayers << " layer pyramids from the frame cache" << std::endl;
+  if (opts.sparse)
+    std::cout << "Echo coverage: " << 100.0 * echo_pixels / (nlayers * npix) << "%" << std::endl;
+
+  return stack;
+}
@@ -0,0 +1,61 @@
+#ifndef TRACKING_H
+#define TRACKING_H
+
+#include "pch.h"
+#include "thread_pool.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace bom;
+
+struct flow_options{
+  float alpha;
+  float gamma;
+  int scales;
+  float zfactor;
+  float tol;
+  int initer;
+  int outiter;
+  int warm_scales;
+  int warm_outiter;
+  bool sparse;
+  int solver; // linear solver of the inner iterations, see brox_optic_flow.h
+};
+
+auto read_flow_options(io::configuration const& config) -> flow_options;
+auto grid_latlons(io::configuration const& config) -> array2<latlon>;
+auto prepare_cappi(array2f& cappi, float min_dbz, int min_neighbours, int iterations) -> void;
+auto echo_mask(array2f const& cappi1, array2f const& cappi0, float min_dbz, vector<unsigned char>& mask) -> size_t;
+// Pyramids of the CAPPI layers of recent volumes, keyed by volume (site,
+// date and time) and layer. Tracking a series compares (t-1, t) then
+// (t, t+1), so frame t is built once and reused as the first image of the
+// next pair. Meant to outlive one volume, as in the daemon workers.
+class frame_cache{
+public:
+  struct entry;
+
+  explicit frame_cache(size_t volumes = 2);
+
+  auto find(string const& volume, size_t layer) const -> std::shared_ptr<entry const>;
+  auto insert(string const& volume, size_t layer, std::shared_ptr<entry const> frame) -> void;
+
+private:
+  size_t volumes_;
+  mutable std::mutex mutex_;
+  std::map<std::pair<string, size_t>, std::shared_ptr<entry const>> frames_;
+  std::deque<string> order_; // volumes, oldest first
+};
+
+auto track_layers(
+      io::configuration const& config
+    , radarset const& lag1
+    , radarset const& lag0
+    , flow_stack const* prior = nullptr
+    , frame_cache* cache = nullptr
+    , thread_pool* pool = nullptr
+    ) -> flow_stack;
+
+#endif
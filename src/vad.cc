@@ -0,0 +1,440 @@
+#include "vad.h"
+#include "gate_bits.h"
+#include "thread_pool.h"
+
+#include <array>
+
+// Geometry of one sweep, shared read-only by the layer fits.
+struct vad_sweep{
+  float nyquist;
+  double cel, sel;
+  vector<double> saz, caz, s2az, c2az; // per ray
+  vector<float> range, altitude;       // per bin, range in km
+};
+
+// Model of the radial velocity along one ray: v = p + q * r, r in km.
+struct vad_ray_model{
+  double p, q;
+};
+
+auto read_vad_options(io::configuration const& config) -> vad_options{
+  // Defaults match the profiles of the external VAD program.
+  vad_options opts{21, 500.f, 1000.f, 100000.f, 7590.f, 100, 2};
+
+  if (auto block = config.find("vad")){
+    opts.layers = block->optional("layers", opts.layers);
+    opts.dz = block->optional("dz", opts.dz);
+    opts.rmin = block->optional("rmin", opts.rmin);
+    opts.rmax = block->optional("rmax", opts.rmax);
+    opts.scale_height = block->optional("scale_height", opts.scale_height);
+    opts.min_gates = block->optional("min_gates", opts.min_gates);
+    opts.iterations = block->optional("iterations", opts.iterations);
+  }
+  return opts;
+}
+
+auto vad_geometry(radarset const& dset) -> vector<vad_sweep>{
+  vector<vad_sweep> geom(dset.vradh.sweeps.size());
+
+  for (size_t k = 0; k < geom.size(); ++k){
+    auto const& swp = dset.vradh.sweeps[k];
+    auto& g = geom[k];
+
+    g.nyquist = k < dset.nyquist.size() ? dset.nyquist[k] : nodata;
+    g.cel = swp.cos_el;
+    g.sel = swp.sin_el;
+
+    for (size_t j = 0; j < swp.rays.size(); ++j){
+      const double s = swp.rays.sin_az[j], c = swp.rays.cos_az[j];
+      g.saz.push_back(s);
+      g.caz.push_back(c);
+      g.s2az.push_back(2 * s * c);
+      g.c2az.push_back(c * c - s * s);
+    }
+    for (size_t i = 0; i < swp.bins.size(); ++i)
+      g.range.push_back(swp.bins.ground_range[i] * 0.001f);
+    g.altitude = swp.bins.altitude;
+  }
+  return geom;
+}
+
+// Gates of a sweep inside a layer, as a weight per bin and the span of bins
+// holding them, so the accumulation runs over contiguous memory.
+auto layer_bins(vad_sweep const& g, vad_options const& opts, float z, vector<float>& weight) -> std::pair<size_t, size_t>{
+  const auto nbins = g.range.size();
+  weight.assign(nbins, 0.f);
+
+  size_t first = nbins, last = 0;
+  for (size_t i = 0; i < nbins; ++i){
+    const auto r = g.range[i] * 1000.f;
+    if (std::fabs(g.altitude[i] - z) < 0.5f * opts.dz && r >= opts.rmin && r <= opts.rmax){
+      weight[i] = 1.f;
+      first = std::min(first, i);
+      last = i + 1;
+    }
+  }
+  return {first, std::max(first, last)};
+}
+
+// First guess of the ray models of a sweep from the folded data alone. The
+// circular mean of each ray is unwrapped along azimuth, then the whole ring
+// is shifted by a multiple of 2 * nyquist towards a zero mean, as the mean
+// of a VAD ring only holds the small divergence and fall speed terms.
+auto ring_models(vad_sweep const& g, sweep const& swp, vector<float> const& weight, size_t first, size_t last) -> vector<vad_ray_model>{
+  const auto nrays = g.saz.size();
+  const auto vn = g.nyquist;
+  const auto interval = 2.0 * vn;
+
+  vector<vad_ray_model> models(nrays, vad_ray_model{nodata, 0.0});
+
+  vector<double> mean(nrays, nodata);
+  vector<float> buffer;
+  for (size_t j = 0; j < nrays; ++j){
+    const auto row = sweep_row(swp, j, buffer);
+    const auto valid = valid_row(swp, j);
+    double sum_cos = 0.0, sum_sin = 0.0;
+    int count = 0;
+    for (size_t i = first; i < last; ++i){
+      const auto v = row[i];
+      if (weight[i] > 0.f && ((valid[i / 64] >> (i % 64)) & 1)){
+        sum_cos += std::cos(M_PI * v / vn);
+        sum_sin += std::sin(M_PI * v / vn);
+        ++count;
+      }
+    }
+    if (count > 0)
+      mean[j] = vn / M_PI * std::atan2(sum_sin, sum_cos);
+  }
+
+  double prev = nodata, sum = 0.0;
+  int count = 0;
+  for (size_t j = 0; j < nrays; ++j){
+    if (std::isnan(mean[j]))
+      continue;
+    if (!std::isnan(prev))
+      mean[j] -= interval * std::round((mean[j] - prev) / interval);
+    prev = mean[j];
+    sum += mean[j];
+    ++count;
+  }
+  if (count == 0)
+    return models;
+
+  const auto shift = interval * std::round(sum / count / interval);
+  for (size_t j = 0; j < nrays; ++j)
+    models[j].p = mean[j] - shift;
+  return models;
+}
+
+// Normal equations of the fit of one layer. The unknowns are u0, v0, the
+// vertical velocity c (w0 - vt), div, det and des, for the model
+//   v = (u0 sin(az) + v0 cos(az)) cel + c sel
+//     + 0.5 r cel (div - det cos(2 az) + des sin(2 az))
+// Along a ray the first three basis terms are constant and the others are
+// proportional to r, so the normal equations only need five sums per ray.
+struct vad_normal{
+  static constexpr int n = 6;
+  double N[n][n] = {};
+  double b[n] = {};
+  int npts = 0;
+};
+
+// Adds the gates of one sweep to the normal equations of a layer. They are
+// unfolded against the ring models of the sweep on the first pass (x null)
+// and against the fitted model x on the refits.
+auto accumulate_layer(
+      vad_sweep const& g
+    , sweep const& swp
+    , vad_options const& opts
+    , float z
+    , std::array<double, 6> const* x
+    , vad_normal& eq
+    ) -> void
+{
+  constexpr int n = vad_normal::n;
+
+  vector<float> w;
+  const auto [first, last] = layer_bins(g, opts, z, w);
+  if (first >= last)
+    return;
+
+  // Sweeps without a Nyquist velocity are used as they are.
+  const float interval = g.nyquist > 0.f ? 2.f * g.nyquist : 0.f;
+
+  vector<vad_ray_model> models;
+  if (interval > 0.f && !x)
+    models = ring_models(g, swp, w, first, last);
+
+  vector<float> buffer;
+  for (size_t j = 0; j < g.saz.size(); ++j){
+    auto model = vad_ray_model{0.0, 0.0};
+    if (interval > 0.f && x){
+      model.p = ((*x)[0] * g.saz[j] + (*x)[1] * g.caz[j]) * g.cel + (*x)[2] * g.sel;
+      model.q = 500.0 * g.cel * ((*x)[3] - (*x)[4] * g.c2az[j] + (*x)[5] * g.s2az[j]);
+    } else if (interval > 0.f)
+      model = models[j];
+    if (std::isnan(model.p))
+      continue;
+
+    const auto p = float(model.p), q = float(model.q);
+    const auto row = sweep_row(swp, j, buffer);
+    const auto valid = valid_row(swp, j);
+
+    // Branch free so the loop over the bins vectorises.
+    float s0 = 0.f, s1 = 0.f, s2 = 0.f, t0 = 0.f, t1 = 0.f;
+    for (size_t i = first; i < last; ++i){
+      const float v = row[i];
+      const float r = g.range[i];
+      const bool ok = w[i] > 0.f && ((valid[i / 64] >> (i % 64)) & 1);
+      const float fold = interval > 0.f ? interval * std::floor((p + q * r - v) / interval + 0.5f) : 0.f;
+      const float vu = ok ? v + fold : 0.f;
+      const float wi = ok ? 1.f : 0.f;
+      s0 += wi;
+      s1 += wi * r;
+      s2 += wi * r * r;
+      t0 += vu;
+      t1 += vu * r;
+    }
+    if (s0 == 0.f)
+      continue;
+    eq.npts += int(s0);
+
+    const double a[n] = {g.saz[j] * g.cel, g.caz[j] * g.cel, g.sel, 0.0, 0.0, 0.0};
+    const double c[n] = {0.0, 0.0, 0.0, 500.0 * g.cel, -500.0 * g.cel * g.c2az[j], 500.0 * g.cel * g.s2az[j]};
+    for (int r = 0; r < n; ++r){
+      for (int s = 0; s < n; ++s)
+        eq.N[r][s] += s0 * a[r] * a[s] + s1 * (a[r] * c[s] + c[r] * a[s]) + s2 * c[r] * c[s];
+      eq.b[r] += t0 * a[r] + t1 * c[r];
+    }
+  }
+}
+
+// Cholesky factorisation, N = L L^T stored in the lower triangle, then the
+// two triangular solves. False when N is not positive definite.
+auto solve_layer(vad_normal eq, std::array<double, 6>& x) -> bool{
+  constexpr int n = vad_normal::n;
+  auto& N = eq.N;
+
+  for (int r = 0; r < n; ++r){
+    for (int s = 0; s <= r; ++s){
+      auto sum = N[r][s];
+      for (int t = 0; t < s; ++t)
+        sum -= N[r][t] * N[s][t];
+      if (r == s){
+        if (sum <= 0.0)
+          return false;
+        N[r][r] = std::sqrt(sum);
+      } else
+        N[r][s] = sum / N[s][s];
+    }
+  }
+  for (int r = 0; r < n; ++r){
+    auto sum = eq.b[r];
+    for (int t = 0; t < r; ++t)
+      sum -= N[r][t] * x[t];
+    x[r] = sum / N[r][r];
+  }
+  for (int r = n - 1; r >= 0; --r){
+    auto sum = x[r];
+    for (int t = r + 1; t < n; ++t)
+      sum -= N[t][r] * x[t];
+    x[r] = sum / N[r][r];
+  }
+  return true;
+}
+
+// Least squares fit of one layer, refitted against the unfolded velocities.
+auto fit_layer(
+      radarset const& dset
+    , vector<vad_sweep> const& geom
+    , vad_options const& opts
+    , float z
+    , std::array<double, 6>& x
+    ) -> int
+{
+  int npts = 0;
+  for (int iter = 0; iter <= opts.iterations; ++iter){
+    vad_normal eq;
+    for (size_t k = 0; k < geom.size(); ++k)
+      accumulate_layer(geom[k], dset.vradh.sweeps[k], opts, z, iter > 0 ? &x : nullptr, eq);
+    npts = eq.npts;
+    if (npts < opts.min_gates)
+      return npts;
+    if (!solve_layer(eq, x))
+      return 0;
+  }
+  return npts;
+}
+
+// Vertical velocity and fall speed of the fitted layers, from anelastic
+// continuity, d(rho w)/dz = -rho div with rho = exp(-z / Hs), integrated
+// upwards from w = 0 at the lowest layer. The fall speed is what is left of
+// the fitted vertical velocity.
+auto integrate_profile(vadset& data, vector<float> const& vertical, vad_options const& opts) -> void{
+  double rho_w = 0.0;
+  for (size_t l = 0; l < data.z.size(); ++l){
+    const auto rho = std::exp(-data.z[l] / opts.scale_height);
+    if (l > 0){
+      const auto rho_prev = std::exp(-data.z[l - 1] / opts.scale_height);
+      rho_w -= 0.5 * (rho * data.div[l] + rho_prev * data.div[l - 1]) * opts.dz;
+    }
+    data.w0[l] = rho_w / rho;
+    data.vt[l] = data.w0[l] - vertical[l];
+  }
+}
+
+auto empty_profile(size_t nz) -> vadset{
+  vadset data;
+  data.z.resize(nz);
+  data.npts.resize(nz);
+  data.u0.assign(nz, nodata);
+  data.v0.assign(nz, nodata);
+  data.w0.assign(nz, nodata);
+  data.vt.assign(nz, nodata);
+  data.div.assign(nz, nodata);
+  data.det.assign(nz, nodata);
+  data.des.assign(nz, nodata);
+  return data;
+}
+
+auto set_layer(vadset& data, vector<float>& vertical, size_t l, std::array<double, 6> const& x) -> void{
+  data.u0[l] = x[0];
+  data.v0[l] = x[1];
+  vertical[l] = x[2];
+  data.div[l] = x[3];
+  data.det[l] = x[4];
+  data.des[l] = x[5];
+}
+
+auto retrieve_vad(io::configuration const& config, radarset const& dset, thread_pool* pool) -> vadset{
+  const auto opts = read_vad_options(config);
+  const auto geom = vad_geometry(dset);
+  const auto nz = size_t(std::max(opts.layers, 0));
+
+  auto data = empty_profile(nz);
+  vector<float> vertical(nz, nodata);
+
+  std::optional<thread_pool> local;
+  auto& workers = pool_or_local(pool, local, size_t(config.optional("threads", 0)));
+  parallel_for(workers, nz, [&](size_t l, size_t){
+    data.z[l] = l * opts.dz;
+
+    std::array<double, 6> x;
+    data.npts[l] = fit_layer(dset, geom, opts, data.z[l], x);
+    if (data.npts[l] >= opts.min_gates)
+      set_layer(data, vertical, l, x);
+  });
+  integrate_profile(data, vertical, opts);
+
+  int valid = 0;
+  for (size_t l = 0; l < nz; ++l)
+    valid += !std::isnan(data.u0[l]);
+  std::cout << "VAD retrieved " << valid << " of " << nz << " layers on " << workers.size() << " threads" << std::endl;
+
+  return data;
+}
+
+auto retrieve_vad(io::configuration const& config, size_t sweeps, sweep_loader const& load, thread_pool* pool) -> vadset{
+  const auto opts = read_vad_options(config);
+  const auto nz = size_t(std::max(opts.layers, 0));
+
+  auto data = empty_profile(nz);
+  vector<float> vertical(nz, nodata);
+  vector<std::array<double, 6>> x(nz);
+  vector<char> active(nz, 1);
+  for (size_t l = 0; l < nz; ++l)
+    data.z[l] = l * opts.dz;
+
+  // Every pass visits the sweeps once, each layer then solved on its own.
+  std::optional<thread_pool> local;
+  auto& workers = pool_or_local(pool, local, size_t(config.optional("threads", 0)));
+  for (int iter = 0; iter <= opts.iterations; ++iter){
+    vector<vad_normal> eqs(nz);
+    for (size_t k = 0; k < sweeps; ++k){
+      const auto one = load(k);
+      if (one.vradh.sweeps.empty())
+        continue;
+      const auto geom = vad_geometry(one);
+      parallel_for(workers, nz, [&](size_t l, size_t){
+        if (active[l])
+          accumulate_layer(geom[0], one.vradh.sweeps[0], opts, data.z[l], iter > 0 ? &x[l] : nullptr, eqs[l]);
+      });
+    }
+    for (size_t l = 0; l < nz; ++l){
+      if (!active[l])
+        continue;
+      data.npts[l] = eqs[l].npts;
+      if (data.npts[l] < opts.min_gates)
+        active[l] = 0;
+      else if (!solve_layer(eqs[l], x[l])){
+        data.npts[l] = 0;
+        active[l] = 0;
+      }
+    }
+  }
+  for (size_t l = 0; l < nz; ++l)
+    if (active[l])
+      set_layer(data, vertical, l, x[l]);
+  integrate_profile(data, vertical, opts);
+
+  int valid = 0;
+  for (size_t l = 0; l < nz; ++l)
+    valid += !std::isnan(data.u0[l]);
+  std::cout << "VAD retrieved " << valid << " of " << nz << " layers from " << sweeps << " sweeps read one at a time" << std::endl;
+
+  return data;
+}
+
+incremental_vad::incremental_vad(io::configuration const& config)
+  : opts_{read_vad_options(config)}
+  , pool_{std::make_unique<thread_pool>(size_t(config.optional("threads", 0)))}
+  , eqs_(size_t(std::max(opts_.layers, 0)))
+  , x_(eqs_.size())
+  , fitted_(eqs_.size(), 0)
+{ }
+
+incremental_vad::~incremental_vad() = default;
+
+auto incremental_vad::add(radarset const& dset) -> vadset{
+  const auto geom = vad_geometry(dset);
+  const auto nz = eqs_.size();
+
+  auto data = empty_profile(nz);
+  vector<float> vertical(nz, nodata);
+  for (size_t l = 0; l < nz; ++l)
+    data.z[l] = l * opts_.dz;
+
+  // The new sweeps are unfolded against the profile so far, or their ring
+  // models while a layer is not fitted yet, then refitted on their own.
+  parallel_for(*pool_, nz, [&](size_t l, size_t){
+    auto x = x_[l];
+    bool fitted = fitted_[l];
+    bool solved = false;
+    vad_normal eq;
+    for (int iter = 0; iter <= opts_.iterations; ++iter){
+      eq = eqs_[l];
+      for (size_t k = 0; k < geom.size(); ++k)
+        accumulate_layer(geom[k], dset.vradh.sweeps[k], opts_, data.z[l], fitted ? &x : nullptr, eq);
+      solved = eq.npts >= opts_.min_gates && solve_layer(eq, x);
+      if (!solved)
+        break;
+      fitted = true;
+    }
+    eqs_[l] = eq;
+    data.npts[l] = eq.npts >= opts_.min_gates && !solved ? 0 : eq.npts;
+    if (solved){
+      x_[l] = x;
+      fitted_[l] = 1;
+      set_layer(data, vertical, l, x);
+    }
+  });
+  integrate_profile(data, vertical, opts_);
+  sweeps_ += geom.size();
+
+  int valid = 0;
+  for (size_t l = 0; l < nz; ++l)
+    valid += !std::isnan(data.u0[l]);
+  std::cout << "VAD retrieved " << valid << " of " << nz << " layers from " << sweeps_ << " sweeps so far" << std::endl;
+
+  return data;
+}
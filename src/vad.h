@@ -0,0 +1,62 @@
+#ifndef VAD_H
+#define VAD_H
+
+#include "pch.h"
+#include "thread_pool.h"
+
+#include <array>
+#include <functional>
+
+using namespace bom;
+
+class thread_pool;
+struct vad_normal;
+
+struct vad_options{
+  int layers;         // number of height layers
+  float dz;           // layer spacing (m), layer l is centred on l * dz
+  float rmin;         // gates closer than this ground range are ignored (m)
+  float rmax;         // gates further than this ground range are ignored (m)
+  float scale_height; // density scale height used to integrate w0 (m)
+  int min_gates;      // layers with fewer valid gates are left missing
+  int iterations;     // refits against the unfolded velocities
+};
+
+auto read_vad_options(io::configuration const& config) -> vad_options;
+
+// Fit the VAD profile of a volume by least squares over its velocity gates,
+// as an in-process replacement for the profile read by read_vad.
+auto retrieve_vad(io::configuration const& config, radarset const& dset, thread_pool* pool = nullptr) -> vadset;
+
+// The same fit over sweeps loaded one at a time, as a radarset holding the
+// sweep k alone, so the volume never has to be held in memory. Every refit
+// loads the sweeps again.
+using sweep_loader = std::function<radarset(size_t k)>;
+auto retrieve_vad(io::configuration const& config, size_t sweeps, sweep_loader const& load, thread_pool* pool = nullptr) -> vadset;
+
+// The same fit over sweeps arriving one at a time, as they are streamed.
+// The normal equations of every layer are kept across sweeps, so a new
+// sweep is added once and the layers solved again without holding the
+// sweeps before it. The refits only unfold the new sweep again, the ones
+// before it staying unfolded against the profile of their time.
+class incremental_vad{
+public:
+  explicit incremental_vad(io::configuration const& config);
+  ~incremental_vad();
+
+  incremental_vad(incremental_vad const&) = delete;
+  auto operator=(incremental_vad const&) -> incremental_vad& = delete;
+
+  // Adds the sweeps of dset and returns the profile fitted so far.
+  auto add(radarset const& dset) -> vadset;
+
+private:
+  vad_options opts_;
+  std::unique_ptr<thread_pool> pool_;
+  vector<vad_normal> eqs_;
+  vector<std::array<double, 6>> x_;
+  vector<char> fitted_;
+  size_t sweeps_ = 0;
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include "writer.h"
+#include "fold.h"
+#include "metrics.h"
+
+#include <memory>
+
+// Metadata of a volume and its scans copied to a moment only output.
+struct metadata_keys{
+  vector<const char*> strings, reals, integers;
+};
+static const metadata_keys root_keys{
+    {"object", "version", "date", "time", "source"}
+  , {"lat", "lon", "height", "beamwH", "beamwV"}
+  , {}
+  };
+static const metadata_keys scan_keys{
+    {"product", "startdate", "starttime", "enddate", "endtime"}
+  , {"elangle", "rscale", "rstart", "NI"}
+  , {"nbins", "nrays", "a1gate"}
+  };
+
+static auto copy_metadata(io::odim::attribute_store& from, io::odim::attribute_store& to, metadata_keys const& keys) -> void{
+  for (auto key : keys.strings)
+    if (from.find(key) != from.end())
+      to[key].set(from[key].get_string());
+  for (auto key : keys.reals)
+    if (from.find(key) != from.end())
+      to[key].set(from[key].get_real());
+  for (auto key : keys.integers)
+    if (from.find(key) != from.end())
+      to[key].set(from[key].get_integer());
+}
+
+// Metadata of a sweep assembled into a volume, the root metadata coming
+// with the first one.
+static auto describe_sweep(
+      sweep_origin const& origin
+    , vec2z extents
+    , bool first
+    , io::odim::polar_volume& target
+    , io::odim::scan& scan
+    ) -> void
+{
+  if (!origin.file.empty()){
+    io::odim::polar_volume from{origin.file, io_mode::read_only};
+    if (first)
+      copy_metadata(from.attributes(), target.attributes(), root_keys);
+    auto from_scan = from.scan_open(0);
+    copy_metadata(from_scan.attributes(), scan.attributes(), scan_keys);
+    return;
+  }
+
+  if (first){
+    auto& root = target.attributes();
+    root["object"].set("PVOL");
+    root["source"].set(origin.source);
+    root["date"].set(origin.date);
+    root["time"].set(origin.time);
+    root["lat"].set(origin.location.lat.degrees());
+    root["lon"].set(origin.location.lon.degrees());
+    root["height"].set(origin.location.alt);
+  }
+  auto& attributes = scan.attributes();
+  attributes["product"].set("SCAN");
+  attributes["elangle"].set(origin.elevation);
+  attributes["rstart"].set((origin.range_start - 0.5 * origin.range_scale) / 1000.0);
+  attributes["rscale"].set(origin.range_scale);
+  attributes["nbins"].set(long(extents.x));
+  attributes["nrays"].set(long(extents.y));
+  attributes["a1gate"].set(0L);
+  attributes["NI"].set(origin.nyquist);
+}
+
+auto parse_output_mode(string const& name) -> output_mode{
+  if (name == "in_place")
+    return output_mode::in_place;
+  if (name == "copy")
+    return output_mode::copy;
+  if (name == "moment")
+    return output_mode::moment;
+  throw std::invalid_argument("Invalid values for parameter in configuration file ('output_mode')");
+}
+
+auto read_output_products(io::configuration const& config) -> output_products{
+  const string name = config.optional("output_product", "velocity");
+  if (name == "velocity")
+    return {true, false};
+  if (name == "fold")
+    return {false, true};
+  if (name == "both")
+    return {true, true};
+  throw std::invalid_argument("Invalid values for parameter in configuration file ('output_product')");
+}
+
+sweep_writer::sweep_writer(
+      std::filesystem::path const& input
+    , std::filesystem::path const& output
+    , output_mode mode
+    , output_encoding encoding
+    , size_t capacity
+    )
+  : input_{input}
+  , output_{output}
+  , mode_{mode}
+  , encoding_{encoding}
+  , capacity_{std::max<size_t>(capacity, 1)}
+{
+  if (mode_ != output_mode::in_place && output_.empty())
+    throw std::invalid_argument("an output file is needed unless output_mode is in_place");
+  if (mode_ != output_mode::moment && input_.empty())
+    throw std::invalid_argument("only output_mode moment assembles a volume without an input file");
+  thread_ = std::thread{[this]{ run(); }};
+}
+
+sweep_writer::~sweep_writer(){
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    done_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+auto sweep_writer::rethrow() -> void{
+  if (error_){
+    auto err = error_;
+    error_ = nullptr;
+    std::rethrow_exception(err);
+  }
+}
+
+auto sweep_writer::push(size_t scan, array2f velocity, array2<uint8_t> folds, sweep_origin origin) -> void{
+  std::unique_lock<std::mutex> lock{mutex_};
+  cv_.wait(lock, [&]{ return queue_.size() < capacity_ || error_; });
+  rethrow();
+  queue_.push_back(item{scan, std::move(velocity), std::move(folds), std::move(origin)});
+  cv_.notify_all();
+}
+
+auto sweep_writer::finish() -> void{
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    done_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  rethrow();
+}
+
+auto sweep_writer::run() -> void{
+  try{
+    // Opening the target overlaps the dealiasing of the first sweep.
+    std::unique_ptr<io::odim::polar_volume> source, target;
+    switch (mode_){
+    case output_mode::in_place:
+      target = std::make_unique<io::odim::polar_volume>(input_, io_mode::read_write);
+      break;
+    case output_mode::copy:
+      std::filesystem::copy_file(input_, output_, std::filesystem::copy_options::overwrite_existing);
+      target = std::make_unique<io::odim::polar_volume>(output_, io_mode::read_write);
+      break;
+    case output_mode::moment:
+      target = std::make_unique<io::odim::polar_volume>(output_, io_mode::create);
+      if (!input_.empty()){
+        source = std::make_unique<io::odim::polar_volume>(input_, io_mode::read_only);
+        copy_metadata(source->attributes(), target->attributes(), root_keys);
+      }
+      break;
+    }
+
+    // bom writes plain f32 datasets, anything else goes through HDF5.
+    std::unique_ptr<odim_data_writer> encoder;
+    auto encode = [&]() -> odim_data_writer&{
+      if (!encoder)
+        encoder = std::make_unique<odim_data_writer>(mode_ == output_mode::in_place ? input_ : output_);
+      return *encoder;
+    };
+    const bool plain = encoding_.type == "f32" && encoding_.deflate == 0 && !encoding_.shuffle;
+
+    // Fold indices come in long runs along a ray, chunks of whole rays
+    // deflate them well.
+    auto fold_encoding = encoding_;
+    fold_encoding.deflate = encoding_.deflate > 0 ? encoding_.deflate : 6;
+
+    while (true){
+      item next;
+      {
+        std::unique_lock<std::mutex> lock{mutex_};
+        cv_.wait(lock, [&]{ return !queue_.empty() || done_; });
+        if (queue_.empty())
+          break;
+        next = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      cv_.notify_all();
+
+      metrics::timer time{metrics::stage::write};
+      auto const& [k, data, folds, origin] = next;
+      auto scan_odim = [&]{
+        if (mode_ != output_mode::moment)
+          return target->scan_open(k);
+        auto scan = target->scan_append();
+        if (source){
+          auto from = source->scan_open(k);
+          copy_metadata(from.attributes(), scan.attributes(), scan_keys);
+        } else
+          describe_sweep(origin, data.size() > 0 ? data.extents() : folds.extents(), k == 0, *target, scan);
+        return scan;
+      }();
+
+      if (folds.size() > 0)
+        bytes_ += encode().append(k, {"VRAD_FOLD", 1.0, -double(fold_offset), fold_nodata, fold_nodata}
+          , H5T_NATIVE_UINT8, folds.data(), folds.extents().y, folds.extents().x, fold_encoding);
+      if (data.size() == 0)
+        continue;
+
+      const auto rows = data.extents().y, cols = data.extents().x;
+      if (encoding_.type == "u16"){
+        auto q = quantise(data, -9999.f);
+        bytes_ += encode().append(k, {"VRAD_DEALIAS", q.gain, q.offset, 0.0, 0.0}, H5T_NATIVE_UINT16, q.codes.data(), rows, cols, encoding_);
+        max_error_ = std::max(max_error_, q.max_error);
+        continue;
+      }
+      if (!plain){
+        bytes_ += encode().append(k, {"VRAD_DEALIAS", 1.0, 0.0, -9999.0, -9999.0}, H5T_NATIVE_FLOAT, data.data(), rows, cols, encoding_);
+        continue;
+      }
+
+      size_t dims[2] = {rows, cols};
+      auto data_odim = scan_odim.data_append(io::odim::data::data_type::f32, 2, dims);
+      data_odim.write(data.data());
+      data_odim.set_quantity("VRAD_DEALIAS");
+      data_odim.set_nodata(-9999.);
+      data_odim.set_undetect(-9999.);
+      data_odim.set_gain(1);
+      data_odim.set_offset(0);
+      bytes_ += data.size() * sizeof(float);
+    }
+  }
+  catch (...){
+    std::lock_guard<std::mutex> lock{mutex_};
+    error_ = std::current_exception();
+    queue_.clear();
+  }
+  cv_.notify_all();
+}
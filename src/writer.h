@@ -0,0 +1,96 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "pch.h"
+#include "encode.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+
+using namespace bom;
+
+// Where the dealiased moment goes: appended to the input volume, to a copy
+// of it, or alone in a new volume holding only the scan metadata.
+enum class output_mode{ in_place, copy, moment };
+
+auto parse_output_mode(string const& name) -> output_mode;
+
+// Moments written for each sweep: the dealiased velocity, its fold index
+// (see fold.h) or both.
+struct output_products{
+  bool velocity = true;
+  bool fold = false;
+};
+
+auto read_output_products(io::configuration const& config) -> output_products;
+
+// Where the metadata of a streamed sweep comes from when the writer has no
+// input volume: the first scan of its own ODIM file, or these fields when
+// the sweep came without a file.
+struct sweep_origin{
+  std::filesystem::path file;
+  string source, date, time;
+  latlonalt location;
+  double elevation, range_start, range_scale, nyquist; // deg, m, m, m/s
+};
+
+// Writes the dealiased sweeps on a background thread, fed through a bounded
+// queue so the next sweep is dealiased while this one is written. Sweeps
+// are pushed in scan order. Until finish returns only the writer thread
+// may call into HDF5. Without an input volume, in moment mode, the volume
+// is assembled from sweeps pushed with their origin.
+class sweep_writer{
+public:
+  sweep_writer(
+        std::filesystem::path const& input
+      , std::filesystem::path const& output
+      , output_mode mode
+      , output_encoding encoding = {}
+      , size_t capacity = 2
+      );
+  ~sweep_writer();
+
+  sweep_writer(sweep_writer const&) = delete;
+  auto operator=(sweep_writer const&) -> sweep_writer& = delete;
+
+  // Blocks while the queue is full. Errors of the writer are rethrown.
+  // Empty arrays are not written.
+  auto push(size_t scan, array2f velocity, array2<uint8_t> folds = {}, sweep_origin origin = {}) -> void;
+
+  // Waits for the queue to drain, rethrowing any error of the writer.
+  auto finish() -> void;
+
+  // Bytes of the written moment and the largest quantisation error, valid
+  // once finish returns.
+  auto bytes() const -> size_t { return bytes_; }
+  auto max_error() const -> float { return max_error_; }
+
+private:
+  auto run() -> void;
+  auto rethrow() -> void;
+
+  std::filesystem::path input_;
+  std::filesystem::path output_;
+  output_mode mode_;
+  output_encoding encoding_;
+  size_t capacity_;
+  size_t bytes_ = 0;
+  float max_error_ = 0.f;
+
+  struct item{
+    size_t scan;
+    array2f velocity;
+    array2<uint8_t> folds;
+    sweep_origin origin;
+  };
+  std::deque<item> queue_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool done_ = false;
+  std::exception_ptr error_;
+  std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,174 @@
+#include "check.h"
+#include "archive.h"
+
+#include <functional>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Zip archive written member by member, stored or deflated.
+class zip_builder{
+public:
+  auto add(string const& name, string const& content, bool deflated) -> void{
+    string data = content;
+    if (deflated){
+      z_stream z{};
+      deflateInit2(&z, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+      data.resize(deflateBound(&z, content.size()));
+      z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(content.data()));
+      z.avail_in = content.size();
+      z.next_out = reinterpret_cast<Bytef*>(data.data());
+      z.avail_out = data.size();
+      deflate(&z, Z_FINISH);
+      data.resize(z.total_out);
+      deflateEnd(&z);
+    }
+    const uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(content.data()), content.size());
+    const uint16_t method = deflated ? 8 : 0;
+
+    const auto offset = uint32_t(body_.size());
+    put32(body_, 0x04034b50);
+    put16(body_, 20);
+    put16(body_, 0);
+    put16(body_, method);
+    put32(body_, 0); // time and date
+    put32(body_, crc);
+    put32(body_, data.size());
+    put32(body_, content.size());
+    put16(body_, name.size());
+    put16(body_, 0);
+    body_ += name + data;
+
+    put32(directory_, 0x02014b50);
+    put16(directory_, 20);
+    put16(directory_, 20);
+    put16(directory_, 0);
+    put16(directory_, method);
+    put32(directory_, 0);
+    put32(directory_, crc);
+    put32(directory_, data.size());
+    put32(directory_, content.size());
+    put16(directory_, name.size());
+    put32(directory_, 0); // extra and comment lengths
+    put32(directory_, 0); // disk and internal attributes
+    put32(directory_, 0); // external attributes
+    put32(directory_, offset);
+    directory_ += name;
+    ++count_;
+  }
+
+  auto bytes() const -> string{
+    auto out = body_ + directory_;
+    put32(out, 0x06054b50);
+    put32(out, 0);
+    put16(out, count_);
+    put16(out, count_);
+    put32(out, directory_.size());
+    put32(out, body_.size());
+    put16(out, 0);
+    return out;
+  }
+
+private:
+  static auto put16(string& out, uint16_t v) -> void{
+    out += char(v & 0xff);
+    out += char(v >> 8);
+  }
+  static auto put32(string& out, uint32_t v) -> void{
+    put16(out, v & 0xffff);
+    put16(out, v >> 16);
+  }
+
+  string body_, directory_;
+  uint16_t count_ = 0;
+};
+
+static auto write_file(std::filesystem::path const& path, string const& bytes) -> void{
+  std::ofstream{path, std::ios::binary} << bytes;
+}
+
+static auto read_file(std::filesystem::path const& path) -> string{
+  std::ifstream in{path, std::ios::binary};
+  return string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+}
+
+static auto throws(std::function<void()> const& f) -> bool{
+  try{
+    f();
+  }
+  catch (std::runtime_error&){
+    return true;
+  }
+  return false;
+}
+
+int main(){
+  // Two volumes, compressible like ODIM data.
+  string first, second;
+  for (int i = 0; i < 200000; ++i){
+    first += char('a' + i % 7);
+    second += char(i * 31 % 251);
+  }
+
+  zip_builder zip;
+  zip.add("66_20250305_000000.pvol.h5", first, false);
+  zip.add("66_20250305_000500.pvol.h5", second, true);
+  const auto bytes = zip.bytes();
+
+  const auto dir = std::filesystem::temp_directory_path() / ("archive_test." + std::to_string(getpid()));
+  std::filesystem::create_directories(dir);
+  const auto path = dir / "66_20250305.pvol.zip";
+  write_file(path, bytes);
+
+  // Stored and deflated members come back as they went in.
+  zip_archive archive{path};
+  test::check(archive.members().size() == 2, "members of the archive");
+  if (auto m = archive.find("66_20250305_000000.pvol.h5")){
+    test::check(m->method == 0, "stored member");
+    test::check(read_file(archive.extract(*m)->path()) == first, "content of the stored member");
+  }
+  else
+    test::check(false, "stored member found");
+  if (auto m = archive.find("66_20250305_000500.pvol.h5")){
+    test::check(m->method == 8 && m->compressed < m->size, "deflated member");
+    test::check(read_file(archive.extract(*m)->path()) == second, "content of the deflated member");
+  }
+  else
+    test::check(false, "deflated member found");
+
+  // archive.zip:member inputs go through the same extraction.
+  std::unique_ptr<memory_file> holder;
+  const auto input = open_input(path.string() + ":66_20250305_000500.pvol.h5", holder);
+  test::check(read_file(input) == second, "member opened as an input");
+  test::check(throws([&]{ open_input(path.string() + ":missing.pvol.h5", holder); }), "missing member");
+
+  // A damaged member fails its checksum rather than passing as a volume.
+  auto damaged = bytes;
+  damaged[30 + 26 + 100] ^= 1; // past the local header and name of the stored member
+  write_file(path, damaged);
+  test::check(throws([&]{ zip_archive a{path}; a.extract(a.members()[0]); }), "damaged member");
+
+  // Archives cut short are rejected.
+  for (size_t size : {size_t(0), size_t(21), bytes.size() / 2, bytes.size() - 1}){
+    write_file(path, bytes.substr(0, size));
+    test::check(throws([&]{ zip_archive a{path}; }), "truncated archive");
+  }
+
+  // Memory files of a process that is gone are removed, those of a live
+  // one are kept.
+  const auto child = fork();
+  if (child == 0)
+    _exit(0);
+  waitpid(child, nullptr, 0);
+  const auto stale = std::filesystem::path{"/dev/shm"} / ("vad-dealias-" + std::to_string(child) + "-abcdef-66_20250305_000000.pvol.h5");
+  write_file(stale, first);
+  {
+    memory_file live{"66_20250305_000500.pvol.h5", second.data(), second.size()};
+    test::check(remove_stale_memory_files() >= 1, "stale memory files removed");
+    test::check(!std::filesystem::exists(stale), "memory file of an exited process removed");
+    test::check(std::filesystem::exists(live.path()), "memory file of a live process kept");
+  }
+
+  std::filesystem::remove_all(dir);
+  return test::result();
+}
@@ -0,0 +1,82 @@
+#include "check.h"
+#include "brox/brox_optic_flow.h"
+
+#include <chrono>
+
+constexpr int nx = 301, ny = 301;
+
+// Echoes moving by (3.1, -1.8) pixels from one frame to the next.
+static auto frame(int step) -> std::vector<float>{
+  const float cx[] = {30, 70, 100, 150, 200, 250}, cy[] = {40, 20, 60, 170, 220, 100}, r[] = {8, 12, 6, 10, 20, 15};
+  std::vector<float> image(nx * ny);
+  for (int y = 0; y < ny; ++y){
+    for (int x = 0; x < nx; ++x){
+      float s = 0.f;
+      for (int k = 0; k < 6; ++k){
+        const auto dx = x - 3.1f * step - cx[k], dy = y + 1.8f * step - cy[k];
+        s += 40.f * std::exp(-(dx * dx + dy * dy) / (r[k] * r[k]));
+      }
+      image[y * nx + x] = s;
+    }
+  }
+  return image;
+}
+
+// Mean distance to the true motion over the echoes.
+static auto flow_error(std::vector<float> const& image, std::vector<float> const& u, std::vector<float> const& v) -> double{
+  double sum = 0.0;
+  int n = 0;
+  for (size_t i = 0; i < image.size(); ++i){
+    if (image[i] > 1.f){
+      sum += std::hypot(u[i] - 3.1, v[i] + 1.8);
+      ++n;
+    }
+  }
+  return n > 0 ? sum / n : 0.0;
+}
+
+int main(){
+  const auto I0 = frame(0), I1 = frame(1), I2 = frame(2);
+  const float alpha = 80, gamma = 7, nu = 0.5, tol = 0.005;
+  const int scales = 100, inner = 3, outer = 12;
+
+  // The flow of the previous time step is the prior.
+  std::vector<float> prior_u(nx * ny, 0.f), prior_v(nx * ny, 0.f);
+  brox_optic_flow(I0.data(), I1.data(), prior_u.data(), prior_v.data(), nx, ny, alpha, gamma, scales, nu, tol, inner, outer, false);
+
+  // Best of a few runs of each, against the noise of a shared machine.
+  std::vector<float> cold_u, cold_v, warm_u, warm_v;
+  brox_stats cold{}, warmed{};
+  const brox_warm_start warm{1, 3};
+  double cold_time = 1e9, warm_time = 1e9;
+  for (int run = 0; run < 3; ++run){
+    cold_u.assign(nx * ny, 0.f);
+    cold_v.assign(nx * ny, 0.f);
+    auto start = std::chrono::steady_clock::now();
+    brox_optic_flow(I1.data(), I2.data(), cold_u.data(), cold_v.data(), nx, ny, alpha, gamma, scales, nu, tol, inner, outer, false, nullptr, &cold);
+    cold_time = std::min(cold_time, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    warm_u = prior_u;
+    warm_v = prior_v;
+    start = std::chrono::steady_clock::now();
+    brox_optic_flow(I1.data(), I2.data(), warm_u.data(), warm_v.data(), nx, ny, alpha, gamma, scales, nu, tol, inner, outer, false, &warm, &warmed);
+    warm_time = std::min(warm_time, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  const auto cold_error = flow_error(I1, cold_u, cold_v), warm_error = flow_error(I1, warm_u, warm_v);
+  std::cout << "cold start: " << cold_time << " s, " << cold.scales << " scales, " << cold.outer_iter << " outer iterations, "
+            << cold.linear_iter << " solver iterations, error " << cold_error << " px" << std::endl;
+  std::cout << "warm start: " << warm_time << " s, " << warmed.scales << " scales, " << warmed.outer_iter << " outer iterations, "
+            << warmed.linear_iter << " solver iterations, error " << warm_error << " px" << std::endl;
+  std::cout << "speed-up " << cold_time / warm_time << std::endl;
+
+  // The finest scale only, with a fraction of the iterations and of the
+  // time, for a flow as good.
+  test::check(warmed.scales == 1, "warm start on the finest scale only");
+  test::check(warmed.outer_iter < cold.outer_iter / 4, "a fraction of the outer iterations");
+  test::check(warmed.linear_iter < cold.linear_iter / 2, "less than half the solver iterations");
+  test::check(warm_time < cold_time / 2, "warm start at least twice as fast");
+  test::check_near(warm_error, 0.0, cold_error + 0.01, "flow of the warm start as good as the cold one");
+
+  return test::result();
+}
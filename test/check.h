@@ -0,0 +1,36 @@
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+// Checks of the tests run by ctest. A failed check is reported and the test
+// goes on, its exit status telling whether any failed.
+namespace test{
+  inline int failures = 0;
+
+  inline auto check(bool ok, char const* what) -> bool{
+    if (!ok){
+      std::cerr << "FAILED: " << what << std::endl;
+      ++failures;
+    }
+    return ok;
+  }
+
+  inline auto check_near(double value, double expected, double tolerance, char const* what) -> bool{
+    if (std::fabs(value - expected) <= tolerance)
+      return true;
+    std::cerr << "FAILED: " << what << ", " << value << " is not within " << tolerance << " of " << expected << std::endl;
+    ++failures;
+    return false;
+  }
+
+  inline auto result() -> int{
+    if (failures > 0)
+      std::cerr << failures << " checks failed" << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+}
+
+#endif
@@ -0,0 +1,64 @@
+#include "check.h"
+#include "encode.h"
+
+#include <random>
+
+static auto decode(quantised_sweep const& q, size_t i) -> double{
+  return q.gain * q.codes[i] + q.offset;
+}
+
+int main(){
+  const float missing = -9999.f;
+
+  // A dealiased sweep with folds of +-2 times a 13 m/s Nyquist velocity and
+  // missing gates, NaN or flagged.
+  const size_t nbins = 1000, nrays = 360;
+  array2f data{vec2z{nbins, nrays}};
+  std::mt19937 rng{7};
+  std::uniform_real_distribution<float> velocity{-65.f, 65.f};
+  for (size_t j = 0; j < nrays; ++j)
+    for (size_t i = 0; i < nbins; ++i)
+      data[j][i] = i % 13 == 0 ? missing : i % 17 == 0 ? nodata : velocity(rng);
+
+  const auto q = quantise(data, missing);
+  test::check(q.codes.size() == data.size(), "a code per gate");
+  test::check(q.max_error <= q.gain / 2 + 1e-5, "largest error of at most half the gain");
+
+  float lo = std::numeric_limits<float>::max(), hi = std::numeric_limits<float>::lowest();
+  int wrong = 0, missed = 0;
+  for (size_t i = 0; i < data.size(); ++i){
+    const auto v = data.data()[i];
+    if (v == missing || std::isnan(v)){
+      missed += q.codes[i] != 0;
+      continue;
+    }
+    lo = std::min(lo, v);
+    hi = std::max(hi, v);
+    wrong += std::fabs(decode(q, i) - v) > q.gain / 2 + 1e-5 * std::fabs(v);
+  }
+  test::check(wrong == 0, "every value decoded within half the gain");
+  test::check(missed == 0, "missing gates coded 0");
+  test::check_near(q.gain, (hi - lo) / 65534.0, 1e-9, "gain spread over the codes 1 to 65535");
+
+  // The extremes take the first and last codes.
+  const auto first = std::min_element(q.codes.begin(), q.codes.end(), [](uint16_t a, uint16_t b){ return (a ? a : 65536) < (b ? b : 65536); });
+  const auto last = std::max_element(q.codes.begin(), q.codes.end());
+  test::check(*first == 1 && *last == 65535, "extremes on codes 1 and 65535");
+
+  // A sweep of one value decodes to that value exactly.
+  array2f flat{vec2z{10, 10}};
+  flat.fill(4.5f);
+  flat[3][3] = missing;
+  const auto f = quantise(flat, missing);
+  test::check(f.codes[33] == 0, "missing gate of a flat sweep coded 0");
+  test::check_near(decode(f, 0), 4.5, 0.0, "value of a flat sweep");
+  test::check(f.max_error == 0.f, "no error on a flat sweep");
+
+  // Nothing to code in a sweep without values.
+  array2f empty{vec2z{10, 10}};
+  empty.fill(missing);
+  const auto e = quantise(empty, missing);
+  test::check(std::all_of(e.codes.begin(), e.codes.end(), [](uint16_t c){ return c == 0; }), "sweep without values coded 0");
+
+  return test::result();
+}
@@ -0,0 +1,99 @@
+#include "check.h"
+#include "fold.h"
+#include "gate_bits.h"
+
+constexpr size_t nbins = 300, nrays = 90;
+constexpr float nyquist = 12.f;
+
+// Raw moment folded into +-nyquist, every 17th bin missing, packed as ODIM
+// stores it in 8 or 16 bits, or decoded (bits 0).
+static auto raw_sweep(int bits) -> sweep{
+  sweep swp;
+  swp.bins.slant_range.resize(nbins);
+  swp.rays.azimuth.resize(nrays);
+  if (bits == 16){
+    swp.packed.raw = array2<uint16_t>{vec2z{nbins, nrays}};
+    swp.packed.gain = 0.01f;
+    swp.packed.offset = -327.68f;
+  }
+  else if (bits == 8){
+    swp.packed.raw8 = array2<uint8_t>{vec2z{nbins, nrays}};
+    swp.packed.gain = 0.1f;
+    swp.packed.offset = -12.8f;
+  }
+  else
+    swp.data = array2f{vec2z{nbins, nrays}};
+
+  for (size_t j = 0; j < nrays; ++j){
+    for (size_t i = 0; i < nbins; ++i){
+      const auto v = std::fmod(i * 0.37f + j, 2 * nyquist) - nyquist;
+      const auto code = i % 17 == 0 ? 0 : std::lround((v - swp.packed.offset) / swp.packed.gain);
+      if (bits == 16)
+        swp.packed.raw[j][i] = code;
+      else if (bits == 8)
+        swp.packed.raw8[j][i] = code;
+      else
+        swp.data[j][i] = i % 17 == 0 ? nodata : v;
+    }
+  }
+  build_gate_bits(swp, undetect);
+  return swp;
+}
+
+// Fold index codes as VRAD_FOLD is read back, gain 1 and offset -128.
+static auto fold_sweep(array2<uint8_t> const& folds) -> sweep{
+  sweep swp;
+  swp.bins.slant_range.resize(nbins);
+  swp.rays.azimuth.resize(nrays);
+  swp.packed.raw = array2<uint16_t>{folds.extents()};
+  swp.packed.gain = 1.f;
+  swp.packed.offset = -fold_offset;
+  swp.packed.nodata = fold_nodata;
+  swp.packed.undetect = fold_nodata;
+  for (size_t i = 0; i < folds.size(); ++i)
+    swp.packed.raw.data()[i] = folds.data()[i];
+  build_gate_bits(swp, nodata);
+  return swp;
+}
+
+static auto check_round_trip(int bits, char const* what) -> void{
+  const auto raw = raw_sweep(bits);
+  const auto velocity = unpack(raw);
+
+  // Folds from -3 to +4 along the ray, -9999 where the raw moment is missing.
+  array2f dealiased{vec2z{nbins, nrays}};
+  for (size_t j = 0; j < nrays; ++j)
+    for (size_t i = 0; i < nbins; ++i)
+      dealiased[j][i] = i % 17 == 0 ? -9999.f : velocity[j][i] + (int(i / 40) - 3) * nyquist;
+
+  const auto folds = fold_index(dealiased, raw, nyquist, -9999.f);
+  const auto rebuilt = rebuild_velocity(raw, fold_sweep(folds), nyquist);
+
+  int wrong = 0;
+  for (size_t j = 0; j < nrays; ++j){
+    for (size_t i = 0; i < nbins; ++i){
+      if (i % 17 == 0)
+        wrong += folds[j][i] != fold_nodata || !std::isnan(rebuilt[j][i]);
+      else
+        wrong += std::fabs(rebuilt[j][i] - dealiased[j][i]) > 1e-4f;
+    }
+  }
+  test::check(wrong == 0, what);
+}
+
+int main(){
+  check_round_trip(0, "fold index round trip of a decoded moment");
+  check_round_trip(16, "fold index round trip of a packed moment");
+  check_round_trip(8, "fold index round trip of an 8-bit moment");
+
+  // 8-bit codes stay 8-bit.
+  const auto raw8 = raw_sweep(8);
+  test::check(is_packed(raw8) && raw8.packed.raw.size() == 0 && sweep_extents(raw8).x == nbins, "8-bit moment kept packed at its width");
+
+  // Without a Nyquist velocity there is no fold to store.
+  const auto raw = raw_sweep(0);
+  const auto folds = fold_index(unpack(raw), raw, 0.f, -9999.f);
+  test::check(std::all_of(folds.data(), folds.data() + folds.size(), [](uint8_t n){ return n == fold_nodata; }), "fold index without a Nyquist velocity");
+
+  return test::result();
+}
@@ -0,0 +1,107 @@
+#include "check.h"
+#include "tracking.h"
+#include "gate_bits.h"
+#include "geometry.h"
+#include "metrics.h"
+
+#include <regex>
+
+// Grid of 61 x 61 km around the radar and two layers, tracked on one thread.
+static const char* config_text = R"(
+proj4 "+proj=aeqd +lat_0=-27.7178 +lon_0=153.24 +units=m +ellps=WGS84"
+size "61 61"
+left_top "-30500 30500"
+cell_delta "1000 -1000"
+altitude_base 500.0
+altitude_step 500.0
+layer_count 2
+max_alt_dist 20000
+idw_pwr 2.0
+min_dbz 20
+threads 1
+optical_flow
+{
+  alpha 80
+  gamma 7.0
+  scales 100
+  zfactor 0.5
+  tol 0.005
+  initer 3
+  outiter 12
+}
+)";
+
+// Volume of time step t, a storm moving 2 km east from one step to the next.
+static auto synthetic_volume(int t) -> radarset{
+  const float elevations[] = {0.5f, 1.5f, 3.f, 6.f};
+  const size_t nbins = 160, nrays = 360;
+
+  radarset dset;
+  dset.source = "WMO:94580";
+  dset.date = "20250305";
+  dset.time = "00" + std::to_string(10 + 5 * t) + "00";
+  dset.beamwidth = 1.f;
+  dset.dbzh.location = latlonalt{-27.7178 * 1_deg, 153.24 * 1_deg, 0.0};
+  for (auto elevation : elevations){
+    sweep swp;
+    swp.beam = radar::beam_propagation{0.f, elevation * 1_deg};
+    vector<float> slant_range(nbins);
+    for (size_t i = 0; i < nbins; ++i)
+      slant_range[i] = (i + 0.5f) * 250.f;
+    vector<angle> azimuth(nrays);
+    for (size_t j = 0; j < nrays; ++j)
+      azimuth[j] = (j + 0.5) * 1_deg;
+    set_geometry(swp, slant_range, azimuth);
+
+    swp.data = array2f{vec2z{nbins, nrays}};
+    for (size_t j = 0; j < nrays; ++j){
+      for (size_t i = 0; i < nbins; ++i){
+        const double g = swp.bins.ground_range[i];
+        const double x = g * swp.rays.sin_az[j] - 2000.0 * t - 12000.0, y = g * swp.rays.cos_az[j] - 9000.0;
+        swp.data[j][i] = 50.0 * std::exp(-(x * x + y * y) / (6000.0 * 6000.0));
+      }
+    }
+    build_gate_bits(swp, undetect);
+    dset.dbzh.sweeps.push_back(std::move(swp));
+  }
+  return dset;
+}
+
+// Hits of the CAPPI frame cache so far, from the metrics exposition.
+static auto cappi_hits() -> long{
+  const auto text = metrics::render({});
+  std::smatch match;
+  if (!std::regex_search(text, match, std::regex{R"re(vad_dealias_cache_lookups_total\{cache="cappi_frame",result="hit"\} (\d+))re"}))
+    return -1;
+  return std::stol(match[1]);
+}
+
+int main(){
+  auto config = io::configuration{std::istringstream{config_text}};
+  const size_t layers = 2;
+
+  // A series of two pairs, (t0, t1) then (t1, t2), as the reprocessing and
+  // the daemon track it.
+  const auto t0 = synthetic_volume(0), t1 = synthetic_volume(1), t2 = synthetic_volume(2);
+  frame_cache frames{4};
+
+  const auto before = cappi_hits();
+  test::check(before == 0, "no frame cache hit before tracking");
+  const auto first = track_layers(config, t0, t1, nullptr, &frames);
+  test::check(cappi_hits() == before, "no frame cache hit on the first pair");
+
+  // The frames of t1 built as the second image of the first pair are the
+  // first image of the second one.
+  const auto second = track_layers(config, t1, t2, &first, &frames);
+  test::check(cappi_hits() - before == long(layers), "frames of the middle volume reused by the second pair");
+
+  // The flow follows the storm east, 2 pixels a step.
+  const auto npix = second.extents.x * second.extents.y;
+  const auto centre = size_t(30 - 9) * second.extents.x + 30 + 14;
+  for (size_t l = 0; l < layers; ++l){
+    test::check_near(second.u[l * npix + centre], 2.0, 0.5, "eastward flow at the storm");
+    test::check_near(second.v[l * npix + centre], 0.0, 0.5, "no northward flow at the storm");
+  }
+
+  return test::result();
+}
@@ -0,0 +1,108 @@
+#include "check.h"
+#include "vad.h"
+#include "gate_bits.h"
+#include "geometry.h"
+
+#include <iterator>
+
+// Wind of the synthetic volume, the model fitted by retrieve_vad.
+struct wind{
+  double u0, v0, c, div, det, des;
+};
+
+// Volume of the wind alone, folded into +-nyquist, every seventh bin
+// missing.
+static auto synthetic_volume(wind const& w, float nyquist) -> radarset{
+  const float elevations[] = {0.5f, 1.5f, 3.f, 6.f, 10.f};
+  const size_t nbins = 400, nrays = 360;
+
+  radarset dset;
+  dset.nyquist = array1f{std::size(elevations)};
+  dset.elevation = array1f{std::size(elevations)};
+  for (size_t k = 0; k < std::size(elevations); ++k){
+    dset.nyquist[k] = nyquist;
+    dset.elevation[k] = elevations[k];
+
+    sweep swp;
+    swp.beam = radar::beam_propagation{0.f, elevations[k] * 1_deg};
+    vector<float> slant_range(nbins);
+    for (size_t i = 0; i < nbins; ++i)
+      slant_range[i] = (i + 0.5f) * 250.f;
+    vector<angle> azimuth(nrays);
+    for (size_t j = 0; j < nrays; ++j)
+      azimuth[j] = (j + 0.5) * 1_deg;
+    set_geometry(swp, slant_range, azimuth);
+
+    swp.data = array2f{vec2z{nbins, nrays}};
+    for (size_t j = 0; j < nrays; ++j){
+      const double az = azimuth[j].radians();
+      for (size_t i = 0; i < nbins; ++i){
+        const double r = swp.bins.ground_range[i] * 0.001;
+        auto v = (w.u0 * std::sin(az) + w.v0 * std::cos(az)) * swp.cos_el + w.c * swp.sin_el
+          + 500.0 * r * swp.cos_el * (w.div - w.det * std::cos(2 * az) + w.des * std::sin(2 * az));
+        v -= 2 * nyquist * std::floor((v + nyquist) / (2 * nyquist));
+        swp.data[j][i] = i % 7 == 0 ? nodata : v;
+      }
+    }
+    build_gate_bits(swp, undetect);
+    dset.vradh.sweeps.push_back(std::move(swp));
+  }
+  return dset;
+}
+
+// Sweep k of a volume alone, as the low memory loader gives it.
+static auto single_sweep(radarset const& dset, size_t k) -> radarset{
+  radarset one;
+  one.vradh.location = dset.vradh.location;
+  one.vradh.sweeps.push_back(dset.vradh.sweeps[k]);
+  one.nyquist = array1f{1};
+  one.nyquist[0] = dset.nyquist[k];
+  one.elevation = array1f{1};
+  one.elevation[0] = dset.elevation[k];
+  return one;
+}
+
+static auto check_profile(vadset const& profile, wind const& w, char const* what) -> void{
+  int fitted = 0;
+  for (size_t l = 0; l < profile.z.size(); ++l){
+    if (std::isnan(profile.u0[l]))
+      continue;
+    ++fitted;
+    test::check_near(profile.u0[l], w.u0, 0.01, what);
+    test::check_near(profile.v0[l], w.v0, 0.01, what);
+    test::check_near(profile.div[l], w.div, 0.01 * std::fabs(w.div), what);
+    test::check_near(profile.det[l], w.det, 0.01 * std::fabs(w.det), what);
+    test::check_near(profile.des[l], w.des, 0.01 * std::fabs(w.des), what);
+  }
+  test::check(fitted >= 10, what);
+}
+
+int main(){
+  // div, det and des in 1/s, as the layer fit has them.
+  const wind w{-5.0, 24.0, -6.0, 2.5e-5, 5e-5, 9e-5};
+  const auto dset = synthetic_volume(w, 13.f);
+  auto config = io::configuration{std::istringstream{"threads 2\n"}};
+
+  // The wind is recovered through the folds.
+  const auto whole = retrieve_vad(config, dset);
+  check_profile(whole, w, "fit of the whole volume");
+
+  // Loading the sweeps one at a time gives the same fit.
+  const auto loaded = retrieve_vad(config, dset.vradh.sweeps.size(), [&](size_t k){ return single_sweep(dset, k); });
+  for (size_t l = 0; l < whole.z.size(); ++l){
+    test::check(whole.npts[l] == loaded.npts[l], "gates of the fit of the loaded sweeps");
+    if (!std::isnan(whole.u0[l])){
+      test::check_near(loaded.u0[l], whole.u0[l], 1e-4, "u0 of the fit of the loaded sweeps");
+      test::check_near(loaded.v0[l], whole.v0[l], 1e-4, "v0 of the fit of the loaded sweeps");
+    }
+  }
+
+  // Streamed sweeps, each added to the normal equations of the ones before.
+  incremental_vad streamed{config};
+  vadset last;
+  for (size_t k = 0; k < dset.vradh.sweeps.size(); ++k)
+    last = streamed.add(single_sweep(dset, k));
+  check_profile(last, w, "fit of the streamed sweeps");
+
+  return test::result();
+}